@@ -6,6 +6,10 @@
 
 #include "adler32memcpy.h"
 
+#if defined(STRESSAPPTEST_CPU_X86_64) || defined(STRESSAPPTEST_CPU_I686)
+#include <emmintrin.h>
+#endif
+
 // We are using (a modified form of) adler-32 checksum algorithm instead
 // of CRC since adler-32 is faster than CRC.
 // (Comparison: http://guru.multimedia.cx/crc32-vs-adler32/)
@@ -113,6 +117,43 @@ bool CalculateAdlerChecksum(uint64 *data64, unsigned int size_in_bytes,
   return true;
 }
 
+// SSE2 implementation of the Adler checksum, for reading memory as fast as
+// possible.  Each 128 bit lane pair holds the a1/a2 and b1/b2 streams, which
+// take the low and then the high 32 bit word of alternate 64 bit words, as in
+// the C implementation.
+bool CalculateAdlerChecksumAsm(uint64 *data64, unsigned int size_in_bytes,
+                               AdlerChecksum *checksum) {
+#if defined(STRESSAPPTEST_CPU_X86_64) || defined(STRESSAPPTEST_CPU_I686)
+  if ((size_in_bytes >> 19) > 0) {
+    // Size is too large. Must be less than 2^19 bytes = 512 KB.
+    return false;
+  }
+  if (size_in_bytes % sizeof(__m128i))
+    return CalculateAdlerChecksum(data64, size_in_bytes, checksum);
+
+  const __m128i low_words = _mm_set_epi32(0, -1, 0, -1);
+  __m128i a = _mm_set_epi64x(1, 1);
+  __m128i b = _mm_setzero_si128();
+  const __m128i *data = reinterpret_cast<const __m128i *>(data64);
+  unsigned int count = size_in_bytes / sizeof(__m128i);
+  for (unsigned int i = 0; i < count; i++) {
+    __m128i words = _mm_loadu_si128(data + i);
+    a = _mm_add_epi64(a, _mm_and_si128(words, low_words));
+    b = _mm_add_epi64(b, a);
+    a = _mm_add_epi64(a, _mm_srli_epi64(words, 32));
+    b = _mm_add_epi64(b, a);
+  }
+
+  uint64 sums[4] __attribute__((aligned(16)));
+  _mm_store_si128(reinterpret_cast<__m128i *>(&sums[0]), a);
+  _mm_store_si128(reinterpret_cast<__m128i *>(&sums[2]), b);
+  checksum->Set(sums[0], sums[1], sums[2], sums[3]);
+  return true;
+#else
+  return CalculateAdlerChecksum(data64, size_in_bytes, checksum);
+#endif
+}
+
 // C implementation of Adler memory copy.
 bool AdlerMemcpyC(uint64 *dstmem64, uint64 *srcmem64,
                   unsigned int size_in_bytes, AdlerChecksum *checksum) {
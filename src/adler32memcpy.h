@@ -35,6 +35,11 @@ class AdlerChecksum {
 bool CalculateAdlerChecksum(uint64 *data64, unsigned int size_in_bytes,
                             AdlerChecksum *checksum);
 
+// SSE2 implementation of CalculateAdlerChecksum(), with the same result.
+// Falls back to it on other cpus.
+bool CalculateAdlerChecksumAsm(uint64 *data64, unsigned int size_in_bytes,
+                               AdlerChecksum *checksum);
+
 // C implementation of Adler memory copy.
 bool AdlerMemcpyC(uint64 *dstmem64, uint64 *srcmem64,
                   unsigned int size_in_bytes, AdlerChecksum *checksum);
@@ -10,6 +10,8 @@
 // so these includes are correct.
 #include "disk_blocks.h"
 
+#include <algorithm>
+#include <new>
 #include <utility>
 
 #include "absl/strings/str_format.h"
@@ -25,39 +27,41 @@ BlockData::BlockData()
       size_(0),
       references_(0),
       initialized_(false),
-      pattern_(NULL) {
-  pthread_mutex_init(&data_mutex_, NULL);
-}
+      pattern_(NULL),
+      index_(-1),
+      position_(-1) {}
 
-BlockData::~BlockData() { pthread_mutex_destroy(&data_mutex_); }
+BlockData::~BlockData() {}
 
 void BlockData::set_initialized() {
-  pthread_mutex_lock(&data_mutex_);
-  initialized_ = true;
-  pthread_mutex_unlock(&data_mutex_);
+  initialized_.store(true, std::memory_order_release);
 }
 
 bool BlockData::initialized() const {
-  pthread_mutex_lock(&data_mutex_);
-  bool initialized = initialized_;
-  pthread_mutex_unlock(&data_mutex_);
-  return initialized;
+  return initialized_.load(std::memory_order_acquire);
 }
 
 // DiskBlockTable
 DiskBlockTable::DiskBlockTable()
-    : sector_size_(0),
+    : bitmap_words_(0),
+      device_blocks_(0),
+      num_segments_(0),
+      size_(0),
+      sector_size_(0),
       write_block_size_(0),
       device_name_(""),
       device_sectors_(0),
-      segment_size_(0),
-      size_(0) {
+      segment_size_(0) {
+  for (int i = 0; i < kShards; i++) pthread_mutex_init(&shards_[i].mutex, NULL);
+  pthread_mutex_init(&slab_mutex_, NULL);
   pthread_mutex_init(&data_mutex_, NULL);
   pthread_mutex_init(&parameter_mutex_, NULL);
   pthread_cond_init(&data_condition_, NULL);
 }
 
 DiskBlockTable::~DiskBlockTable() {
+  for (int i = 0; i < kShards; i++) pthread_mutex_destroy(&shards_[i].mutex);
+  pthread_mutex_destroy(&slab_mutex_);
   pthread_mutex_destroy(&data_mutex_);
   pthread_mutex_destroy(&parameter_mutex_);
   pthread_cond_destroy(&data_condition_);
@@ -75,110 +79,107 @@ int64 DiskBlockTable::Random64() {
     return -x;
 }
 
-uint64 DiskBlockTable::Size() {
-  pthread_mutex_lock(&data_mutex_);
-  uint64 size = size_;
-  pthread_mutex_unlock(&data_mutex_);
-  return size;
-}
+uint64 DiskBlockTable::Size() { return size_; }
 
-void DiskBlockTable::InsertOnStructure(BlockData *block) {
-  int64 address = block->address();
-  StorageData *sd = new StorageData();
-  sd->block = block;
-  sd->pos = size_;
-  // Creating new block ...
-  pthread_mutex_lock(&data_mutex_);
-  if (pos_to_addr_.size() <= size_) {
-    pos_to_addr_.insert(pos_to_addr_.end(), address);
-  } else {
-    pos_to_addr_[size_] = address;
+// Find the blocks lying entirely within a segment.
+void DiskBlockTable::SegmentBlocks(int64 segment, int64 *first,
+                                   int64 *last) const {
+  if (segment_size_ <= 0) {
+    *first = 0;
+    *last = device_blocks_;
+    return;
   }
-  addr_to_block_[address] = sd;
-  size_++;
-  pthread_cond_broadcast(&data_condition_);
-  pthread_mutex_unlock(&data_mutex_);
+  int64 sectors_per_block = write_block_size_ / sector_size_;
+  *first = (segment * segment_size_ + sectors_per_block - 1) /
+           sectors_per_block;
+  *last = std::min((segment + 1) * segment_size_ / sectors_per_block,
+                   device_blocks_);
+}
+
+// Find the segment a block starts in.
+int64 DiskBlockTable::BlockSegment(int64 index) const {
+  if (segment_size_ <= 0) return 0;
+  return index * (write_block_size_ / sector_size_) / segment_size_;
 }
 
 int DiskBlockTable::RemoveBlock(BlockData *block) {
-  // For write threads, check the reference counter and remove
-  // it from the structure.
-  int64 address = block->address();
-  AddrToBlockMap::iterator it = addr_to_block_.find(address);
-  int ret = 1;
-  if (it != addr_to_block_.end()) {
-    int curr_pos = it->second->pos;
-    int last_pos = size_ - 1;
-    AddrToBlockMap::iterator last_it =
-        addr_to_block_.find(pos_to_addr_[last_pos]);
-    sat_assert(size_ > 0);
-    sat_assert(last_it != addr_to_block_.end());
-    // Everything is fine, removing block from table.
-    pthread_mutex_lock(&data_mutex_);
-    pos_to_addr_[curr_pos] = pos_to_addr_[last_pos];
-    last_it->second->pos = curr_pos;
-    delete it->second;
-    addr_to_block_.erase(it);
-    size_--;
-    block->DecreaseReferenceCounter();
-    if (block->GetReferenceCounter() == 0)
-      delete block;
-    else if (block->GetReferenceCounter() < 0)
-      ret = 0;
-    pthread_cond_broadcast(&data_condition_);
-    pthread_mutex_unlock(&data_mutex_);
-  } else {
-    ret = 0;
+  // For write threads, take the block out of reach of random threads,
+  // then drop the write thread's reference.
+  Shard &shard = shards_[block->index_ % kShards];
+  pthread_mutex_lock(&shard.mutex);
+  if (block->position_ < 0) {
+    pthread_mutex_unlock(&shard.mutex);
+    return 0;
   }
-  return ret;
+  BlockData *last = shard.blocks.back();
+  shard.blocks[block->position_] = last;
+  last->position_ = block->position_;
+  shard.blocks.pop_back();
+  block->position_ = -1;
+  pthread_mutex_unlock(&shard.mutex);
+  size_--;
+
+  // Random threads still reading the block keep its sectors reserved
+  // until the last of them releases it.
+  int references = block->DecreaseReferenceCounter();
+  if (references == 0)
+    FreeBlock(block);
+  else if (references < 0)
+    return 0;
+  return 1;
 }
 
 int DiskBlockTable::ReleaseBlock(BlockData *block) {
   // If caller is a random thread, just check the reference counter.
-  int ret = 1;
-  pthread_mutex_lock(&data_mutex_);
-  int references = block->GetReferenceCounter();
-  if (references == 1)
-    delete block;
-  else if (references > 0)
-    block->DecreaseReferenceCounter();
-  else
-    ret = 0;
-  pthread_mutex_unlock(&data_mutex_);
-  return ret;
+  int references = block->DecreaseReferenceCounter();
+  if (references == 0) {
+    // The write thread already removed it.
+    FreeBlock(block);
+  } else if (references < 0) {
+    return 0;
+  }
+  return 1;
 }
 
 BlockData *DiskBlockTable::GetRandomBlock() {
-  struct timespec ts;
-  struct timeval tp;
-  gettimeofday(&tp, NULL);
-  ts.tv_sec = tp.tv_sec;
-  ts.tv_nsec = tp.tv_usec * 1000;
-  ts.tv_sec += 2;  // Wait for 2 seconds.
-  int result = 0;
-  pthread_mutex_lock(&data_mutex_);
-  while (!size_ && result != ETIMEDOUT) {
-    result = pthread_cond_timedwait(&data_condition_, &data_mutex_, &ts);
-  }
-  if (result == ETIMEDOUT) {
+  if (size_ == 0) {
+    struct timespec ts;
+    struct timeval tp;
+    gettimeofday(&tp, NULL);
+    ts.tv_sec = tp.tv_sec;
+    ts.tv_nsec = tp.tv_usec * 1000;
+    ts.tv_sec += 2;  // Wait for 2 seconds.
+    int result = 0;
+    pthread_mutex_lock(&data_mutex_);
+    while (!size_ && result != ETIMEDOUT) {
+      result = pthread_cond_timedwait(&data_condition_, &data_mutex_, &ts);
+    }
     pthread_mutex_unlock(&data_mutex_);
-    return NULL;
-  } else {
-    int64 random_number = Random64();
-    int64 random_pos = random_number % size_;
-    int64 address = pos_to_addr_[random_pos];
-    AddrToBlockMap::const_iterator it = addr_to_block_.find(address);
-    sat_assert(it != addr_to_block_.end());
-    BlockData *b = it->second->block;
+    if (result == ETIMEDOUT) return NULL;
+  }
+
+  // Start at a random shard, and pick a random block from the first one
+  // that has any.
+  int64 first_shard = Random64() % kShards;
+  int64 random_number = Random64();
+  for (int i = 0; i < kShards; i++) {
+    Shard &shard = shards_[(first_shard + i) % kShards];
+    pthread_mutex_lock(&shard.mutex);
+    if (shard.blocks.empty()) {
+      pthread_mutex_unlock(&shard.mutex);
+      continue;
+    }
+    BlockData *b = shard.blocks[random_number % shard.blocks.size()];
     // A block is returned only if its content is written on disk.
     if (b->initialized()) {
       b->IncreaseReferenceCounter();
     } else {
       b = NULL;
     }
-    pthread_mutex_unlock(&data_mutex_);
+    pthread_mutex_unlock(&shard.mutex);
     return b;
   }
+  return NULL;
 }
 
 void DiskBlockTable::SetParameters(int sector_size, int write_block_size,
@@ -191,13 +192,113 @@ void DiskBlockTable::SetParameters(int sector_size, int write_block_size,
   device_sectors_ = device_sectors;
   segment_size_ = segment_size;
   device_name_ = device_name;
+
+  // Size the bitmap for the device.  Bits past the last block are left
+  // set so that they are never handed out.
+  device_blocks_ = 0;
+  if (sector_size_ > 0 && write_block_size_ >= sector_size_)
+    device_blocks_ = device_sectors_ / (write_block_size_ / sector_size_);
+  bitmap_words_ = (device_blocks_ + 63) / 64;
+  bitmap_.reset(new std::atomic<uint64>[bitmap_words_]);
+  for (int64 i = 0; i < bitmap_words_; i++) bitmap_[i] = 0;
+  if (device_blocks_ % 64) {
+    bitmap_[bitmap_words_ - 1] = ~0ULL << (device_blocks_ % 64);
+  }
+
+  num_segments_ = 1;
+  if (segment_size_ > 0) {
+    num_segments_ = device_sectors_ / segment_size_;
+    if (device_sectors_ % segment_size_ != 0) num_segments_++;
+  }
+  segment_free_.reset(new std::atomic<int64>[num_segments_]);
+  for (int64 segment = 0; segment < num_segments_; segment++) {
+    int64 first, last;
+    SegmentBlocks(segment, &first, &last);
+    segment_free_[segment] = std::max(last - first, 0LL);
+  }
   pthread_mutex_unlock(&parameter_mutex_);
 }
 
+// Try to claim a free block between 'first' and 'last', starting at a
+// random one and moving up a bitmap word at a time.
+// Returns the index of the block, or -1 if all blocks are in use.
+int64 DiskBlockTable::ClaimBlock(int64 first, int64 last) {
+  int64 count = last - first;
+  if (count <= 0) return -1;
+
+  int64 index = first + Random64() % count;
+  int64 scanned = 0;
+  while (scanned <= count) {
+    int64 word = index / 64;
+    int64 word_end = std::min((word + 1) * 64, last);
+    // Only look at the blocks from 'index' up to 'word_end'.
+    uint64 mask = ~0ULL << (index % 64);
+    if (word_end % 64) mask &= ~(~0ULL << (word_end % 64));
+    uint64 free_bits = ~bitmap_[word].load(std::memory_order_relaxed) & mask;
+    if (free_bits) {
+      uint64 bit = 1ULL << __builtin_ctzll(free_bits);
+      if (!(bitmap_[word].fetch_or(bit, std::memory_order_acq_rel) & bit))
+        return word * 64 + __builtin_ctzll(bit);
+      // Another thread took it first, look at the word again.
+      continue;
+    }
+    scanned += word_end - index;
+    index = (word_end == last) ? first : word_end;
+  }
+  return -1;
+}
+
+// Return a block's sectors to the bitmap, and its data to the slab.
+void DiskBlockTable::FreeBlock(BlockData *block) {
+  FreeBlockBit(block->index_);
+  FreeBlockData(block);
+}
+
+void DiskBlockTable::FreeBlockBit(int64 index) {
+  bitmap_[index / 64].fetch_and(~(1ULL << (index % 64)),
+                                std::memory_order_release);
+  segment_free_[BlockSegment(index)]++;
+}
+
+// Take a BlockData from the slab, growing it if needed.
+BlockData *DiskBlockTable::AllocateBlockData() {
+  pthread_mutex_lock(&slab_mutex_);
+  if (free_blocks_.empty()) {
+    BlockData *slab = new (std::nothrow) BlockData[kSlabSize];
+    if (slab) {
+      slabs_.emplace_back(slab);
+      for (int i = 0; i < kSlabSize; i++) free_blocks_.push_back(&slab[i]);
+    }
+  }
+  BlockData *block = NULL;
+  if (!free_blocks_.empty()) {
+    block = free_blocks_.back();
+    free_blocks_.pop_back();
+  }
+  pthread_mutex_unlock(&slab_mutex_);
+  return block;
+}
+
+void DiskBlockTable::FreeBlockData(BlockData *block) {
+  pthread_mutex_lock(&slab_mutex_);
+  free_blocks_.push_back(block);
+  pthread_mutex_unlock(&slab_mutex_);
+}
+
 BlockData *DiskBlockTable::GetUnusedBlock(int64 segment, TestStep &test_step) {
-  int64 sector = 0;
-  BlockData *block = new BlockData();
-  bool good_sequence = false;
+  sat_assert(device_sectors_ != 0);
+  segment %= num_segments_;
+
+  // Skip the bitmap scan when the segment is known to be full.  Soon, a
+  // new segment will come and new blocks will be free.
+  if (segment_free_[segment] <= 0) return NULL;
+  int64 first, last;
+  SegmentBlocks(segment, &first, &last);
+  int64 index = ClaimBlock(first, last);
+  if (index < 0) return NULL;
+  segment_free_[segment]--;
+
+  BlockData *block = AllocateBlockData();
   if (block == NULL) {
     test_step.AddError(Error{
         .symptom = kProcessError,
@@ -205,58 +306,27 @@ BlockData *DiskBlockTable::GetUnusedBlock(int64 segment, TestStep &test_step) {
             "Unable to allocate memory for sector data for disk %s.",
             device_name_),
     });
+    FreeBlockBit(index);
     return NULL;
   }
-  pthread_mutex_lock(&parameter_mutex_);
-  sat_assert(device_sectors_ != 0);
-  // Align the first sector with the beginning of a write block
-  int num_sectors = write_block_size_ / sector_size_;
-  for (int i = 0; i < kBlockRetry && !good_sequence; i++) {
-    good_sequence = true;
-    // Use the entire disk or a small segment of the disk to allocate the first
-    // sector in the block from.
-    if (segment_size_ == -1) {
-      sector =
-          (Random64() & 0x7FFFFFFFFFFFFFFFLL) % (device_sectors_ / num_sectors);
-      sector *= num_sectors;
-    } else {
-      sector =
-          (Random64() & 0x7FFFFFFFFFFFFFFFLL) % (segment_size_ / num_sectors);
-      sector *= num_sectors;
-      sector += segment * segment_size_;
-      // Make sure the block is within the segment.
-      if (sector + num_sectors > (segment + 1) * segment_size_) {
-        good_sequence = false;
-        continue;
-      }
-    }
-    // Make sure the entire block is in range.
-    if (sector + num_sectors > device_sectors_) {
-      good_sequence = false;
-      continue;
-    }
-    // Check to see if the block is free. Since the blocks are
-    // now aligned to the write_block_size, it is not necessary
-    // to check each sector, just the first block (a sector
-    // overlap will never occur).
+  block->index_ = index;
+  block->set_address(index * (write_block_size_ / sector_size_));
+  block->set_size(write_block_size_);
+  block->set_pattern(NULL);
+  block->initialized_ = false;
+  block->references_ = 1;
+
+  Shard &shard = shards_[index % kShards];
+  pthread_mutex_lock(&shard.mutex);
+  block->position_ = shard.blocks.size();
+  shard.blocks.push_back(block);
+  pthread_mutex_unlock(&shard.mutex);
+
+  // Wake up random threads waiting for a first block.
+  if (size_++ == 0) {
     pthread_mutex_lock(&data_mutex_);
-    if (addr_to_block_.find(sector) != addr_to_block_.end()) {
-      good_sequence = false;
-    }
+    pthread_cond_broadcast(&data_condition_);
     pthread_mutex_unlock(&data_mutex_);
   }
-
-  if (good_sequence) {
-    block->set_address(sector);
-    block->set_size(write_block_size_);
-    block->IncreaseReferenceCounter();
-    InsertOnStructure(block);
-  } else {
-    // No contiguous sequence of num_sectors sectors was found within
-    // kBlockRetry iterations so return an error value.
-    delete block;
-    block = NULL;
-  }
-  pthread_mutex_unlock(&parameter_mutex_);
   return block;
 }
@@ -15,7 +15,8 @@
 #include <sys/types.h>
 #include <time.h>
 
-#include <map>
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -25,10 +26,9 @@
 class Pattern;
 
 // Data about a block written to disk so that it can be verified later.
-// Thread-unsafe, must be used with locks on non-const methods,
-// except for initialized accessor/mutator, which are thread-safe
-// (and in fact, is the only method supposed to be accessed from
-// someone which is not the thread-safe DiskBlockTable).
+// BlockData objects are owned and recycled by a DiskBlockTable.  The
+// reference counter and the initialized flag are atomic, the other
+// fields are only changed by the write thread owning the block.
 class BlockData {
  public:
   BlockData();
@@ -37,7 +37,7 @@ class BlockData {
   // These are reference counters used to control how many
   // threads currently have a copy of this particular block.
   void IncreaseReferenceCounter() { references_++; }
-  void DecreaseReferenceCounter() { references_--; }
+  int DecreaseReferenceCounter() { return --references_; }
   int GetReferenceCounter() const { return references_; }
 
   // Controls whether the block was written on disk or not.
@@ -55,18 +55,28 @@ class BlockData {
   Pattern *pattern() { return pattern_; }
 
  private:
-  uint64 address_;    // Address of first sector in block
-  uint64 size_;       // Size of block
-  int references_;    // Reference counter
-  bool initialized_;  // Flag indicating the block was written on disk
+  friend class DiskBlockTable;
+
+  uint64 address_;                 // Address of first sector in block
+  uint64 size_;                    // Size of block
+  std::atomic<int> references_;    // Reference counter
+  std::atomic<bool> initialized_;  // Flag indicating the block was written
+                                   // on disk
   Pattern *pattern_;
-  mutable pthread_mutex_t data_mutex_;
+  int64 index_;                    // Index of the block on disk, in blocks
+  int64 position_;                 // Position in its shard, -1 if none
   DISALLOW_COPY_AND_ASSIGN(BlockData);
 };
 
 // A thread-safe table used to store block data and control access
 // to these blocks, letting several threads read and write blocks on
 // disk.
+//
+// Blocks are aligned to the write block size.  A bitmap with one bit per
+// block on disk tracks which blocks are in use, and blocks are allocated
+// by setting their bit with an atomic compare and swap, so write threads
+// never wait on each other.  Blocks handed to random threads are spread
+// over several independently locked shards.
 class DiskBlockTable {
  public:
   DiskBlockTable();
@@ -122,24 +132,10 @@ class DiskBlockTable {
   int ReleaseBlock(BlockData *block);
 
  protected:
-  struct StorageData {
-    BlockData *block;
-    int pos;
-  };
-  typedef map<int64, StorageData *> AddrToBlockMap;
-  typedef vector<int64> PosToAddrVector;
-
-  // Inserts block in structure, used in tests and by other methods.
-  void InsertOnStructure(BlockData *block);
-
   // Generates a random 64-bit integer.
   // Virtual method so it can be overridden by the tests.
   virtual int64 Random64();
 
-  // Accessor methods for testing.
-  const PosToAddrVector &pos_to_addr() const { return pos_to_addr_; }
-  const AddrToBlockMap &addr_to_block() const { return addr_to_block_; }
-
   int sector_size() const { return sector_size_; }
   int write_block_size() const { return write_block_size_; }
   const string &device_name() const { return device_name_; }
@@ -147,19 +143,56 @@ class DiskBlockTable {
   int64 segment_size() const { return segment_size_; }
 
  private:
-  // Number of retries to allocate sectors.
-  static const int kBlockRetry = 100;
-  // Actual tables.
-  PosToAddrVector pos_to_addr_;
-  AddrToBlockMap addr_to_block_;
+  // Number of shards holding the blocks random threads pick from.
+  static const int kShards = 16;
+  // Number of BlockData objects allocated at once.
+  static const int kSlabSize = 1024;
+
+  // Blocks available to random threads, hashed by block index.
+  struct Shard {
+    pthread_mutex_t mutex;
+    std::vector<BlockData *> blocks;
+  };
+
+  // Try to claim a free block between 'first' and 'last', starting at a
+  // random one.  Returns its index, or -1 if they are all in use.
+  int64 ClaimBlock(int64 first, int64 last);
+  // Return a block to the bitmap and its BlockData to the slab.
+  void FreeBlock(BlockData *block);
+  // Clear a block's bit in the bitmap.
+  void FreeBlockBit(int64 index);
+
+  // Blocks from 'first' up to 'last' lie entirely within 'segment'.
+  void SegmentBlocks(int64 segment, int64 *first, int64 *last) const;
+  // Segment a block starts in.
+  int64 BlockSegment(int64 index) const;
+
+  // Take a BlockData from the slab, and give it back.
+  BlockData *AllocateBlockData();
+  void FreeBlockData(BlockData *block);
+
+  // One bit per block on disk, set while the block is in use, including
+  // after the write thread removed it while random threads still read it.
+  std::unique_ptr<std::atomic<uint64>[]> bitmap_;
+  int64 bitmap_words_;
+  int64 device_blocks_;      // Number of blocks on disk.
+  std::unique_ptr<std::atomic<int64>[]> segment_free_;  // Free blocks,
+                                                        // per segment.
+  int64 num_segments_;
+
+  Shard shards_[kShards];
+  std::atomic<uint64> size_;  // Number of elements on table
+
+  pthread_mutex_t slab_mutex_;
+  std::vector<std::unique_ptr<BlockData[]>> slabs_;
+  std::vector<BlockData *> free_blocks_;
 
   // Configuration parameters for block selection
   int sector_size_;       // Sector size, in bytes
   int write_block_size_;  // Block size, in bytes
   string device_name_;    // Device name
   int64 device_sectors_;  // Number of sectors in device
-  int64 segment_size_;    // Segment size in bytes
-  uint64 size_;           // Number of elements on table
+  int64 segment_size_;    // Segment size in sectors
   pthread_mutex_t data_mutex_;
   pthread_cond_t data_condition_;
   pthread_mutex_t parameter_mutex_;
@@ -0,0 +1,287 @@
+// Copyright 2023 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// io_uring ring setup, submission and completion reaping.
+
+// This file must work with autoconf on its public version,
+// so these includes are correct.
+#include "io_ring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#define IO_RING_SUPPORTED 1
+#endif
+
+IoRing::IoRing()
+    : ring_fd_(-1),
+      file_fd_(-1),
+      fixed_file_(false),
+      fixed_buffers_(false),
+      sq_ring_(NULL),
+      cq_ring_(NULL),
+      sqes_(NULL),
+      sq_ring_size_(0),
+      cq_ring_size_(0),
+      sqes_size_(0),
+      sq_head_(NULL),
+      sq_tail_(NULL),
+      sq_array_(NULL),
+      sq_mask_(0),
+      sq_entries_(0),
+      cq_head_(NULL),
+      cq_tail_(NULL),
+      cq_mask_(0),
+      cqes_(NULL),
+      sqe_head_(0),
+      sqe_tail_(0) {}
+
+IoRing::~IoRing() { Destroy(); }
+
+bool IoRing::Supported() {
+#ifdef IO_RING_SUPPORTED
+  return true;
+#else
+  return false;
+#endif
+}
+
+#ifdef IO_RING_SUPPORTED
+
+int IoRing::Init(unsigned depth) {
+  Destroy();
+
+  // Each request takes two entries: the I/O and its linked timeout.
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, depth * 2, &params);
+  if (fd < 0) return -errno;
+  ring_fd_ = fd;
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    cq_ring_size_ = 0;
+  }
+
+  sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    int error = errno;
+    sq_ring_ = NULL;
+    Destroy();
+    return -error;
+  }
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      int error = errno;
+      cq_ring_ = NULL;
+      Destroy();
+      return -error;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED) {
+    int error = errno;
+    sqes_ = NULL;
+    Destroy();
+    return -error;
+  }
+
+  char *sq = static_cast<char *>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+
+  char *cq = static_cast<char *>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes_ = cq + params.cq_off.cqes;
+
+  sqe_head_ = sqe_tail_ = *sq_tail_;
+  timeouts_.assign(sq_entries_ * 2, 0);
+  return 0;
+}
+
+int IoRing::ProbeOps() {
+  // Reads and writes from plain buffers and the probe itself need 5.6, the
+  // rest 5.5.  Older kernels fail the probe, which is what is wanted.
+  static const int kOps[] = {IORING_OP_READ, IORING_OP_WRITE,
+                             IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+                             IORING_OP_LINK_TIMEOUT};
+  static const unsigned kProbeOps = 256;
+  // Kept in 64-bit words for the alignment of the probe header.
+  std::vector<uint64> buffer(
+      (sizeof(struct io_uring_probe) +
+       kProbeOps * sizeof(struct io_uring_probe_op) + sizeof(uint64) - 1) /
+          sizeof(uint64),
+      0);
+  struct io_uring_probe *probe =
+      reinterpret_cast<struct io_uring_probe *>(buffer.data());
+  if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PROBE, probe,
+              kProbeOps) < 0)
+    return -errno;
+  for (int op : kOps) {
+    if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+      return -EOPNOTSUPP;
+  }
+  return 0;
+}
+
+void IoRing::Destroy() {
+  if (sqes_) munmap(sqes_, sqes_size_);
+  if (cq_ring_ && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_) munmap(sq_ring_, sq_ring_size_);
+  sqes_ = cq_ring_ = sq_ring_ = NULL;
+  // Closing the ring also drops registered files and buffers.
+  if (ring_fd_ >= 0) close(ring_fd_);
+  ring_fd_ = -1;
+  file_fd_ = -1;
+  fixed_file_ = false;
+  fixed_buffers_ = false;
+}
+
+int IoRing::RegisterFile(int fd) {
+  file_fd_ = fd;
+  fixed_file_ = false;
+  if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES, &fd,
+              1) < 0)
+    return -errno;
+  fixed_file_ = true;
+  return 0;
+}
+
+int IoRing::RegisterBuffers(const struct iovec *iovecs, unsigned count) {
+  fixed_buffers_ = false;
+  if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS,
+              iovecs, count) < 0)
+    return -errno;
+  fixed_buffers_ = true;
+  return 0;
+}
+
+bool IoRing::Queue(bool write, void *buf, int buf_index, unsigned size,
+                   int64 offset, uint64 user_data, int64 timeout) {
+  // The kernel advances the head as it consumes entries.
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sqe_tail_ + 2 - head > sq_entries_) return false;
+
+  struct io_uring_sqe *sqes = static_cast<struct io_uring_sqe *>(sqes_);
+  struct io_uring_sqe *sqe = &sqes[sqe_tail_++ & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  if (fixed_buffers_ && buf_index >= 0) {
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = buf_index;
+  } else {
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  if (fixed_file_) {
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = file_fd_;
+  }
+  sqe->flags |= IOSQE_IO_LINK;
+  sqe->addr = reinterpret_cast<uint64>(buf);
+  sqe->len = size;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+
+  // The kernel copies the timespec when it picks the entry up, so it only
+  // has to live as long as the entry itself.
+  unsigned index = sqe_tail_ & sq_mask_;
+  struct __kernel_timespec *ts =
+      reinterpret_cast<struct __kernel_timespec *>(&timeouts_[index * 2]);
+  ts->tv_sec = timeout / 1000000;
+  ts->tv_nsec = (timeout % 1000000) * 1000;
+
+  sqe = &sqes[sqe_tail_++ & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = reinterpret_cast<uint64>(ts);
+  sqe->len = 1;
+  sqe->user_data = kTimeoutUserData;
+  return true;
+}
+
+int IoRing::Submit(unsigned min_complete) {
+  // Publish the new entries in one go, then tell the kernel about them.
+  unsigned tail = *sq_tail_;
+  for (; sqe_head_ != sqe_tail_; sqe_head_++, tail++)
+    sq_array_[tail & sq_mask_] = sqe_head_ & sq_mask_;
+  __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+  // Entries the kernel did not take last time are still pending.
+  unsigned to_submit = tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  int result = syscall(__NR_io_uring_enter, ring_fd_, to_submit,
+                       min_complete, flags, NULL, 0);
+  return result < 0 ? -errno : result;
+}
+
+bool IoRing::Reap(uint64 *user_data, int *result) {
+  struct io_uring_cqe *cqes = static_cast<struct io_uring_cqe *>(cqes_);
+  unsigned head = *cq_head_;
+  while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &cqes[head & cq_mask_];
+    uint64 data = cqe->user_data;
+    int res = cqe->res;
+    __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+    if (data == kTimeoutUserData) continue;
+    *user_data = data;
+    *result = res;
+    return true;
+  }
+  return false;
+}
+
+#else  // !IO_RING_SUPPORTED
+
+int IoRing::Init(unsigned depth) { return -ENOSYS; }
+
+int IoRing::ProbeOps() { return -ENOSYS; }
+
+void IoRing::Destroy() {}
+
+int IoRing::RegisterFile(int fd) { return -ENOSYS; }
+
+int IoRing::RegisterBuffers(const struct iovec *iovecs, unsigned count) {
+  return -ENOSYS;
+}
+
+bool IoRing::Queue(bool write, void *buf, int buf_index, unsigned size,
+                   int64 offset, uint64 user_data, int64 timeout) {
+  return false;
+}
+
+int IoRing::Submit(unsigned min_complete) { return -ENOSYS; }
+
+bool IoRing::Reap(uint64 *user_data, int *result) { return false; }
+
+#endif  // IO_RING_SUPPORTED
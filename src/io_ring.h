@@ -0,0 +1,104 @@
+// Copyright 2023 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// A minimal io_uring submission/completion ring, driven directly through
+// the io_uring system calls so that no extra library is needed.
+
+#ifndef STRESSAPPTEST_IO_RING_H_
+#define STRESSAPPTEST_IO_RING_H_
+
+#include <sys/uio.h>
+
+#include <vector>
+
+// This file must work with autoconf on its public version,
+// so these includes are correct.
+#include "sattypes.h"
+
+// A single-threaded io_uring instance, doing reads and writes on one file.
+// All methods returning int return a negative errno value on failure.
+class IoRing {
+ public:
+  IoRing();
+  ~IoRing();
+
+  // Returns true if io_uring support was compiled in.
+  static bool Supported();
+
+  // Create a ring able to hold 'depth' requests in flight.
+  int Init(unsigned depth);
+  // Check that the kernel supports every operation the ring queues, which
+  // io_uring_setup() succeeding does not tell.  Returns -EOPNOTSUPP if one
+  // is missing.
+  int ProbeOps();
+  // Release the ring and anything registered with it.
+  void Destroy();
+
+  // Register the file that all requests go to.  If this fails, the
+  // plain file descriptor is used instead.
+  int RegisterFile(int fd);
+  // Register buffers so that requests naming them skip the per-request
+  // page pinning.  If this fails, requests fall back to plain reads and
+  // writes.
+  int RegisterBuffers(const struct iovec *iovecs, unsigned count);
+
+  // Queue a read or write of 'size' bytes at 'offset' through 'buf',
+  // which is registered buffer 'buf_index' if that is not negative.  The
+  // request is canceled if it is not complete within 'timeout' us.
+  // Returns false if the submission queue is full.
+  bool Queue(bool write, void *buf, int buf_index, unsigned size,
+             int64 offset, uint64 user_data, int64 timeout);
+  // Requests queued but not yet handed to the kernel.
+  unsigned queued() const { return (sqe_tail_ - sqe_head_) / 2; }
+
+  // Hand queued requests to the kernel, then wait until at least
+  // 'min_complete' completions are available.  Returns the number of
+  // requests submitted.
+  int Submit(unsigned min_complete);
+
+  // Pop the next completion, returning false if there is none.  'result'
+  // is the byte count, or a negative errno value (-ECANCELED on timeout).
+  bool Reap(uint64 *user_data, int *result);
+
+  bool fixed_file() const { return fixed_file_; }
+  bool fixed_buffers() const { return fixed_buffers_; }
+
+ private:
+  // User data tagging the linked timeouts, whose completions are dropped.
+  static const uint64 kTimeoutUserData = ~0ULL;
+
+  int ring_fd_;  // The io_uring file descriptor, -1 if not set up.
+  int file_fd_;  // The file requests go to.
+  bool fixed_file_;     // file_fd_ is registered as fixed file 0.
+  bool fixed_buffers_;  // Buffers are registered.
+
+  void *sq_ring_;  // Mapped submission ring.
+  void *cq_ring_;  // Mapped completion ring, may alias sq_ring_.
+  void *sqes_;     // Mapped submission queue entries.
+  size_t sq_ring_size_;
+  size_t cq_ring_size_;
+  size_t sqes_size_;
+
+  unsigned *sq_head_;  // Pointers into the mapped rings.
+  unsigned *sq_tail_;
+  unsigned *sq_array_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned cq_mask_;
+  void *cqes_;
+
+  unsigned sqe_head_;  // First entry not yet published to the kernel.
+  unsigned sqe_tail_;  // Next entry to hand out.
+
+  std::vector<int64> timeouts_;  // Linked timeout timespecs, two words per
+                                 // queue entry.
+
+  DISALLOW_COPY_AND_ASSIGN(IoRing);
+};
+
+#endif  // STRESSAPPTEST_IO_RING_H_
@@ -0,0 +1,63 @@
+// Copyright 2023 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// latency_histogram.cc : log-linear latency histogram.
+
+// This file must work with autoconf on its public version,
+// so these includes are correct.
+#include "latency_histogram.h"
+
+#include <string.h>
+
+LatencyHistogram::LatencyHistogram() { Reset(); }
+
+// Exact values first, then kSubBuckets buckets per power of two, indexed
+// by the bits following the most significant one.
+int LatencyHistogram::BucketIndex(int64 value) {
+  if (value < kSubBuckets) return value;
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - kSubBucketBits;
+  int sub_bucket = (value >> shift) - kSubBuckets;
+  return (shift + 1) * kSubBuckets + sub_bucket;
+}
+
+int64 LatencyHistogram::BucketMax(int index) {
+  if (index < kSubBuckets) return index;
+  int shift = index / kSubBuckets - 1;
+  int64 sub_bucket = index % kSubBuckets;
+  return ((kSubBuckets + sub_bucket) << shift) + ((1LL << shift) - 1);
+}
+
+void LatencyHistogram::Record(int64 value) {
+  if (value < 0) value = 0;
+  buckets_[BucketIndex(value)]++;
+  count_++;
+  if (value > max_) max_ = value;
+}
+
+void LatencyHistogram::Reset() {
+  memset(buckets_, 0, sizeof(buckets_));
+  count_ = 0;
+  max_ = 0;
+}
+
+int64 LatencyHistogram::Percentile(double percentile) const {
+  if (count_ == 0) return 0;
+  // Rank of the value wanted, counting from 1.
+  int64 rank = static_cast<int64>(percentile / 100.0 * count_ + 0.5);
+  if (rank < 1) rank = 1;
+  if (rank > count_) rank = count_;
+
+  int64 seen = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      int64 value = BucketMax(i);
+      return value < max_ ? value : max_;
+    }
+  }
+  return max_;
+}
@@ -0,0 +1,52 @@
+// Copyright 2023 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// A log-linear latency histogram, in the style of HdrHistogram, so that
+// per-request timings can be kept without storing every sample.
+
+#ifndef STRESSAPPTEST_LATENCY_HISTOGRAM_H_
+#define STRESSAPPTEST_LATENCY_HISTOGRAM_H_
+
+// This file must work with autoconf on its public version,
+// so these includes are correct.
+#include "sattypes.h"
+
+// Values below 2^kSubBucketBits are counted exactly.  Above that, each
+// power of two is split into 2^kSubBucketBits linear buckets, so that any
+// value is recorded within about 3% of itself.  Not thread safe: each
+// thread keeps its own.
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  // Count one value, negative values count as zero.
+  void Record(int64 value);
+  // Forget all the values counted.
+  void Reset();
+
+  int64 count() const { return count_; }
+  int64 max() const { return max_; }
+  // Value that 'percentile' percent of the values are at or below, as
+  // the highest value of its bucket but never above max().  Returns 0
+  // if nothing was counted.
+  int64 Percentile(double percentile) const;
+
+ private:
+  static const int kSubBucketBits = 5;
+  static const int kSubBuckets = 1 << kSubBucketBits;
+  // One set of sub buckets for the exact values, and one for each power
+  // of two above them.
+  static const int kBuckets = (64 - kSubBucketBits) * kSubBuckets;
+
+  static int BucketIndex(int64 value);
+  static int64 BucketMax(int index);
+
+  int64 buckets_[kBuckets];
+  int64 count_;
+  int64 max_;
+};
+
+#endif  // STRESSAPPTEST_LATENCY_HISTOGRAM_H_
@@ -24,7 +24,11 @@ int main(int argc, const char **argv) {
     return 1;
   }
 
-  sat->Run();
+  if (sat->daemon_mode()) {
+    sat->Serve();
+  } else {
+    sat->Run();
+  }
   sat->Cleanup();
 
   int retval = 0;
@@ -13,6 +13,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <linux/types.h>
 #include <malloc.h>
 #include <stdio.h>
@@ -31,7 +32,14 @@
 #ifndef SHM_HUGETLB
 #define SHM_HUGETLB 04000  // remove when glibc defines it
 #endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U  // remove when glibc defines it
+#endif
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT 26
+#endif
 
+#include <atomic>
 #include <list>
 #include <string>
 
@@ -59,9 +67,14 @@ OsLayer::OsLayer() {
   normal_mem_ = true;
   use_hugepages_ = false;
   use_posix_shm_ = false;
+  use_memfd_hugepages_ = false;
+  use_thp_ = false;
   dynamic_mapped_shmem_ = false;
   mmapped_allocation_ = false;
   shmid_ = 0;
+  testmem_pagesize_ = 0;
+  mapped_bytes_ = 0;
+  pthread_mutex_init(&mapping_lock_, NULL);
   channels_ = NULL;
 
   time_initialized_ = 0;
@@ -80,12 +93,16 @@ OsLayer::OsLayer() {
   has_vector_ = false;
 
   use_flush_page_cache_ = false;
+  page_cache_flushes_ = 0;
+  page_cache_flush_us_ = 0;
 
   clock_ = NULL;
 }
 
 // OsLayer cleanup.
 OsLayer::~OsLayer() {
+  FreeMappingWindows();
+  pthread_mutex_destroy(&mapping_lock_);
   if (clock_) delete clock_;
 }
 
@@ -169,6 +186,47 @@ uint64 OsLayer::VirtualToPhysical(void *vaddr, TestStep &test_step) {
   return paddr;
 }
 
+// Translates a range of user virtual addresses with one pagemap read.
+bool OsLayer::VirtualToPhysicalRange(void *vaddr, uint64 length,
+                                     vector<uint64> *paddrs,
+                                     TestStep &test_step) {
+  int pagesize = sysconf(_SC_PAGESIZE);
+  uint64 first = reinterpret_cast<uintptr_t>(vaddr) / pagesize;
+  uint64 count =
+      (reinterpret_cast<uintptr_t>(vaddr) + length + pagesize - 1) / pagesize -
+      first;
+  vector<uint64> frames(count);
+
+  int fd = open(kPagemapPath, O_RDONLY);
+  if (fd < 0) return false;
+  ssize_t bytes = count * sizeof(uint64);
+  if (pread(fd, frames.data(), bytes, first * sizeof(uint64)) != bytes) {
+    int err = errno;
+    string errtxt = ErrorString(err);
+    test_step.AddError(Error{
+        .symptom = kProcessError,
+        .message = absl::StrFormat(
+            "Error when converting the user virtual address range to "
+            "physical addresses. Failed to read %s with error code %d (%s).",
+            kPagemapPath, err, errtxt),
+    });
+    close(fd);
+    return false;
+  }
+  close(fd);
+
+  // See VirtualToPhysical for the pagemap entry layout.
+  uint64 pfnmask = ((1ULL << 55) - 1);
+  for (uint64 frame : frames) {
+    if (!(frame & (1ULL << 63)) || (frame & (1ULL << 62))) {
+      paddrs->push_back(0);
+    } else {
+      paddrs->push_back((frame & pfnmask) * pagesize);
+    }
+  }
+  return true;
+}
+
 // Returns the HD device that contains this file.
 string OsLayer::FindFileDevice(string filename) { return "hdUnknown"; }
 
@@ -207,39 +265,40 @@ void OsLayer::ActivateFlushPageCache(TestStep &test_step) {
   use_flush_page_cache_ = true;
 }
 
-// Flush the page cache to ensure reads come from the disk.
-bool OsLayer::FlushPageCache(TestStep &test_step) {
+// Flush the page cache to ensure reads come from the disk.  Only the range
+// of the file given is written back and dropped, rather than the whole
+// system's page cache, which other workloads on the machine rely on.
+bool OsLayer::FlushPageCache(int fd, int64 offset, int64 length,
+                             TestStep &test_step) {
   if (!use_flush_page_cache_) return true;
+  int64 start_us = sat_get_time_us();
 
-  // First, ask the kernel to write the cache to the disk.
-  sync();
-
-  // Second, ask the kernel to empty the cache by writing "1" to
-  // "/proc/sys/vm/drop_caches".
-  static const char *drop_caches_file = "/proc/sys/vm/drop_caches";
-  int dcfile = open(drop_caches_file, O_WRONLY);
-  if (dcfile < 0) {
+  // First, ask the kernel to write the file's dirty pages to the disk.
+  if (fdatasync(fd) < 0) {
     int err = errno;
     string errtxt = ErrorString(err);
-    test_step.AddLog(
-        Log{.severity = LogSeverity::kWarning,
-            .message = absl::StrFormat("Failed to open %s - error code %d (%s)",
-                                       drop_caches_file, err, errtxt)});
+    test_step.AddLog(Log{
+        .severity = LogSeverity::kWarning,
+        .message = absl::StrFormat("Failed to sync file - error code %d (%s)",
+                                   err, errtxt)});
     return false;
   }
 
-  ssize_t bytes_written = write(dcfile, "1", 1);
-  close(dcfile);
-
-  if (bytes_written != 1) {
-    int err = errno;
+  // Second, ask the kernel to drop the now clean range from the cache.
+  int err = posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+  if (err) {
     string errtxt = ErrorString(err);
     test_step.AddLog(Log{
         .severity = LogSeverity::kWarning,
-        .message = absl::StrFormat("Failed to write to %s - error code %d (%s)",
-                                   drop_caches_file, err, errtxt)});
+        .message = absl::StrFormat(
+            "Failed to drop %lld bytes at %lld from the page cache - error "
+            "code %d (%s)",
+            length, offset, err, errtxt)});
     return false;
   }
+
+  page_cache_flushes_++;
+  page_cache_flush_us_ += sat_get_time_us() - start_us;
   return true;
 }
 
@@ -263,6 +322,16 @@ bool OsLayer::AdlerMemcpyWarm(uint64 *dstmem, uint64 *srcmem,
   }
 }
 
+// Run C or vector checksum as appropriate.
+bool OsLayer::AdlerChecksumMem(uint64 *mem, unsigned int size_in_bytes,
+                               AdlerChecksum *checksum) {
+  if (has_vector_) {
+    return CalculateAdlerChecksumAsm(mem, size_in_bytes, checksum);
+  } else {
+    return CalculateAdlerChecksum(mem, size_in_bytes, checksum);
+  }
+}
+
 // Translate physical address to memory module/chip name.
 // Assumes interleaving between two memory channels based on the XOR of
 // all address bits in the 'channel_hash' mask, with repeated 'channel_width_'
@@ -344,8 +413,70 @@ string OsLayer::FindCoreMaskFormat(cpu_set_t *mask) {
   return format;
 }
 
-// Read the number of hugepages out of the kernel interface in proc.
+// Read a short sysfs or procfs file into contents.
+// Returns false if the file could not be read.
+static bool ReadSmallFile(const char *path, string *contents) {
+  char buf[256];
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  ssize_t bytes_read = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (bytes_read <= 0) return false;
+  buf[bytes_read] = '\0';
+  *contents = buf;
+  return true;
+}
+
+// Read the free hugepage count of every supported hugepage size.
+void OsLayer::FindHugePageSizes(TestStep &test_step) {
+  static const char *hugepages_dir = "/sys/kernel/mm/hugepages";
+
+  hugepage_pools_.clear();
+  DIR *dir = opendir(hugepages_dir);
+  if (dir == NULL) return;
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    // Entries look like "hugepages-2048kB".
+    int64 size_kb = 0;
+    if (sscanf(entry->d_name, "hugepages-%lldkB", &size_kb) != 1 ||
+        size_kb <= 0)
+      continue;
+
+    string path = absl::StrFormat("%s/%s/free_hugepages", hugepages_dir,
+                                  entry->d_name);
+    string contents;
+    if (!ReadSmallFile(path.c_str(), &contents)) {
+      test_step.AddLog(Log{
+          .severity = LogSeverity::kWarning,
+          .message = absl::StrFormat("%s read did not provide data.", path),
+      });
+      continue;
+    }
+    int64 pages = strtoull(contents.c_str(), NULL, 10);  // NOLINT
+    hugepage_pools_[size_kb * 1024] = pages;
+    test_step.AddLog(Log{
+        .severity = LogSeverity::kDebug,
+        .message = absl::StrFormat("Found %lld free %lld kB hugepages.", pages,
+                                   size_kb),
+    });
+  }
+  closedir(dir);
+}
+
+// Find the number of bytes available in the largest hugepage pool. Each
+// hugepage size is allocated separately, so pools are never summed.
 int64 OsLayer::FindHugePages(TestStep &test_step) {
+  FindHugePageSizes(test_step);
+  if (!hugepage_pools_.empty()) {
+    int64 bytes = 0;
+    for (const auto &pool : hugepage_pools_)
+      bytes = std::max(bytes, pool.first * pool.second);
+    return bytes;
+  }
+
+  // Fall back to the legacy kernel interface, which only reports the
+  // default hugepage size.
   char buf[65] = "0";
 
   // This is a kernel interface to query the numebr of hugepages
@@ -374,10 +505,31 @@ int64 OsLayer::FindHugePages(TestStep &test_step) {
 
   // Add a null termintation to be string safe.
   buf[bytes_read] = '\0';
-  // Read the page count.
+  // Read the page count, assuming 2MB hugepages.
   int64 pages = strtoull(buf, NULL, 10);  // NOLINT
 
-  return pages;
+  return pages * 2 * kMegabyte;
+}
+
+// Check whether anonymous memory can be backed by transparent hugepages.
+int64 OsLayer::FindThpSize(TestStep &test_step) {
+  string enabled;
+  if (!ReadSmallFile("/sys/kernel/mm/transparent_hugepage/enabled", &enabled))
+    return 0;
+  // The active mode is bracketed, e.g. "always [madvise] never".
+  if (enabled.find("[never]") != string::npos) {
+    test_step.AddLog(Log{
+        .severity = LogSeverity::kInfo,
+        .message = "Transparent hugepages are disabled on this system.",
+    });
+    return 0;
+  }
+
+  string size;
+  if (!ReadSmallFile("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size",
+                     &size))
+    return 2 * kMegabyte;
+  return strtoull(size.c_str(), NULL, 10);  // NOLINT
 }
 
 int64 OsLayer::FindFreeMemSize(TestStep &test_step) {
@@ -391,8 +543,7 @@ int64 OsLayer::FindFreeMemSize(TestStep &test_step) {
   int64 physsize = pages * pagesize;
   int64 avphyssize = avpages * pagesize;
 
-  // Assume 2MB hugepages.
-  int64 hugepagesize = FindHugePages(test_step) * 2 * kMegabyte;
+  int64 hugepagesize = FindHugePages(test_step);
 
   if ((pages == -1) || (pagesize == -1)) {
     test_step.AddLog(Log{
@@ -513,7 +664,7 @@ bool OsLayer::AllocateTestMem(int64 length, uint64 paddr_base,
   bool prefer_dynamic_mapping = false;
 
   // Are there enough hugepages?
-  int64 hugepagesize = FindHugePages(test_step) * 2 * kMegabyte;
+  int64 hugepagesize = FindHugePages(test_step);
   // TODO(nsanders): Is there enough /dev/shm? Is there enough free memeory?
   if ((length >= 1400LL * kMegabyte) && (address_mode_ == 32)) {
     prefer_dynamic_mapping = true;
@@ -532,9 +683,64 @@ bool OsLayer::AllocateTestMem(int64 length, uint64 paddr_base,
             .message = "Preferring plain malloc memory allocation."});
   }
 
+#ifdef HAVE_MEMFD_CREATE
+  // Allocate hugetlb memfd memory, preferring the largest page size whose
+  // pool can hold the whole allocation.
+  if (prefer_hugepages) {
+    for (auto pool = hugepage_pools_.rbegin(); pool != hugepage_pools_.rend();
+         ++pool) {
+      int64 pagesize = pool->first;
+      if ((pagesize * pool->second < length) || (length % pagesize)) continue;
+
+      // The hugepage size is encoded as log2(size) in the flags.
+      unsigned int flags = MFD_HUGETLB;
+      flags |= static_cast<unsigned int>(__builtin_ctzll(pagesize))
+               << MFD_HUGE_SHIFT;
+      int memfd = memfd_create("stressapptest", flags);
+      if (memfd < 0) {
+        int err = errno;
+        string errtxt = ErrorString(err);
+        test_step.AddLog(Log{
+            .severity = LogSeverity::kInfo,
+            .message = absl::StrFormat("Failed to create %lld kB hugepage "
+                                       "memfd - error code %d (%s).",
+                                       pagesize / 1024, err, errtxt)});
+        continue;
+      }
+
+      void *memfdaddr = MAP_FAILED;
+      if (ftruncate(memfd, length) == 0) {
+        memfdaddr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         memfd, 0);
+      }
+      if (memfdaddr == MAP_FAILED) {
+        int err = errno;
+        string errtxt = ErrorString(err);
+        test_step.AddLog(Log{
+            .severity = LogSeverity::kInfo,
+            .message = absl::StrFormat("Failed to map %lld kB hugepage memfd "
+                                       "- error code %d (%s).",
+                                       pagesize / 1024, err, errtxt)});
+        close(memfd);
+        continue;
+      }
+
+      use_memfd_hugepages_ = true;
+      shmid_ = memfd;
+      testmem_pagesize_ = pagesize;
+      buf = memfdaddr;
+      test_step.AddLog(Log{
+          .severity = LogSeverity::kInfo,
+          .message = absl::StrFormat("Using %lld kB hugepage memfd at %p.",
+                                     pagesize / 1024, memfdaddr)});
+      break;
+    }
+  }
+#endif  // HAVE_MEMFD_CREATE
+
 #ifdef HAVE_SYS_SHM_H
   // Allocate hugepage mapped memory.
-  if (prefer_hugepages) {
+  if (prefer_hugepages && !use_memfd_hugepages_) {
     do {  // Allow break statement.
       int shmid;
       void *shmaddr;
@@ -574,6 +780,8 @@ bool OsLayer::AllocateTestMem(int64 length, uint64 paddr_base,
       }
       use_hugepages_ = true;
       shmid_ = shmid;
+      // SysV shm always uses the default hugepage size. Assume 2MB.
+      testmem_pagesize_ = 2 * kMegabyte;
       buf = shmaddr;
       test_step.AddLog(
           Log{.severity = LogSeverity::kInfo,
@@ -611,8 +819,8 @@ bool OsLayer::AllocateTestMem(int64 length, uint64 paddr_base,
       }
 
       // 32 bit linux apps can only use ~1.4G of address space.
-      // Use dynamic mapping for allocations larger than that.
-      // Currently perf hit is ~10% for this.
+      // Use dynamic mapping for allocations larger than that. Mappings are
+      // cached in windows, see PrepareTestMem.
       if (prefer_dynamic_mapping) {
         dynamic_mapped_shmem_ = true;
       } else {
@@ -634,6 +842,7 @@ bool OsLayer::AllocateTestMem(int64 length, uint64 paddr_base,
 
       use_posix_shm_ = true;
       shmid_ = shm_object;
+      testmem_pagesize_ = sysconf(_SC_PAGESIZE);
       buf = shmaddr;
       char location_message[256] = "";
       if (dynamic_mapped_shmem_) {
@@ -650,18 +859,47 @@ bool OsLayer::AllocateTestMem(int64 length, uint64 paddr_base,
   }
 #endif  // HAVE_SYS_SHM_H
 
-  if (!use_hugepages_ && !use_posix_shm_) {
+  if (!use_hugepages_ && !use_posix_shm_ && !use_memfd_hugepages_) {
+    testmem_pagesize_ = sysconf(_SC_PAGESIZE);
     // If the page size is what SAT is expecting explicitly perform mmap()
     // allocation.
-    if (sysconf(_SC_PAGESIZE) >= 4096) {
-      void *map_buf = mmap(NULL, length, PROT_READ | PROT_WRITE,
-                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (testmem_pagesize_ >= 4096) {
+      // Over-allocate so the buffer can be aligned to a transparent hugepage
+      // boundary, otherwise the first and last huge pages are lost.
+      int64 thpsize = FindThpSize(test_step);
+      int64 map_length = length + thpsize;
+      char *map_buf =
+          static_cast<char *>(mmap(NULL, map_length, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
       if (map_buf != MAP_FAILED) {
         buf = map_buf;
+        if (thpsize > 0) {
+          char *aligned = reinterpret_cast<char *>(
+              (reinterpret_cast<uintptr_t>(map_buf) + thpsize - 1) &
+              ~(static_cast<uintptr_t>(thpsize) - 1));
+          if (aligned > map_buf) munmap(map_buf, aligned - map_buf);
+          if (aligned + length < map_buf + map_length)
+            munmap(aligned + length, map_buf + map_length - aligned - length);
+          buf = aligned;
+          if (madvise(buf, length, MADV_HUGEPAGE) == 0) {
+            use_thp_ = true;
+            testmem_pagesize_ = thpsize;
+          } else {
+            int err = errno;
+            string errtxt = ErrorString(err);
+            test_step.AddLog(Log{
+                .severity = LogSeverity::kInfo,
+                .message = absl::StrFormat(
+                    "Failed to advise transparent hugepages - error code %d "
+                    "(%s).",
+                    err, errtxt)});
+          }
+        }
         mmapped_allocation_ = true;
         test_step.AddLog(Log{
             .severity = LogSeverity::kInfo,
-            .message = absl::StrFormat("Using mmap allocation at %p.", buf)});
+            .message = absl::StrFormat("Using %smmap allocation at %p.",
+                                       use_thp_ ? "THP advised " : "", buf)});
       }
     }
     if (!mmapped_allocation_) {
@@ -692,6 +930,31 @@ bool OsLayer::AllocateTestMem(int64 length, uint64 paddr_base,
     testmemsize_ = 0;
   }
 
+  if (testmemsize_) {
+    string backing;
+    if (use_memfd_hugepages_)
+      backing = "hugetlb memfd";
+    else if (use_hugepages_)
+      backing = "hugetlb shm";
+    else if (use_posix_shm_)
+      backing = "posix shm";
+    else if (use_thp_)
+      backing = "transparent hugepage mmap";
+    else if (mmapped_allocation_)
+      backing = "mmap";
+    else
+      backing = "memalign";
+    test_step.AddMeasurement(Measurement{
+        .name = "Test Memory Backing",
+        .value = backing,
+    });
+    test_step.AddMeasurement(Measurement{
+        .name = "Test Memory Page Size",
+        .unit = "kB",
+        .value = static_cast<double>(testmem_pagesize_ / 1024),
+    });
+  }
+
   return (buf != 0) || dynamic_mapped_shmem_;
 }
 
@@ -708,6 +971,9 @@ void OsLayer::FreeTestMem() {
         munmap(testmem_, testmemsize_);
       }
       close(shmid_);
+    } else if (use_memfd_hugepages_) {
+      munmap(testmem_, testmemsize_);
+      close(shmid_);
     } else if (mmapped_allocation_) {
       munmap(testmem_, testmemsize_);
     } else {
@@ -716,28 +982,198 @@ void OsLayer::FreeTestMem() {
     testmem_ = 0;
     testmemsize_ = 0;
   }
+  FreeMappingWindows();
 }
 
-// Prepare the target memory. It may requre mapping in, or this may be a noop.
-void *OsLayer::PrepareTestMem(uint64 offset, uint64 length,
-                              TestStep &test_step) {
-  sat_assert((offset + length) <= testmemsize_);
-  if (dynamic_mapped_shmem_) {
+// Sum the transparent hugepages mapped into the test memory, as reported by
+// the AnonHugePages field of each overlapping mapping in smaps.
+void OsLayer::ReportHugePageCoverage(TestStep &test_step) {
+  if (!use_thp_ || !testmem_ || !testmemsize_) return;
+
+  FILE *smaps = fopen("/proc/self/smaps", "r");
+  if (smaps == NULL) {
+    test_step.AddLog(Log{
+        .severity = LogSeverity::kWarning,
+        .message = "Unable to open /proc/self/smaps to check THP coverage.",
+    });
+    return;
+  }
+
+  uintptr_t test_start = reinterpret_cast<uintptr_t>(testmem_);
+  uintptr_t test_end = test_start + testmemsize_;
+  bool in_testmem = false;
+  int64 thp_kb = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), smaps)) {
+    uintptr_t start, end;
+    int64 kb;
+    // Mapping headers start with "start-end perms".
+    if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &start, &end) == 2) {
+      in_testmem = (start < test_end) && (end > test_start);
+    } else if (in_testmem &&
+               sscanf(line, "AnonHugePages: %lld kB", &kb) == 1) {
+      thp_kb += kb;
+    }
+  }
+  fclose(smaps);
+
+  test_step.AddMeasurement(Measurement{
+      .name = "Transparent Hugepage Coverage",
+      .unit = "%",
+      .value = thp_kb * 1024 * 100.0 / testmemsize_,
+  });
+}
+
+// Bumped whenever the mapping windows are torn down, so that thread caches
+// left behind by exited or idle threads are never dereferenced afterwards.
+static std::atomic<uint64> mapping_generation(1);
+
+// Each thread pins the window it last used. Hits in the pinned window are
+// counted in outstanding without taking mapping_lock_; the count is handed
+// over to the window's reference count when the pin moves elsewhere.
+struct OsLayer::ThreadMappingCache {
+  OsLayer *os = NULL;
+  MappingWindow *window = NULL;
+  int64 outstanding = 0;
+  uint64 generation = 0;
+
+  bool Valid() const {
+    return window && generation == mapping_generation.load();
+  }
+
+  ~ThreadMappingCache() {
+    if (Valid()) os->UnpinMappingWindow(window, outstanding);
+  }
+};
+
+thread_local OsLayer::ThreadMappingCache OsLayer::thread_mapping_cache_;
+
+OsLayer::MappingWindow *OsLayer::PinMappingWindow(uint64 window_offset,
+                                                  TestStep &test_step) {
+  pthread_mutex_lock(&mapping_lock_);
+  MappingWindow *window;
+  auto it = mapping_windows_.find(window_offset);
+  if (it != mapping_windows_.end()) {
+    window = it->second;
+    if (window->refs == 0) mapping_lru_.erase(window->lru);
+  } else {
+    window = new MappingWindow;
+    window->offset = window_offset;
+    window->length = min(kMappingWindowSize, testmemsize_ - window_offset);
+    window->refs = 0;
     // TODO(nsanders): Check if we can support MAP_NONBLOCK,
     // and evaluate performance hit from not using it.
-    void *mapping = mmap(NULL, length, PROT_READ | PROT_WRITE,
-                         MAP_SHARED | MAP_NORESERVE | MAP_LOCKED | MAP_POPULATE,
-                         shmid_, offset);
+    void *mapping =
+        mmap(NULL, window->length, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_NORESERVE | MAP_LOCKED | MAP_POPULATE, shmid_,
+             window_offset);
     if (mapping == MAP_FAILED) {
       string errtxt = ErrorString(errno);
       test_step.AddError(
           Error{.symptom = kProcessError,
                 .message = absl::StrFormat(
                     "PrepareTestMem mmap(%llx, %llx) failed with error: %s.",
-                    offset, length, errtxt)});
+                    window_offset, window->length, errtxt)});
       sat_assert(0);
     }
-    return mapping;
+    window->addr = static_cast<char *>(mapping);
+    mapping_windows_[window_offset] = window;
+    mapped_bytes_ += window->length;
+    TrimMappingWindows(test_step);
+  }
+  window->refs++;
+  pthread_mutex_unlock(&mapping_lock_);
+  return window;
+}
+
+void OsLayer::UnpinMappingWindow(MappingWindow *window, int64 outstanding) {
+  pthread_mutex_lock(&mapping_lock_);
+  // Drop the pin itself, keeping any pages still in use by this thread.
+  window->refs += outstanding - 1;
+  if (window->refs == 0)
+    window->lru = mapping_lru_.insert(mapping_lru_.end(), window);
+  pthread_mutex_unlock(&mapping_lock_);
+}
+
+void OsLayer::PutMappingWindow(uint64 offset) {
+  pthread_mutex_lock(&mapping_lock_);
+  auto it = mapping_windows_.find(offset - offset % kMappingWindowSize);
+  sat_assert(it != mapping_windows_.end());
+  MappingWindow *window = it->second;
+  if (--window->refs == 0)
+    window->lru = mapping_lru_.insert(mapping_lru_.end(), window);
+  pthread_mutex_unlock(&mapping_lock_);
+}
+
+// Called with mapping_lock_ held.
+void OsLayer::TrimMappingWindows(TestStep &test_step) {
+  while (mapped_bytes_ > kMaxMappedBytes && !mapping_lru_.empty()) {
+    MappingWindow *window = mapping_lru_.front();
+    mapping_lru_.pop_front();
+    if (munmap(window->addr, window->length) == -1) {
+      string errtxt = ErrorString(errno);
+      test_step.AddError(
+          Error{.symptom = kProcessError,
+                .message = absl::StrFormat(
+                    "ReleaseTestMem munmap(%p, %llx) failed with error: %s.",
+                    window->addr, window->length, errtxt)});
+      sat_assert(0);
+    }
+    mapping_windows_.erase(window->offset);
+    mapped_bytes_ -= window->length;
+    delete window;
+  }
+}
+
+void OsLayer::FreeMappingWindows() {
+  pthread_mutex_lock(&mapping_lock_);
+  mapping_generation++;
+  for (auto &entry : mapping_windows_) {
+    munmap(entry.second->addr, entry.second->length);
+    delete entry.second;
+  }
+  mapping_windows_.clear();
+  mapping_lru_.clear();
+  mapped_bytes_ = 0;
+  pthread_mutex_unlock(&mapping_lock_);
+}
+
+// Prepare the target memory. It may requre mapping in, or this may be a noop.
+void *OsLayer::PrepareTestMem(uint64 offset, uint64 length,
+                              TestStep &test_step) {
+  sat_assert((offset + length) <= testmemsize_);
+  if (dynamic_mapped_shmem_) {
+    uint64 window_offset = offset - offset % kMappingWindowSize;
+    // Pages that would straddle a window are mapped on their own.
+    if (offset + length > window_offset + kMappingWindowSize) {
+      void *mapping =
+          mmap(NULL, length, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_NORESERVE | MAP_LOCKED | MAP_POPULATE,
+               shmid_, offset);
+      if (mapping == MAP_FAILED) {
+        string errtxt = ErrorString(errno);
+        test_step.AddError(
+            Error{.symptom = kProcessError,
+                  .message = absl::StrFormat(
+                      "PrepareTestMem mmap(%llx, %llx) failed with error: %s.",
+                      offset, length, errtxt)});
+        sat_assert(0);
+      }
+      return mapping;
+    }
+
+    ThreadMappingCache &cache = thread_mapping_cache_;
+    if (!cache.Valid() || cache.window->offset != window_offset) {
+      // Slow path: move this thread's pin to the new window.
+      MappingWindow *window = PinMappingWindow(window_offset, test_step);
+      if (cache.Valid()) UnpinMappingWindow(cache.window, cache.outstanding);
+      cache.os = this;
+      cache.window = window;
+      cache.outstanding = 0;
+      cache.generation = mapping_generation.load();
+    }
+    cache.outstanding++;
+    return cache.window->addr + (offset - window_offset);
   }
 
   return reinterpret_cast<void *>(reinterpret_cast<char *>(testmem_) + offset);
@@ -747,6 +1183,17 @@ void *OsLayer::PrepareTestMem(uint64 offset, uint64 length,
 void OsLayer::ReleaseTestMem(void *addr, uint64 offset, uint64 length,
                              TestStep &test_step) {
   if (dynamic_mapped_shmem_) {
+    uint64 window_offset = offset - offset % kMappingWindowSize;
+    if (offset + length <= window_offset + kMappingWindowSize) {
+      // Windows stay mapped until evicted by TrimMappingWindows.
+      ThreadMappingCache &cache = thread_mapping_cache_;
+      if (cache.Valid() && cache.window->offset == window_offset)
+        cache.outstanding--;
+      else
+        PutMappingWindow(offset);
+      return;
+    }
+
     int retval = munmap(addr, length);
     if (retval == -1) {
       string errtxt = ErrorString(errno);
@@ -760,6 +1207,97 @@ void OsLayer::ReleaseTestMem(void *addr, uint64 offset, uint64 length,
   }
 }
 
+// Walk /sys/devices/system/cpu to build the topology of the online cpus.
+bool OsLayer::FindCpuTopology(vector<CpuTopology> *topology,
+                              TestStep &test_step) {
+  topology->clear();
+  int cpus = sysconf(_SC_NPROCESSORS_CONF);
+  for (int cpu = 0; cpu < cpus; cpu++) {
+    string base = absl::StrFormat("/sys/devices/system/cpu/cpu%d", cpu);
+    string value;
+    // Offline cpus have no topology directory.
+    if (!ReadSmallFile((base + "/topology/core_id").c_str(), &value)) continue;
+
+    CpuTopology entry;
+    entry.cpu = cpu;
+    entry.core = atoi(value.c_str());
+    entry.package = 0;
+    if (ReadSmallFile((base + "/topology/physical_package_id").c_str(), &value))
+      entry.package = atoi(value.c_str());
+    entry.die = 0;
+    if (ReadSmallFile((base + "/topology/die_id").c_str(), &value))
+      entry.die = atoi(value.c_str());
+
+    // The last level cache is the highest level data or unified cache.
+    // Name the domain after the first cpu that shares it.
+    entry.llc = -1 - entry.package;
+    int llc_level = 0;
+    for (int index = 0;; index++) {
+      string cache = absl::StrFormat("%s/cache/index%d/", base, index);
+      if (!ReadSmallFile((cache + "level").c_str(), &value)) break;
+      int level = atoi(value.c_str());
+      string type;
+      if (ReadSmallFile((cache + "type").c_str(), &type) &&
+          type.find("Instruction") == 0)
+        continue;
+      if (level >= llc_level &&
+          ReadSmallFile((cache + "shared_cpu_list").c_str(), &value)) {
+        llc_level = level;
+        entry.llc = atoi(value.c_str());
+      }
+    }
+
+    // Siblings are numbered in cpu order.
+    entry.smt_index = 0;
+    for (const CpuTopology &other : *topology) {
+      if (other.package == entry.package && other.die == entry.die &&
+          other.core == entry.core)
+        entry.smt_index++;
+    }
+    topology->push_back(entry);
+  }
+
+  if (topology->empty()) {
+    test_step.AddLog(Log{
+        .severity = LogSeverity::kWarning,
+        .message = "Unable to read the cpu topology from sysfs.",
+    });
+    return false;
+  }
+  return true;
+}
+
+// Read the model name of the first cpu from /proc/cpuinfo.
+string OsLayer::FindCpuModel() {
+  FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+  if (!cpuinfo) return "unknown";
+  string model = "unknown";
+  char line[256];
+  while (fgets(line, sizeof(line), cpuinfo)) {
+    // x86 reports "model name", arm64 only the "CPU part" number.
+    if (strncmp(line, "model name", 10) && strncmp(line, "CPU part", 8))
+      continue;
+    char *value = strchr(line, ':');
+    if (!value) continue;
+    model = value + 1;
+    model.erase(0, model.find_first_not_of(" \t"));
+    model.erase(model.find_last_not_of(" \t\n") + 1);
+    break;
+  }
+  fclose(cpuinfo);
+  return model;
+}
+
+bool OsLayer::ReadMemoryPressure(int64 *stall_us) {
+  string contents;
+  if (!ReadSmallFile("/proc/pressure/memory", &contents)) return false;
+  // The first line is "some avg10=... avg60=... avg300=... total=<us>".
+  size_t total = contents.find("total=");
+  if (contents.compare(0, 5, "some ") || total == string::npos) return false;
+  *stall_us = strtoll(contents.c_str() + total + 6, NULL, 10);
+  return true;
+}
+
 // Open dev msr.
 int OsLayer::OpenMSR(uint32 core, uint32 address, TestStep &test_step) {
   char buf[256];
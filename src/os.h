@@ -8,10 +8,12 @@
 #define STRESSAPPTEST_OS_H_
 
 #include <dirent.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <list>
 #include <map>
 #include <string>
@@ -48,6 +50,16 @@ typedef vector<PCIDevice *> PCIDevices;
 
 class Clock;
 
+// Location of one logical cpu, as described by sysfs.
+struct CpuTopology {
+  int cpu;        // Logical cpu number.
+  int package;    // Physical package (socket).
+  int die;        // Die within the package.
+  int core;       // Core id, unique within a die.
+  int llc;        // Last level cache domain, named by its lowest cpu.
+  int smt_index;  // Position of this cpu among its core's SMT siblings.
+};
+
 // This class implements OS/Platform specific funtions.
 class OsLayer {
  public:
@@ -83,6 +95,14 @@ class OsLayer {
   virtual uint64 VirtualToPhysical(void *vaddr,
                                    ocpdiag::results::TestStep &test_step);
 
+  // Bulk version of VirtualToPhysical. Translates every page in
+  // [vaddr, vaddr + length) with a single pagemap read, appending one
+  // physical page address per page to paddrs. Pages that are not present
+  // translate to 0. Returns false on error.
+  virtual bool VirtualToPhysicalRange(void *vaddr, uint64 length,
+                                      vector<uint64> *paddrs,
+                                      ocpdiag::results::TestStep &test_step);
+
   // Prints failed dimm. This implementation is optional for
   // subclasses to implement.
   // Takes a bus address and string, and prints the DIMM name
@@ -104,12 +124,17 @@ class OsLayer {
   // Returns the HD device that contains this file.
   virtual string FindFileDevice(string filename);
 
-  // Flushes page cache. Used to circumvent the page cache when doing disk
-  // I/O.  This will be a NOP until ActivateFlushPageCache() is called, which
-  // is typically done when opening a file with O_DIRECT fails.
+  // Flushes the page cache of 'length' bytes of a file from 'offset', or up
+  // to its end if 'length' is 0.  Used to circumvent the page cache when
+  // doing disk I/O.  This will be a NOP until ActivateFlushPageCache() is
+  // called, which is typically done when opening a file with O_DIRECT fails.
   // Returns false on error, true on success or NOP.
   // Subclasses may implement this in machine specific ways.
-  virtual bool FlushPageCache(ocpdiag::results::TestStep &test_step);
+  virtual bool FlushPageCache(int fd, int64 offset, int64 length,
+                              ocpdiag::results::TestStep &test_step);
+  // Number of page cache flushes done, and the time they took in us.
+  int64 page_cache_flushes() const { return page_cache_flushes_; }
+  int64 page_cache_flush_us() const { return page_cache_flush_us_; }
   // Enable FlushPageCache() to actually do the flush instead of being a NOP.
   virtual void ActivateFlushPageCache(ocpdiag::results::TestStep &test_step);
 
@@ -286,6 +311,9 @@ class OsLayer {
   virtual bool AllocateTestMem(int64 length, uint64 paddr_base,
                                ocpdiag::results::TestStep &test_step);
   virtual void FreeTestMem();
+  // Report how much of the test memory ended up backed by transparent
+  // hugepages. Only meaningful once the memory has been touched.
+  virtual void ReportHugePageCoverage(ocpdiag::results::TestStep &test_step);
 
   // Prepares the memory for use. You must call this
   // before using test memory, and after you are done.
@@ -319,6 +347,19 @@ class OsLayer {
   // Is SAT using normal malloc'd memory, or exotic mmap'd memory.
   bool normal_mem() const { return normal_mem_; }
 
+  // Read the SMT, die, package and last level cache layout of every
+  // online cpu. Returns false if the topology is not available.
+  virtual bool FindCpuTopology(vector<CpuTopology> *topology,
+                               ocpdiag::results::TestStep &test_step);
+
+  // Return the cpu model name, to tell identical machines apart from
+  // different ones.
+  virtual string FindCpuModel();
+
+  // Read the total time, in microseconds, that some tasks were stalled on
+  // memory, from /proc/pressure/memory.  Returns false without PSI support.
+  virtual bool ReadMemoryPressure(int64 *stall_us);
+
   // Get numa config, if available..
   int num_nodes() const { return num_nodes_; }
   int num_cpus() const { return num_cpus_; }
@@ -328,6 +369,9 @@ class OsLayer {
                                unsigned int size_in_bytes,
                                AdlerChecksum *checksum);
   bool has_vector() const { return has_vector_; }
+  // Disambiguate between the C and vector checksums.
+  virtual bool AdlerChecksumMem(uint64 *mem, unsigned int size_in_bytes,
+                                AdlerChecksum *checksum);
 
   // Set a clock object that can be overridden for use with unit tests.
   void SetClock(Clock *clock) {
@@ -348,9 +392,13 @@ class OsLayer {
   bool normal_mem_;            // Memory DMA capable?
   bool use_hugepages_;         // Use hugepage shmem?
   bool use_posix_shm_;         // Use 4k page shmem?
+  bool use_memfd_hugepages_;   // Use hugetlb memfd?
+  bool use_thp_;               // Anonymous mmap advised for THP?
   bool dynamic_mapped_shmem_;  // Conserve virtual address space.
   bool mmapped_allocation_;    // Was memory allocated using mmap()?
   int shmid_;                  // Handle to shmem
+  int64 testmem_pagesize_;     // Page size backing the test memory.
+  map<int64, int64> hugepage_pools_;  // Free hugepages keyed by page size.
   vector<vector<string> > *channels_;  // Memory module names per channel.
   uint64 channel_hash_;  // Mask of address bits XORed for channel.
   int channel_width_;    // Channel width in bits.
@@ -364,6 +412,8 @@ class OsLayer {
   bool has_vector_;            // Do we have sse2/neon instructions?
   bool has_clflush_;           // Do we have clflush instructions?
   bool use_flush_page_cache_;  // Do we need to flush the page cache?
+  std::atomic<int64> page_cache_flushes_;   // Page cache flushes done, and
+  std::atomic<int64> page_cache_flush_us_;  // the time they took.
 
   time_t time_initialized_;  // Start time of test.
 
@@ -374,12 +424,51 @@ class OsLayer {
   virtual int OpenMSR(uint32 core, uint32 address,
                       ocpdiag::results::TestStep &test_step);
 
-  // Look up how many hugepages there are.
+  // Look up how many bytes the largest hugepage pool can provide.
   virtual int64 FindHugePages(ocpdiag::results::TestStep &test_step);
+  // Populate hugepage_pools_ from the per-size sysfs interface.
+  virtual void FindHugePageSizes(ocpdiag::results::TestStep &test_step);
+  // Returns the transparent hugepage size if THP may be requested through
+  // madvise(), or 0 otherwise.
+  virtual int64 FindThpSize(ocpdiag::results::TestStep &test_step);
 
   // Object to wrap the time function.
   Clock *clock_;
 
+  // A window of dynamically mapped shared memory. Windows stay mapped while
+  // referenced and are kept on an LRU list once idle, so that repeated
+  // PrepareTestMem calls do not pay for mmap, munmap and TLB shootdowns.
+  struct MappingWindow {
+    uint64 offset;   // Offset of the window into the shm object.
+    uint64 length;   // Length of the mapping.
+    char *addr;      // Where the window is mapped.
+    int64 refs;      // Outstanding pages plus per-thread pins.
+    list<MappingWindow *>::iterator lru;  // Position in mapping_lru_.
+  };
+  // Per-thread fast path, defined in os.cc.
+  struct ThreadMappingCache;
+
+  // Find or map the window at window_offset, and pin it for this thread.
+  MappingWindow *PinMappingWindow(uint64 window_offset,
+                                  ocpdiag::results::TestStep &test_step);
+  // Drop a thread's pin and hand over its outstanding page references.
+  void UnpinMappingWindow(MappingWindow *window, int64 outstanding);
+  // Drop one page reference to the window containing offset.
+  void PutMappingWindow(uint64 offset);
+  // Unmap idle windows until the mapped size fits the budget.
+  void TrimMappingWindows(ocpdiag::results::TestStep &test_step);
+  // Unmap every window, referenced or not.
+  void FreeMappingWindows();
+
+  static constexpr uint64 kMappingWindowSize = 16 * kMegabyte;
+  static constexpr uint64 kMaxMappedBytes = 512 * kMegabyte;
+  static thread_local ThreadMappingCache thread_mapping_cache_;
+
+  map<uint64, MappingWindow *> mapping_windows_;  // Live windows by offset.
+  list<MappingWindow *> mapping_lru_;  // Idle windows, oldest first.
+  uint64 mapped_bytes_;                // Total size of live windows.
+  pthread_mutex_t mapping_lock_;       // Protects the mapping cache.
+
  private:
   DISALLOW_COPY_AND_ASSIGN(OsLayer);
 };
@@ -38,6 +38,8 @@ struct page_entry {
   uint64 ts;       // Timestamp of the last read from this page.
   uint32 lastcpu;  // Last CPU to write this page.
   class Pattern *lastpattern;  // Expected Pattern at last read.
+  uint32 verified_epoch;  // Sat::verify_epoch() when the contents were last
+                          // checked, 0 if written since.
 };
 
 static inline void init_pe(struct page_entry *pe) {
@@ -48,6 +50,7 @@ static inline void init_pe(struct page_entry *pe) {
   pe->touch = 0;
   pe->ts = 0;
   pe->lastcpu = 0;
+  pe->verified_epoch = 0;
 }
 
 // This is a threadsafe randomized queue of pages for
@@ -13,16 +13,22 @@
 // stressapptest can be run using memory only, or using many system components.
 
 #include <errno.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/times.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <iostream>
 #include <memory>
 
 // #define __USE_GNU
@@ -31,6 +37,7 @@
 
 #include <list>
 #include <string>
+#include <tuple>
 
 // This file must work with autoconf on its public version,
 // so these includes are correct.
@@ -40,16 +47,27 @@
 #include "ocpdiag/core/results/data_model/dut_info.h"
 #include "ocpdiag/core/results/data_model/input_model.h"
 #include "ocpdiag/core/results/data_model/input_model_helpers.h"
+#include "ocpdiag/core/results/measurement_series.h"
 #include "ocpdiag/core/results/test_step.h"
 #include "os.h"
 #include "sat.h"
 #include "sattypes.h"
 #include "worker.h"
 
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+
 using ::ocpdiag::results::Error;
 using ::ocpdiag::results::Log;
 using ::ocpdiag::results::LogSeverity;
 using ::ocpdiag::results::Measurement;
+using ::ocpdiag::results::MeasurementSeries;
+using ::ocpdiag::results::MeasurementSeriesElement;
+using ::ocpdiag::results::MeasurementSeriesStart;
 using ::ocpdiag::results::TestStep;
 using ::ocpdiag::results::Validator;
 using ::ocpdiag::results::ValidatorType;
@@ -288,6 +306,7 @@ bool Sat::PutEmpty(struct page_entry *pe, TestStep &test_step) {
     os_->ReleaseTestMem(pe->addr, pe->offset, page_length_,
                         test_step);  // Unmap the page.
   pe->addr = 0;
+  pe->verified_epoch = 0;
 
   // Put empty page depending on implementation.
   if (pe_q_implementation_ == SAT_FINELOCK)
@@ -298,85 +317,186 @@ bool Sat::PutEmpty(struct page_entry *pe, TestStep &test_step) {
     return false;
 }
 
-// Set up the bitmap of physical pages in case we want to see which pages were
-// accessed under this run of SAT.
-void Sat::AddrMapInit(TestStep &fill_step) {
-  if (!do_page_map_) return;
-  // Find about how much physical mem is in the system.
-  // TODO(nsanders): Find some way to get the max
-  // and min phys addr in the system.
-  uint64 maxsize = os_->FindFreeMemSize(fill_step) * 4;
-  sat_assert(maxsize != 0);
+namespace {
+// Sorts extents by start address and merges overlapping or adjacent ones.
+void CoalesceExtents(vector<PhysExtent> *extents) {
+  if (extents->empty()) return;
+  vector<PhysExtent>::iterator out = extents->begin();
+  for (vector<PhysExtent>::iterator it = out + 1; it != extents->end(); ++it) {
+    if (it->start <= out->end) {
+      out->end = max(out->end, it->end);
+    } else {
+      *++out = *it;
+    }
+  }
+  extents->erase(out + 1, extents->end());
+}
 
-  // Make a bitmask of this many pages. Assume that the memory is relatively
-  // zero based. This is true on x86, typically.
-  // This is one bit per page.
-  uint64 arraysize = maxsize / 4096 / 8;
-  unsigned char *bitmap = new unsigned char[arraysize];
-  sat_assert(bitmap);
+void *SortExtentsThread(void *arg) {
+  vector<PhysExtent> *extents = static_cast<vector<PhysExtent> *>(arg);
+  sort(extents->begin(), extents->end(),
+       [](const PhysExtent &a, const PhysExtent &b) {
+         return a.start < b.start;
+       });
+  CoalesceExtents(extents);
+  return NULL;
+}
 
-  // Mark every page as 0, not seen.
-  memset(bitmap, 0, arraysize);
+// Merges the second of a pair of sorted extent lists into the first.
+void *MergeExtentsThread(void *arg) {
+  vector<PhysExtent> *lists = static_cast<vector<PhysExtent> *>(arg);
+  vector<PhysExtent> merged(lists[0].size() + lists[1].size());
+  merge(lists[0].begin(), lists[0].end(), lists[1].begin(), lists[1].end(),
+        merged.begin(), [](const PhysExtent &a, const PhysExtent &b) {
+          return a.start < b.start;
+        });
+  CoalesceExtents(&merged);
+  lists[0].swap(merged);
+  lists[1].clear();
+  return NULL;
+}
+}  // namespace
 
-  page_bitmap_size_ = maxsize;
-  page_bitmap_ = bitmap;
+// Set up the list of physical ranges in case we want to see which pages were
+// accessed under this run of SAT.
+void Sat::AddrMapInit(TestStep &fill_step) {
+  if (!do_page_map_) return;
+  page_extents_.clear();
+  page_extents_.reserve(pages_);
 }
 
-// Add the 4k pages in this block to the array of pages SAT has seen.
+// Add the physical ranges backing this block to the list SAT has seen.
+// The whole block is translated with a single pagemap read.
 void Sat::AddrMapUpdate(struct page_entry *pe, TestStep &fill_step) {
   if (!do_page_map_) return;
 
-  // Go through 4k page blocks.
-  uint64 arraysize = page_bitmap_size_ / 4096 / 8;
-
-  char *base = reinterpret_cast<char *>(pe->addr);
-  for (int i = 0; i < page_length_; i += 4096) {
-    uint64 paddr = os_->VirtualToPhysical(base + i, fill_step);
-
-    uint32 offset = paddr / 4096 / 8;
-    unsigned char mask = 1 << ((paddr / 4096) % 8);
+  vector<uint64> paddrs;
+  if (!os_->VirtualToPhysicalRange(pe->addr, page_length_, &paddrs,
+                                   fill_step))
+    return;
+
+  int64 pagesize = sysconf(_SC_PAGESIZE);
+  for (size_t i = 0; i < paddrs.size(); i++) {
+    if (!paddrs[i]) continue;
+    // Extend the previous extent if the frames are physically contiguous.
+    if (!page_extents_.empty() && page_extents_.back().end == paddrs[i]) {
+      page_extents_.back().end += pagesize;
+    } else {
+      page_extents_.push_back(PhysExtent{paddrs[i], paddrs[i] + pagesize});
+    }
+  }
+}
 
-    if (offset >= arraysize) {
-      fill_step.AddError({Error{
-          .symptom = kProcessError,
-          .message = absl::StrFormat("Physical address %#llx is greater than "
-                                     "the expected limit %#llx.",
-                                     paddr, page_bitmap_size_),
-      }});
-      sat_assert(0);
+// Sort and coalesce the extent list. Each cpu sorts a slice, then the
+// slices are merged pairwise in parallel.
+void Sat::AddrMapMerge() {
+  size_t slices = min(static_cast<size_t>(CpuCount()),
+                      page_extents_.size() / 4096 + 1);
+  vector<vector<PhysExtent> > lists(slices);
+  size_t per_slice = page_extents_.size() / slices + 1;
+  for (size_t i = 0; i < slices; i++) {
+    size_t first = min(i * per_slice, page_extents_.size());
+    size_t last = min(first + per_slice, page_extents_.size());
+    lists[i].assign(page_extents_.begin() + first,
+                    page_extents_.begin() + last);
+  }
+  page_extents_.clear();
+
+  vector<pthread_t> threads(slices);
+  for (size_t i = 0; i < slices; i++)
+    pthread_create(&threads[i], NULL, SortExtentsThread, &lists[i]);
+  for (size_t i = 0; i < slices; i++) pthread_join(threads[i], NULL);
+
+  // Merge neighbours at doubling strides until one list is left.
+  for (size_t stride = 1; stride < slices; stride *= 2) {
+    vector<vector<PhysExtent> > pair_lists;
+    size_t spawned = 0;
+    for (size_t i = 0; i + stride < slices; i += 2 * stride) {
+      // The merge thread expects the two lists side by side.
+      lists[i + 1].swap(lists[i + stride]);
+      pthread_create(&threads[spawned++], NULL, MergeExtentsThread, &lists[i]);
     }
-    page_bitmap_[offset] |= mask;
+    for (size_t i = 0; i < spawned; i++) pthread_join(threads[i], NULL);
+  }
+  page_extents_.swap(lists[0]);
+}
+
+// Write the physical ranges as a binary file: the magic "SATPMAP1", a
+// little endian uint64 extent count, then start/end uint64 pairs.
+bool Sat::AddrMapWrite(TestStep &fill_step) {
+  int fd = open(page_map_file_, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fill_step.AddError(Error{
+        .symptom = kProcessError,
+        .message = absl::StrFormat("Unable to open page map file %s: %s.",
+                                   page_map_file_, ErrorString(errno)),
+    });
+    return false;
+  }
+  uint64 count = page_extents_.size();
+  size_t bytes = count * sizeof(PhysExtent);
+  bool ok = (write(fd, "SATPMAP1", 8) == 8) &&
+            (write(fd, &count, sizeof(count)) == sizeof(count)) &&
+            (write(fd, page_extents_.data(), bytes) ==
+             static_cast<ssize_t>(bytes));
+  if (!ok) {
+    fill_step.AddError(Error{
+        .symptom = kProcessError,
+        .message = absl::StrFormat("Unable to write page map file %s: %s.",
+                                   page_map_file_, ErrorString(errno)),
+    });
   }
+  close(fd);
+  return ok;
 }
 
 // Print out the physical memory ranges that SAT has accessed.
 void Sat::AddrMapPrint(TestStep &fill_step) {
   if (!do_page_map_) return;
 
-  uint64 pages = page_bitmap_size_ / 4096;
+  AddrMapMerge();
+
+  uint64 total = 0;
+  for (const PhysExtent &extent : page_extents_)
+    total += extent.end - extent.start;
+  fill_step.AddMeasurement(Measurement{
+      .name = "Physical Memory Ranges Accessed",
+      .unit = "ranges",
+      .value = static_cast<double>(page_extents_.size()),
+  });
+  fill_step.AddMeasurement(Measurement{
+      .name = "Physical Memory Accessed",
+      .unit = "MB",
+      .value = static_cast<double>(total) / kMegabyte,
+  });
 
-  uint64 last_page = 0;
-  bool valid_range = false;
+  if (page_map_file_[0]) {
+    if (AddrMapWrite(fill_step)) {
+      fill_step.AddLog(
+          Log{.severity = LogSeverity::kInfo,
+              .message = absl::StrFormat(
+                  "Wrote %d physical memory ranges to %s.",
+                  page_extents_.size(), page_map_file_)});
+    }
+    return;
+  }
 
   fill_step.AddLog(
       Log{.severity = LogSeverity::kInfo,
           .message =
               "Printing physical memory ranges that this test has accessed."});
 
-  for (uint64 i = 0; i < pages; i++) {
-    int offset = i / 8;
-    unsigned char mask = 1 << (i % 8);
-
-    bool touched = page_bitmap_[offset] & mask;
-    if (touched && !valid_range) {
-      valid_range = true;
-      last_page = i * 4096;
-    } else if (!touched && valid_range) {
-      valid_range = false;
+  // Batch ranges into a few logs rather than one log per range.
+  static const int kRangesPerLog = 64;
+  string ranges;
+  for (size_t i = 0; i < page_extents_.size(); i++) {
+    if (!ranges.empty()) ranges += "\n";
+    absl::StrAppendFormat(&ranges, "%#016llx - %#016llx",
+                          page_extents_[i].start, page_extents_[i].end - 1);
+    if ((i + 1) % kRangesPerLog == 0 || i + 1 == page_extents_.size()) {
       fill_step.AddLog(
-          Log{.severity = LogSeverity::kInfo,
-              .message = absl::StrFormat("%#016llx - %#016llx", last_page,
-                                         (i * 4096) - 1)});
+          Log{.severity = LogSeverity::kInfo, .message = ranges});
+      ranges.clear();
     }
   }
   fill_step.AddLog(Log{.severity = LogSeverity::kInfo,
@@ -398,8 +518,10 @@ bool Sat::InitializePages() {
   });
 
   // Calculate needed page totals.
+  // Disk threads hold a page for every write in flight.
   double neededpages = memory_threads_ + invert_threads_ + check_threads_ +
-                       net_threads_ + file_threads_;
+                       net_threads_ + file_threads_ +
+                       disk_threads_ * queue_depth_;
   fill_step->AddMeasurement(Measurement{
       .name = "Required Thread Memory Page Count",
       .unit = "pages",
@@ -468,67 +590,15 @@ bool Sat::InitializePages() {
   }
 
   // Fill valid pages with test patterns.
-  // Use fill threads to do this.
-  WorkerStatus fill_status;
-  WorkerVector fill_vector;
-
-  fill_step->AddLog(
-      Log{.severity = LogSeverity::kDebug,
-          .message = absl::StrFormat(
-              "Starting memory page fill threads: %d threads, %d pages",
-              fill_threads_, pages_)});
-  // Initialize the fill threads.
-  for (int i = 0; i < fill_threads_; i++) {
-    FillThread *thread = new FillThread();
-    thread->InitThread(i, this, os_, patternlist_, &fill_status,
-                       fill_step.get());
-    if (i != fill_threads_ - 1) {
-      fill_step->AddLog(
-          Log{.severity = LogSeverity::kDebug,
-              .message = absl::StrFormat(
-                  "Starting memory page fill Thread %d to fill %d pages", i,
-                  pages_ / fill_threads_)});
-      thread->SetFillPages(pages_ / fill_threads_);
-      // The last thread finishes up all the leftover pages.
-    } else {
-      fill_step->AddLog(
-          Log{.severity = LogSeverity::kDebug,
-              .message = absl::StrFormat(
-                  "Starting memory page fill Thread %d to fill %d pages", i,
-                  pages_ - pages_ / fill_threads_ * i)});
-      thread->SetFillPages(pages_ - pages_ / fill_threads_ * i);
-    }
-    fill_vector.push_back(thread);
-  }
-
-  // Spawn the fill threads.
-  fill_status.Initialize();
-  for (WorkerVector::const_iterator it = fill_vector.begin();
-       it != fill_vector.end(); ++it)
-    (*it)->SpawnThread();
-
-  // Reap the finished fill threads.
-  for (WorkerVector::const_iterator it = fill_vector.begin();
-       it != fill_vector.end(); ++it) {
-    (*it)->JoinThread();
-    if ((*it)->GetStatus() != 1) {
-      fill_step->AddError(Error{
-          .symptom = kProcessError,
-          .message = absl::StrFormat(
-              "Memory page fill thread %d failed with status %d after running "
-              "for %.2f seconds. See error logs for additional information.",
-              (*it)->ThreadID(), (*it)->GetStatus(),
-              (*it)->GetRunDurationUSec() * 1.0 / 1000000)});
-      return false;
-    }
-    delete (*it);
-  }
-  fill_vector.clear();
-  fill_status.Destroy();
+  if (!FillPages(pages_, *fill_step)) return false;
   fill_step->AddLog(
       Log{.severity = LogSeverity::kDebug,
           .message = "Done filling memory pages. Starting to allocate pages."});
 
+  // Now that every page has been touched, check how much of the test memory
+  // the kernel managed to back with transparent hugepages.
+  os_->ReportHugePageCoverage(*fill_step);
+
   AddrMapInit(*fill_step);
 
   // Initialize page locations.
@@ -585,6 +655,81 @@ bool Sat::InitializePages() {
   return true;
 }
 
+// Fills 'pages' empty pages with test patterns, making them valid.
+bool Sat::FillPages(int64 pages, TestStep &test_step) {
+  // Use fill threads to do this.
+  WorkerStatus fill_status;
+  WorkerVector fill_vector;
+
+  test_step.AddLog(
+      Log{.severity = LogSeverity::kDebug,
+          .message = absl::StrFormat(
+              "Starting memory page fill threads: %d threads, %d pages",
+              fill_threads_, pages)});
+  // Initialize the fill threads.
+  for (int i = 0; i < fill_threads_; i++) {
+    FillThread *thread = new FillThread();
+    thread->InitThread(i, this, os_, patternlist_, &fill_status, &test_step);
+    if (i != fill_threads_ - 1) {
+      test_step.AddLog(
+          Log{.severity = LogSeverity::kDebug,
+              .message = absl::StrFormat(
+                  "Starting memory page fill Thread %d to fill %d pages", i,
+                  pages / fill_threads_)});
+      thread->SetFillPages(pages / fill_threads_);
+      // The last thread finishes up all the leftover pages.
+    } else {
+      test_step.AddLog(
+          Log{.severity = LogSeverity::kDebug,
+              .message = absl::StrFormat(
+                  "Starting memory page fill Thread %d to fill %d pages", i,
+                  pages - pages / fill_threads_ * i)});
+      thread->SetFillPages(pages - pages / fill_threads_ * i);
+    }
+    fill_vector.push_back(thread);
+  }
+
+  // Spawn the fill threads.
+  fill_status.Initialize();
+  for (WorkerVector::const_iterator it = fill_vector.begin();
+       it != fill_vector.end(); ++it)
+    (*it)->SpawnThread();
+
+  // Reap the finished fill threads.
+  for (WorkerVector::const_iterator it = fill_vector.begin();
+       it != fill_vector.end(); ++it) {
+    (*it)->JoinThread();
+    if ((*it)->GetStatus() != 1) {
+      test_step.AddError(Error{
+          .symptom = kProcessError,
+          .message = absl::StrFormat(
+              "Memory page fill thread %d failed with status %d after running "
+              "for %.2f seconds. See error logs for additional information.",
+              (*it)->ThreadID(), (*it)->GetStatus(),
+              (*it)->GetRunDurationUSec() * 1.0 / 1000000)});
+      return false;
+    }
+    delete (*it);
+  }
+  fill_vector.clear();
+  fill_status.Destroy();
+  return true;
+}
+
+// Refills memory after a run.  The final check of a run leaves every page
+// empty, so fill all but freepages_ of them again with fresh patterns.  Page
+// locations, tags and regions are kept from InitializePages().
+bool Sat::RefillPages(TestStep &test_step) {
+  int64 start_us = sat_get_time_us();
+  if (!FillPages(pages_ - freepages_, test_step)) return false;
+  test_step.AddMeasurement(Measurement{
+      .name = "Memory Refill Time",
+      .unit = "s",
+      .value = (sat_get_time_us() - start_us) / 1000000.0,
+  });
+  return true;
+}
+
 // Initializes the resources that SAT needs to run.
 // This needs to be called before Run(), and after ParseArgs().
 // Returns true on success, false on error, and will exit() on help message.
@@ -696,6 +841,10 @@ bool Sat::Initialize() {
 
   if (!InitializePages()) return false;
 
+  if (auto_tune_ && !monitor_mode_ && memory_threads_ > 0 &&
+      !AutoTuneCopyThreads())
+    return false;
+
   return true;
 }
 
@@ -716,6 +865,10 @@ Sat::Sat() {
   channel_width_ = 64;
 
   user_break_ = false;
+  run_event_fd_ = -1;
+  run_wakers_ = 0;
+  run_timer_fd_ = -1;
+  errors_found_ = 0;
   verbosity_ = 8;
   Logger::GlobalLogger()->SetVerbosity(verbosity_);
   print_delay_ = 10;
@@ -734,8 +887,23 @@ Sat::Sat() {
   stop_on_error_ = false;
 
   do_page_map_ = false;
-  page_bitmap_ = 0;
-  page_bitmap_size_ = 0;
+  page_map_file_[0] = 0;
+
+  copy_budget_mbps_ = 0;
+  invert_budget_mbps_ = 0;
+  check_budget_mbps_ = 0;
+  sched_idle_ = false;
+  nice_ = 0;
+  psi_threshold_ = 0;
+  last_stall_us_ = 0;
+  last_stall_ms_ = 0;
+  psi_backoffs_ = 0;
+  load_profile_file_[0] = 0;
+  daemon_socket_[0] = 0;
+  daemon_output_dir_[0] = 0;
+  sample_interval_ms_ = 1000;
+  embedded_ = false;
+  run_thread_started_ = false;
 
   // Cache coherency data initialization.
   cc_test_ = false;         // Flag to trigger cc threads.
@@ -763,14 +931,21 @@ Sat::Sat() {
   total_threads_ = 0;
 
   use_affinity_ = true;
+  placement_policy_ = kPlaceAlternate;
+  yield_policy_ = kYieldAuto;
+  auto_tune_ = false;
+  auto_tune_ms_ = 1000;
+  tune_profile_file_[0] = 0;
   region_mask_ = 0;
   region_count_ = 0;
+  verify_epoch_ = 1;
   for (int i = 0; i < 32; i++) {
     region_[i] = 0;
   }
   region_mode_ = 0;
 
   errorcount_ = 0;
+  tune_errors_ = 0;
   statuscount_ = 0;
 
   valid_ = 0;
@@ -783,7 +958,7 @@ Sat::Sat() {
   patternlist_ = 0;
   logfilename_[0] = 0;
 
-  read_block_size_ = 512;
+  read_block_size_ = -1;
   write_block_size_ = -1;
   segment_size_ = -1;
   cache_size_ = -1;
@@ -791,12 +966,21 @@ Sat::Sat() {
   read_threshold_ = -1;
   write_threshold_ = -1;
   non_destructive_ = 1;
+  io_engine_ = DiskThread::kIoEngineAuto;
+  queue_depth_ = 1;
+  submit_batch_ = 0;
+  disk_pipeline_ = false;
+  disk_latency_interval_ = 10;
+  disk_iops_ = 0;
+  disk_mbps_ = 0;
+  disk_thread_iops_ = 0;
+  disk_thread_mbps_ = 0;
   monitor_mode_ = 0;
   tag_mode_ = 0;
   random_threads_ = 0;
 
-  pause_delay_ = 600;
-  pause_duration_ = 15;
+  pause_delay_ms_ = 600 * 1000;
+  pause_duration_ms_ = 15 * 1000;
 }
 
 // Destructor.
@@ -909,6 +1093,78 @@ bool Sat::ParseArgs(int argc, const char **argv) {
     ARG_KVALUE("--local_numa", region_mode_, kLocalNuma);
     ARG_KVALUE("--remote_numa", region_mode_, kRemoteNuma);
 
+    // Choose how memory copy and cpu stress threads are pinned.
+    if (!strcmp(argv[i], "--placement")) {
+      i++;
+      if (i < argc) {
+        if (!strcmp(argv[i], "alternate")) {
+          placement_policy_ = kPlaceAlternate;
+        } else if (!strcmp(argv[i], "core")) {
+          placement_policy_ = kPlaceCore;
+        } else if (!strcmp(argv[i], "smt")) {
+          placement_policy_ = kPlaceSmt;
+        } else if (!strcmp(argv[i], "llc")) {
+          placement_policy_ = kPlaceLlc;
+        } else if (!strcmp(argv[i], "socket")) {
+          placement_policy_ = kPlaceSocket;
+        } else {
+          if (embedded_) {
+            fprintf(stderr, "Unknown placement policy %s\n", argv[i]);
+            return false;
+          }
+          PrintHelp();
+          printf("\n Unknown placement policy %s\n", argv[i]);
+          exit(1);
+        }
+      }
+      continue;
+    }
+
+    // Run at reduced intensity.
+    ARG_IVALUE("--copy_mbps", copy_budget_mbps_);
+    ARG_IVALUE("--invert_mbps", invert_budget_mbps_);
+    ARG_IVALUE("--check_mbps", check_budget_mbps_);
+    ARG_KVALUE("--sched_idle", sched_idle_, true);
+    ARG_IVALUE("--nice", nice_);
+    ARG_IVALUE("--psi_backoff", psi_threshold_);
+
+    // Choose when cpu bound workers yield between pages.
+    if (!strcmp(argv[i], "--yield_policy")) {
+      i++;
+      if (i < argc) {
+        if (!strcmp(argv[i], "auto")) {
+          yield_policy_ = kYieldAuto;
+        } else if (!strcmp(argv[i], "always")) {
+          yield_policy_ = WorkerThread::kYieldAlways;
+        } else if (!strcmp(argv[i], "pause")) {
+          yield_policy_ = WorkerThread::kYieldPause;
+        } else if (!strcmp(argv[i], "never")) {
+          yield_policy_ = WorkerThread::kYieldNever;
+        } else {
+          if (embedded_) {
+            fprintf(stderr, "Unknown yield policy %s\n", argv[i]);
+            return false;
+          }
+          PrintHelp();
+          printf("\n Unknown yield policy %s\n", argv[i]);
+          exit(1);
+        }
+      }
+      continue;
+    }
+
+    // Pick the number of copy threads by measuring bandwidth.
+    ARG_KVALUE("--auto_tune", auto_tune_, true);
+    ARG_IVALUE("--auto_tune_ms", auto_tune_ms_);
+    if (!strcmp(argv[i], "--tune_profile")) {
+      auto_tune_ = true;
+      i++;
+      if (i < argc)
+        snprintf(tune_profile_file_, sizeof(tune_profile_file_), "%s",
+                 argv[i]);
+      continue;
+    }
+
     // Inject errors to force miscompare code paths
     ARG_KVALUE("--force_errors", error_injection_, true);
     ARG_KVALUE("--force_errors_like_crazy", crazy_error_injection_, true);
@@ -950,6 +1206,45 @@ bool Sat::ParseArgs(int argc, const char **argv) {
     // Do not write anything to disk in the disk test.
     ARG_KVALUE("--destructive", non_destructive_, 0);
 
+    // I/O engine used by the disk test.
+    if (!strcmp(argv[i], "--io-engine")) {
+      i++;
+      if (i < argc) {
+        if (!strcmp(argv[i], "auto")) {
+          io_engine_ = DiskThread::kIoEngineAuto;
+        } else if (!strcmp(argv[i], "aio")) {
+          io_engine_ = DiskThread::kIoEngineAio;
+        } else if (!strcmp(argv[i], "uring")) {
+          io_engine_ = DiskThread::kIoEngineUring;
+        } else {
+          if (embedded_) {
+            fprintf(stderr, "Unknown I/O engine %s\n", argv[i]);
+            return false;
+          }
+          PrintHelp();
+          printf("\n Unknown I/O engine %s\n", argv[i]);
+          exit(1);
+        }
+      }
+      continue;
+    }
+
+    // Number of disk requests in flight, and how many to submit at once.
+    ARG_IVALUE("--queue-depth", queue_depth_);
+    ARG_IVALUE("--submit-batch", submit_batch_);
+
+    // Verify disk blocks while writing new ones.
+    ARG_KVALUE("--disk-pipeline", disk_pipeline_, true);
+
+    // Seconds between disk latency summaries.
+    ARG_IVALUE("--disk-latency-interval", disk_latency_interval_);
+
+    // Limit the requests and bandwidth of each disk, and of each thread.
+    ARG_IVALUE("--disk-iops", disk_iops_);
+    ARG_IVALUE("--disk-mbps", disk_mbps_);
+    ARG_IVALUE("--disk-thread-iops", disk_thread_iops_);
+    ARG_IVALUE("--disk-thread-mbps", disk_thread_mbps_);
+
     // Run SAT in monitor mode. No test load at all.
     ARG_KVALUE("--monitor_mode", monitor_mode_, true);
 
@@ -959,14 +1254,40 @@ bool Sat::ParseArgs(int argc, const char **argv) {
     // Dump range map of tested pages..
     ARG_KVALUE("--do_page_map", do_page_map_, true);
 
+    // Write the range map of tested pages to a binary file.
+    ARG_SVALUE("--page_map_file", page_map_file_);
+
     // Specify the physical address base to test.
     ARG_IVALUE("--paddr_base", paddr_base_);
 
     // Specify the frequency for power spikes.
-    ARG_IVALUE("--pause_delay", pause_delay_);
+    ARG_IVALUE("--pause_delay_ms", pause_delay_ms_);
+    if (!strcmp(argv[i], "--pause_delay")) {
+      i++;
+      if (i < argc) pause_delay_ms_ = strtoull(argv[i], NULL, 0) * 1000;
+      continue;
+    }
 
     // Specify the duration of each pause (for power spikes).
-    ARG_IVALUE("--pause_duration", pause_duration_);
+    ARG_IVALUE("--pause_duration_ms", pause_duration_ms_);
+    if (!strcmp(argv[i], "--pause_duration")) {
+      i++;
+      if (i < argc) pause_duration_ms_ = strtoull(argv[i], NULL, 0) * 1000;
+      continue;
+    }
+
+    // Load profile to cycle the worker threads through.
+    if (!strcmp(argv[i], "--load_profile")) {
+      i++;
+      if (i < argc)
+        snprintf(load_profile_file_, sizeof(load_profile_file_), "%s",
+                 argv[i]);
+      continue;
+    }
+
+    // Unix socket to serve run requests on, keeping memory filled between.
+    ARG_SVALUE("--daemon", daemon_socket_);
+    ARG_SVALUE("--daemon_output_dir", daemon_output_dir_);
 
     // Disk device names
     if (!strcmp(argv[i], "-d")) {
@@ -1030,6 +1351,10 @@ bool Sat::ParseArgs(int argc, const char **argv) {
     }
 
     // Default:
+    if (embedded_) {
+      fprintf(stderr, "Unknown argument %s\n", argv[i]);
+      return false;
+    }
     PrintHelp();
     if (strcmp(argv[i], "-h") && strcmp(argv[i], "--help")) {
       printf("\n Unknown argument %s\n", argv[i]);
@@ -1049,12 +1374,48 @@ bool Sat::ParseArgs(int argc, const char **argv) {
   // Set logfile flag.
   if (strcmp(logfilename_, "")) use_logfile_ = true;
 
+  // A page map file needs the page map.
+  if (page_map_file_[0]) do_page_map_ = true;
+
   cmdline_ = ocpdiag::results::CommandLineStringFromMainArgs(argc, argv);
   cmdline_json_ = ocpdiag::results::ParameterJsonFromMainArgs(argc, argv);
 
   return true;
 }
 
+// Configures SAT from typed options.  They are turned into the equivalent
+// command line, so that both share the same parsing and reporting.
+bool Sat::Configure(const SatOptions &options) {
+  vector<string> args = {
+      "stressapptest",
+      "-s", absl::StrCat(options.runtime_seconds),
+      "-m", absl::StrCat(options.copy_threads),
+      "-i", absl::StrCat(options.invert_threads),
+      "-c", absl::StrCat(options.check_threads),
+      "-C", absl::StrCat(options.cpu_threads),
+      "-v", absl::StrCat(options.verbosity),
+  };
+  if (options.memory_mb) {
+    args.push_back("-M");
+    args.push_back(absl::StrCat(options.memory_mb));
+  }
+  if (options.max_errors) {
+    args.push_back("--max_errors");
+    args.push_back(absl::StrCat(options.max_errors));
+  }
+  if (options.stop_on_error) args.push_back("--stop_on_errors");
+  args.insert(args.end(), options.args.begin(), options.args.end());
+
+  vector<const char *> argv;
+  for (const string &arg : args) argv.push_back(arg.c_str());
+
+  embedded_ = true;
+  bandwidth_callback_ = options.on_bandwidth;
+  error_callback_ = options.on_error;
+  sample_interval_ms_ = options.sample_interval_ms;
+  return ParseArgs(argv.size(), argv.data());
+}
+
 bool Sat::ValidateArgs() {
   // Checks valid page length.
   if (page_length_ && !(page_length_ & (page_length_ - 1)) &&
@@ -1126,6 +1487,82 @@ bool Sat::ValidateArgs() {
     }
   }
 
+  if (pause_delay_ms_ <= 0 || pause_duration_ms_ < 0) {
+    test_run_->AddPreStartError(Error{
+        .symptom = kProcessError,
+        .message = absl::StrFormat(
+            "Invalid power spike timing: pause delay %lld ms, pause duration "
+            "%lld ms",
+            pause_delay_ms_, pause_duration_ms_),
+    });
+    return false;
+  }
+
+  if (copy_budget_mbps_ < 0 || invert_budget_mbps_ < 0 ||
+      check_budget_mbps_ < 0 || psi_threshold_ < 0 || psi_threshold_ > 100) {
+    test_run_->AddPreStartError(Error{
+        .symptom = kProcessError,
+        .message = "Bandwidth limits and the memory pressure threshold must "
+                   "not be negative, and the threshold is a percentage.",
+    });
+    return false;
+  }
+  if (disk_iops_ < 0 || disk_mbps_ < 0 || disk_thread_iops_ < 0 ||
+      disk_thread_mbps_ < 0) {
+    test_run_->AddPreStartError(Error{
+        .symptom = kProcessError,
+        .message = "Disk request and bandwidth limits must not be negative.",
+    });
+    return false;
+  }
+  if (psi_threshold_ &&
+      !(copy_budget_mbps_ || invert_budget_mbps_ || check_budget_mbps_)) {
+    test_run_->AddPreStartError(Error{
+        .symptom = kProcessError,
+        .message = "--psi_backoff scales the bandwidth limits, set at least "
+                   "one of --copy_mbps, --invert_mbps or --check_mbps.",
+    });
+    return false;
+  }
+
+  if (auto_tune_ && auto_tune_ms_ <= 0) {
+    test_run_->AddPreStartError(Error{
+        .symptom = kProcessError,
+        .message = absl::StrFormat("Invalid auto tune step time %d ms",
+                                   auto_tune_ms_),
+    });
+    return false;
+  }
+
+  if (load_profile_file_[0] && !ParseLoadProfile()) return false;
+
+  if (bandwidth_callback_ && sample_interval_ms_ <= 0) {
+    test_run_->AddPreStartError(Error{
+        .symptom = kProcessError,
+        .message = absl::StrFormat("Invalid bandwidth sample interval %d ms",
+                                   sample_interval_ms_),
+    });
+    return false;
+  }
+
+  if (daemon_mode() && monitor_mode_) {
+    test_run_->AddPreStartError(Error{
+        .symptom = kProcessError,
+        .message = "--daemon needs test memory, it can't be used together "
+                   "with --monitor_mode.",
+    });
+    return false;
+  }
+
+  if (strlen(daemon_socket_) >= sizeof(sockaddr_un::sun_path)) {
+    test_run_->AddPreStartError(Error{
+        .symptom = kProcessError,
+        .message = absl::StrFormat("Daemon socket path %s is too long",
+                                   daemon_socket_),
+    });
+    return false;
+  }
+
   return true;
 }
 
@@ -1162,7 +1599,8 @@ void Sat::PrintHelp() {
       "to test error handling\n"
       " -F               don't result check each transaction\n"
       " --stop_on_errors  Stop after finding the first error.\n"
-      " --read-block-size     size of block for reading (-d)\n"
+      " --read-block-size     size of block for reading (-d). If not "
+      "defined, the physical sector size of the disk\n"
       " --write-block-size    size of block for writing (-d). If not "
       "defined, the size of block for writing will be defined as the "
       "size of block for reading\n"
@@ -1171,12 +1609,28 @@ void Sat::PrintHelp() {
       " --blocks-per-segment  number of blocks to read/write per "
       "segment per iteration (-d)\n"
       " --read-threshold      maximum time (in us) a block read should "
-      "take (-d)\n"
+      "take, slower reads make disk threads back off (-d)\n"
       " --write-threshold     maximum time (in us) a block write "
-      "should take (-d)\n"
+      "should take, slower writes make disk threads back off.  A request "
+      "that times out still stops a write thread (-d)\n"
       " --random-threads      number of random threads for each disk "
       "write thread (-d)\n"
       " --destructive    write/wipe disk partition (-d)\n"
+      " --io-engine e    disk I/O engine: auto, aio or uring (-d)\n"
+      " --queue-depth n  number of requests each disk thread keeps in "
+      "flight, needs io_uring above 1 (-d)\n"
+      " --submit-batch n number of queued requests handed to the kernel "
+      "at once, default the queue depth (-d)\n"
+      " --disk-pipeline  verify blocks while writing new ones, instead of "
+      "alternating write and read phases (-d)\n"
+      " --disk-latency-interval n  seconds between disk latency "
+      "summaries, 0 for a summary at the end only (-d)\n"
+      " --disk-iops n    limit each disk to 'n' requests per second in "
+      "total (-d)\n"
+      " --disk-mbps n    limit each disk to 'n' MB/s in total (-d)\n"
+      " --disk-thread-iops n  limit each disk thread to 'n' requests per "
+      "second (-d)\n"
+      " --disk-thread-mbps n  limit each disk thread to 'n' MB/s (-d)\n"
       " --monitor_mode   only do ECC error polling, no stress load.\n"
       " --cc_test        do the cache coherency testing\n"
       " --cc_inc_count   number of times to increment the "
@@ -1190,14 +1644,52 @@ void Sat::PrintHelp() {
       "goes below this value (specified in MHz)\n"
       " --cpu_freq_round round the computed frequency to this value, if set"
       " to zero, only round to the nearest MHz\n"
+      " --do_page_map    print the physical memory ranges tested\n"
+      " --page_map_file f  write the physical memory ranges tested to "
+      "binary file 'f' instead of printing them\n"
       " --paddr_base     allocate memory starting from this address\n"
       " --pause_delay    delay (in seconds) between power spikes\n"
+      " --pause_delay_ms delay (in milliseconds) between power spikes\n"
       " --pause_duration duration (in seconds) of each pause\n"
+      " --pause_duration_ms  duration (in milliseconds) of each pause\n"
+      " --load_profile f cycle through the load segments in file 'f'. Each "
+      "line is '<duration_ms> [copy|invert|cpu|disk=<level>]...', where a "
+      "level is a thread count 'n', a fraction 'n%%', a ramp 'a..b' of either, "
+      "or 'random'. Unlisted types run all threads, '#' starts a comment\n"
       " --no_affinity    do not set any cpu affinity\n"
       " --local_numa     choose memory regions associated with "
       "each CPU to be tested by that CPU\n"
       " --remote_numa    choose memory regions not associated with "
       "each CPU to be tested by that CPU\n"
+      " --placement p    pin memory copy and cpu stress threads by policy "
+      "'p': alternate (default), core (one per physical core), smt (fill "
+      "SMT siblings), llc (spread across last level caches) or socket "
+      "(pack a single socket)\n"
+      " --copy_mbps n    limit memory copy threads to 'n' MB/s of memory "
+      "traffic in total\n"
+      " --invert_mbps n  limit memory invert threads to 'n' MB/s in total\n"
+      " --check_mbps n   limit mid-test check threads to 'n' MB/s in total\n"
+      " --sched_idle     run worker threads under SCHED_IDLE\n"
+      " --nice n         run worker threads at nice level 'n'\n"
+      " --psi_backoff p  cut the MB/s limits while tasks are stalled on "
+      "memory more than 'p' percent of the time (/proc/pressure/memory)\n"
+      " --yield_policy p when copy, invert and cpu stress threads yield "
+      "between pages: auto (default, only when more of them share a cpu "
+      "mask than it has cpus), always, pause (spin-wait hint only) or "
+      "never\n"
+      " --auto_tune      sweep copy thread counts per NUMA node before the "
+      "run and use the smallest count reaching peak bandwidth. -m caps the "
+      "sweep\n"
+      " --auto_tune_ms n measure each auto tune step for 'n' milliseconds\n"
+      " --tune_profile f reuse the auto tuning saved in file 'f' on the same "
+      "cpu model, or tune and save it there\n"
+      " --daemon s       allocate and fill memory once, then serve run "
+      "requests on unix socket 's'. A request is one line of 'seconds=n', "
+      "'copy=n', 'invert=n', 'cpu=n', 'check=n' and 'output=file' settings, "
+      "or 'quit'. Unset values come from the command line, and the reply is "
+      "PASS, FAIL or ERROR <reason>\n"
+      " --daemon_output_dir d  directory that 'output=file' names a file "
+      "in, 'output=' is refused without it\n"
       " --channel_hash   mask of address bits XORed to determine channel. "
       "Mask 0x40 interleaves cachelines between channels\n"
       " --channel_width bits     width in bits of each memory channel\n"
@@ -1206,15 +1698,502 @@ void Sat::PrintHelp() {
       "define multiple channels.\n");
 }
 
-// Launch the SAT task threads. Returns 0 on error.
-void Sat::InitializeThreads(TestStep &test_step) {
-  // Skip creating threads if in monitor mode.
-  if (monitor_mode_) return;
-
-  AcquireWorkerLock();
+// List the available cpus in the order threads should be placed on them.
+void Sat::PlacementOrder(const cpu_set_t &available, vector<int> *order) {
+  order->clear();
+  vector<CpuTopology> cpus;
+  for (const CpuTopology &cpu : cpu_topology_) {
+    if (CPU_ISSET(cpu.cpu, &available)) cpus.push_back(cpu);
+  }
 
-  test_step.AddLog(
-      Log{.severity = LogSeverity::kDebug, "Starting worker threads"});
+  if (placement_policy_ == kPlaceAlternate || cpus.empty()) {
+    // Place threads on alternating cpus first.
+    // This assures interleaved core use with no overlap.
+    vector<int> ids;
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+      if (CPU_ISSET(i, &available)) ids.push_back(i);
+    }
+    int cores = ids.size();
+    for (int nthcore = 0; nthcore < cores; nthcore++) {
+      int nthbit =
+          (((2 * nthcore) % cores) + (((2 * nthcore) / cores) % 2)) % cores;
+      order->push_back(ids[nthbit]);
+    }
+    return;
+  }
+
+  // Rank each cpu within its last level cache, physical cores first.
+  map<int, int> llc_used;
+  map<int, int> llc_rank;
+  vector<CpuTopology> by_sibling = cpus;
+  stable_sort(by_sibling.begin(), by_sibling.end(),
+              [](const CpuTopology &a, const CpuTopology &b) {
+                return a.smt_index < b.smt_index;
+              });
+  for (const CpuTopology &cpu : by_sibling)
+    llc_rank[cpu.cpu] = llc_used[cpu.llc]++;
+
+  if (placement_policy_ == kPlaceSocket) {
+    int package = cpus[0].package;
+    cpus.erase(remove_if(cpus.begin(), cpus.end(),
+                         [package](const CpuTopology &cpu) {
+                           return cpu.package != package;
+                         }),
+               cpus.end());
+  }
+
+  int policy = placement_policy_;
+  stable_sort(
+      cpus.begin(), cpus.end(),
+      [policy, &llc_rank](const CpuTopology &a, const CpuTopology &b) {
+        if (policy == kPlaceSmt) {
+          return make_tuple(a.package, a.die, a.core, a.smt_index) <
+                 make_tuple(b.package, b.die, b.core, b.smt_index);
+        } else if (policy == kPlaceLlc) {
+          return make_pair(llc_rank[a.cpu], a.llc) <
+                 make_pair(llc_rank[b.cpu], b.llc);
+        }
+        // One thread per physical core, then the siblings.
+        return make_tuple(a.smt_index, a.package, a.die, a.core) <
+               make_tuple(b.smt_index, b.package, b.die, b.core);
+      });
+  for (const CpuTopology &cpu : cpus) order->push_back(cpu.cpu);
+}
+
+// Pin a thread to the cpu chosen by the placement policy.
+void Sat::PlaceThread(WorkerThread *thread, int nth, bool reverse,
+                      int total_placed, TestStep &test_step) {
+  if (!use_affinity_) return;
+
+  cpu_set_t available_cpus;
+  thread->AvailableCpus(&available_cpus);
+  vector<int> order;
+  PlacementOrder(available_cpus, &order);
+  int cpus = order.size();
+  if (cpus == 0) return;
+
+  if (total_placed > cpus) {
+    // Don't restrict thread location if we have more than one
+    // thread per core. Not so good for performance. A packed socket still
+    // keeps every thread within the socket.
+    if (placement_policy_ == kPlaceSocket) {
+      cpu_set_t socket;
+      CPU_ZERO(&socket);
+      for (int cpu : order) CPU_SET(cpu, &socket);
+      thread->set_cpu_mask(&socket);
+      test_step.AddLog(Log{
+          .severity = LogSeverity::kInfo,
+          .message = absl::StrFormat("%s %d placed on cpu mask 0x%s.",
+                                     thread->GetThreadTypeName(),
+                                     thread->ThreadID(),
+                                     cpuset_format(&socket))});
+    }
+    return;
+  }
+
+  int cpu = order[reverse ? (cpus - 1) - (nth % cpus) : nth % cpus];
+  thread->set_cpu_mask_to_cpu(cpu);
+
+  string location;
+  for (const CpuTopology &entry : cpu_topology_) {
+    if (entry.cpu == cpu) {
+      location = absl::StrFormat(" (package %d, die %d, core %d, llc %d, "
+                                 "smt %d)",
+                                 entry.package, entry.die, entry.core,
+                                 entry.llc, entry.smt_index);
+    }
+  }
+  test_step.AddLog(Log{
+      .severity = LogSeverity::kInfo,
+      .message = absl::StrFormat("%s %d placed on cpu %d%s.",
+                                 thread->GetThreadTypeName(),
+                                 thread->ThreadID(), cpu, location)});
+}
+
+const Sat::LoadProfileType Sat::kLoadProfileTypes[4] = {
+    {"copy", kMemoryType},
+    {"invert", kInvertType},
+    {"cpu", kCPUType},
+    {"disk", kDiskType},
+};
+
+// Read the load profile.  Each line is a segment duration in milliseconds
+// followed by the levels of the worker types it controls, for example
+// "30000 copy=50% cpu=1..4 disk=random".  The run cycles through the
+// segments until it ends.
+bool Sat::ParseLoadProfile() {
+  // Levels are "n", "n%", "a..b", "a%..b%" or "random".
+  auto parse_value = [](const string &text, double *value, bool *percent) {
+    char *end;
+    *value = strtod(text.c_str(), &end);
+    if (end == text.c_str() || *value < 0) return false;
+    *percent = (*end == '%');
+    if (*percent) end++;
+    return *end == 0;
+  };
+  auto parse_level = [&parse_value](const char *text, LoadLevel *level) {
+    level->random = !strcmp(text, "random");
+    level->fraction = false;
+    level->from = 0;
+    level->to = 0;
+    if (level->random) return true;
+    string from = text, to = text;
+    size_t dots = from.find("..");
+    if (dots != string::npos) {
+      from = from.substr(0, dots);
+      to = to.substr(dots + 2);
+    }
+    bool to_fraction;
+    if (!parse_value(from, &level->from, &level->fraction) ||
+        !parse_value(to, &level->to, &to_fraction) ||
+        to_fraction != level->fraction) {
+      return false;
+    }
+    if (level->fraction) {
+      level->from /= 100;
+      level->to /= 100;
+    }
+    return !level->fraction || (level->from <= 1 && level->to <= 1);
+  };
+
+  FILE *file = fopen(load_profile_file_, "r");
+  if (!file) {
+    test_run_->AddPreStartError(Error{
+        .symptom = kProcessError,
+        .message = absl::StrFormat("Unable to open load profile %s: %s",
+                                   load_profile_file_, ErrorString(errno)),
+    });
+    return false;
+  }
+
+  string problem;
+  int line_number = 0;
+  char line[1024];
+  while (problem.empty() && fgets(line, sizeof(line), file)) {
+    line_number++;
+    char *comment = strchr(line, '#');
+    if (comment) *comment = 0;
+    char *save;
+    char *token = strtok_r(line, " \t\r\n", &save);
+    if (!token) continue;
+
+    LoadSegment segment;
+    char *end;
+    segment.duration_ms = strtoll(token, &end, 0);
+    if (*end || segment.duration_ms <= 0) {
+      problem = absl::StrFormat("invalid segment duration '%s'", token);
+      break;
+    }
+    while ((token = strtok_r(NULL, " \t\r\n", &save))) {
+      char *value = strchr(token, '=');
+      if (value) *value++ = 0;
+      const LoadProfileType *type = NULL;
+      for (const LoadProfileType &entry : kLoadProfileTypes) {
+        if (!strcmp(token, entry.name)) type = &entry;
+      }
+      LoadLevel level;
+      if (!type || !value) {
+        problem = absl::StrFormat("unknown worker type '%s'", token);
+        break;
+      }
+      if (!parse_level(value, &level)) {
+        problem = absl::StrFormat("invalid %s level '%s'", token, value);
+        break;
+      }
+      segment.levels[type->type] = level;
+    }
+    load_profile_.push_back(segment);
+  }
+  fclose(file);
+
+  if (problem.empty() && load_profile_.empty()) problem = "no segments";
+  if (!problem.empty()) {
+    test_run_->AddPreStartError(Error{
+        .symptom = kProcessError,
+        .message = absl::StrFormat("Load profile %s line %d: %s",
+                                   load_profile_file_, line_number, problem),
+    });
+    return false;
+  }
+  return true;
+}
+
+WorkerStatus *Sat::ProfileStatus(ThreadType type, WorkerStatus *shared) {
+  bool controlled = false;
+  for (const LoadSegment &segment : load_profile_) {
+    if (segment.levels.count(type)) controlled = true;
+  }
+  if (!controlled) return shared;
+  WorkerStatus *status = new WorkerStatus();
+  profile_status_[type].push_back(status);
+  return status;
+}
+
+void Sat::DiscardProfileStatus(ThreadType type) {
+  map<int, vector<WorkerStatus *>>::iterator it = profile_status_.find(type);
+  if (it == profile_status_.end() || it->second.empty()) return;
+  delete it->second.back();
+  it->second.pop_back();
+}
+
+void Sat::ApplyLoadSegment(const LoadSegment &segment, double progress,
+                           bool segment_start, TestStep &test_step) {
+  string summary;
+  for (const LoadProfileType &entry : kLoadProfileTypes) {
+    map<int, vector<WorkerStatus *>>::iterator it =
+        profile_status_.find(entry.type);
+    if (it == profile_status_.end()) continue;
+    vector<WorkerStatus *> &statuses = it->second;
+    int total = statuses.size();
+    int &active = profile_active_[entry.type];
+
+    int target = total;
+    map<int, LoadLevel>::const_iterator level_it =
+        segment.levels.find(entry.type);
+    if (level_it != segment.levels.end()) {
+      const LoadLevel &level = level_it->second;
+      if (level.random) {
+        target = segment_start ? random() % (total + 1) : active;
+      } else {
+        double value = level.from + (level.to - level.from) * progress;
+        if (level.fraction) value *= total;
+        target = min(total, static_cast<int>(value + 0.5));
+      }
+    }
+
+    // The running threads are always the leading ones, so only the threads
+    // at the boundary change state.
+    for (; active < target; active++) statuses[active]->ResumeWorkers();
+    for (; active > target; active--) statuses[active - 1]->PauseWorkers();
+    absl::StrAppendFormat(&summary, ", %s %d/%d", entry.name, active, total);
+  }
+
+  if (segment_start) {
+    test_step.AddLog(Log{
+        .severity = LogSeverity::kInfo,
+        .message = absl::StrFormat(
+            "Load profile segment %d for %lld ms: active threads%s",
+            &segment - &load_profile_[0], segment.duration_ms,
+            summary.empty() ? string(" unchanged") : summary.substr(1))});
+  }
+}
+
+namespace {
+// Auto tuning keeps the smallest copy thread count within this fraction of
+// the best bandwidth seen.
+const double kAutoTuneKnee = 0.95;
+// Time for new copy threads to ramp up before they are measured.
+const int kAutoTuneWarmupMs = 200;
+}  // namespace
+
+double Sat::MeasureCopyBandwidth(int threads, int32 region,
+                                 TestStep &tune_step) {
+  cpu_set_t *cpuset = NULL;
+  if (region >= 0) {
+    cpuset = os_->FindCoreMask(region, tune_step);
+    sat_assert(cpuset);
+  }
+
+  WorkerStatus status;
+  vector<CopyThread *> copy_threads;
+  for (int i = 0; i < threads; i++) {
+    CopyThread *thread = new CopyThread();
+    thread->InitThread(total_threads_++, this, os_, patternlist_, &status,
+                       &tune_step);
+    if (cpuset) {
+      thread->set_cpu_mask(cpuset);
+      thread->set_tag(1 << region);
+    }
+    copy_threads.push_back(thread);
+  }
+  status.Initialize();
+  for (CopyThread *thread : copy_threads) thread->SpawnThread();
+
+  auto pages_copied = [&copy_threads]() {
+    int64 pages = 0;
+    for (CopyThread *thread : copy_threads) pages += thread->GetPageCount();
+    return pages;
+  };
+  sat_usleep(kAutoTuneWarmupMs * 1000);
+  int64 start_pages = pages_copied();
+  int64 start_us = sat_get_time_us();
+  sat_usleep(auto_tune_ms_ * 1000);
+  int64 pages = pages_copied() - start_pages;
+  int64 elapsed_us = sat_get_time_us() - start_us;
+
+  status.StopWorkers();
+  for (CopyThread *thread : copy_threads) {
+    thread->JoinThread();
+    // Miscompares found while tuning count like any other.
+    tune_errors_ += thread->GetErrorCount();
+    if (thread->GetErrorCount()) {
+      tune_step.AddLog(Log{.severity = LogSeverity::kDebug,
+                           .message = absl::StrFormat(
+                               "Thread %d found %lld hardware incidents",
+                               thread->ThreadID(), thread->GetErrorCount())});
+    }
+    delete thread;
+  }
+  status.Destroy();
+
+  // Each copied page is read once and written once.
+  return 2.0 * pages * page_length_ / kMegabyte / (elapsed_us / 1000000.0);
+}
+
+bool Sat::ReadTuneProfile(const string &sku, TestStep &tune_step) {
+  FILE *file = fopen(tune_profile_file_, "r");
+  if (!file) return false;
+  bool matched = false;
+  map<int32, int> tuned;
+  char line[512];
+  while (fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\n")] = 0;
+    int32 region;
+    int threads;
+    if (!strncmp(line, "sku ", 4)) {
+      matched = (sku == line + 4);
+    } else if (sscanf(line, "region %d threads %d", &region, &threads) == 2 &&
+               threads > 0) {
+      tuned[region] = threads;
+    }
+  }
+  fclose(file);
+
+  // A profile for other regions than the ones in use doesn't apply either.
+  for (const auto &entry : tuned) {
+    if (entry.first >= 0 && !(region_mask_ & (1 << entry.first)))
+      matched = false;
+  }
+  if (!matched || tuned.empty()) {
+    tune_step.AddLog(Log{
+        .severity = LogSeverity::kInfo,
+        .message = absl::StrFormat(
+            "Tune profile %s was saved on a different machine, retuning",
+            tune_profile_file_)});
+    return false;
+  }
+  region_copy_threads_ = tuned;
+  return true;
+}
+
+void Sat::WriteTuneProfile(const string &sku, TestStep &tune_step) {
+  FILE *file = fopen(tune_profile_file_, "w");
+  if (!file) {
+    tune_step.AddLog(Log{
+        .severity = LogSeverity::kWarning,
+        .message = absl::StrFormat("Unable to save tune profile %s: %s",
+                                   tune_profile_file_, ErrorString(errno))});
+    return;
+  }
+  fprintf(file, "# stressapptest copy thread tuning\n");
+  fprintf(file, "sku %s\n", sku.c_str());
+  for (const auto &entry : region_copy_threads_)
+    fprintf(file, "region %d threads %d\n", entry.first, entry.second);
+  fclose(file);
+}
+
+bool Sat::AutoTuneCopyThreads() {
+  TestStep tune_step("Auto Tune Memory Copy Threads", *test_run_);
+
+  // Tune each NUMA region separately when threads can be pinned to them,
+  // since the knee depends on the local memory controllers.
+  vector<int32> regions;
+  if (region_count_ > 1 && use_affinity_) {
+    for (int i = 0; i < region_count_; i++) regions.push_back(region_find(i));
+  } else {
+    regions.push_back(-1);
+  }
+
+  string sku = absl::StrFormat("%s, %d cpus, %d regions", os_->FindCpuModel(),
+                               os_->num_cpus(), regions.size());
+  auto region_name = [](int32 region) {
+    return region < 0 ? string("") : absl::StrFormat(" Region %d", region);
+  };
+  if (!tune_profile_file_[0] || !ReadTuneProfile(sku, tune_step)) {
+    region_copy_threads_.clear();
+    for (int32 region : regions) {
+      int max_threads = memory_threads_;
+      if (region >= 0) {
+        max_threads =
+            min(max_threads, CPU_COUNT(os_->FindCoreMask(region, tune_step)));
+      }
+
+      // Double the thread count each step; the knee rarely needs more
+      // resolution than that, and this keeps the sweep short.
+      vector<pair<int, double>> samples;
+      double best = 0;
+      for (int threads = 1;; threads = min(threads * 2, max_threads)) {
+        double bandwidth = MeasureCopyBandwidth(threads, region, tune_step);
+        samples.push_back(make_pair(threads, bandwidth));
+        best = max(best, bandwidth);
+        tune_step.AddLog(Log{
+            .severity = LogSeverity::kInfo,
+            .message = absl::StrFormat(
+                "Auto tune%s: %d copy threads reach %.1f MB/s",
+                region_name(region), threads, bandwidth)});
+        if (threads >= max_threads) break;
+      }
+
+      for (const auto &sample : samples) {
+        if (sample.second >= best * kAutoTuneKnee) {
+          region_copy_threads_[region] = sample.first;
+          tune_step.AddMeasurement(Measurement{
+              .name = absl::StrCat("Tuned Copy Bandwidth",
+                                   region_name(region)),
+              .unit = "MB/s",
+              .value = sample.second,
+          });
+          break;
+        }
+      }
+    }
+    if (tune_profile_file_[0]) WriteTuneProfile(sku, tune_step);
+  }
+
+  memory_threads_ = 0;
+  for (const auto &entry : region_copy_threads_) {
+    memory_threads_ += entry.second;
+    tune_step.AddMeasurement(Measurement{
+        .name = absl::StrCat("Tuned Copy Threads", region_name(entry.first)),
+        .unit = "threads",
+        .value = static_cast<double>(entry.second),
+    });
+  }
+  tune_step.AddLog(Log{
+      .severity = LogSeverity::kInfo,
+      .message = absl::StrFormat("Auto tune picked %d memory copy threads for "
+                                 "%s",
+                                 memory_threads_, sku)});
+  // Unpinned tuning only decides the count.
+  if (region_copy_threads_.count(-1)) region_copy_threads_.clear();
+  return memory_threads_ > 0;
+}
+
+// Launch the SAT task threads. Returns 0 on error.
+void Sat::InitializeThreads(TestStep &test_step) {
+  // Skip creating threads if in monitor mode.
+  if (monitor_mode_) return;
+
+  AcquireWorkerLock();
+
+  test_step.AddLog(Log{.severity = LogSeverity::kDebug,
+                       .message = "Starting worker threads"});
+
+  if (placement_policy_ != kPlaceAlternate &&
+      !os_->FindCpuTopology(&cpu_topology_, test_step)) {
+    test_step.AddLog(Log{
+        .severity = LogSeverity::kWarning,
+        .message = "Falling back to alternating cpu placement.",
+    });
+  }
+
+  // Budgets shared by all threads of a type.
+  if (copy_budget_mbps_)
+    budgets_[kMemoryType] = new TokenBucket(copy_budget_mbps_ * kMegabyte);
+  if (invert_budget_mbps_)
+    budgets_[kInvertType] = new TokenBucket(invert_budget_mbps_ * kMegabyte);
+  if (check_budget_mbps_)
+    budgets_[kCheckType] = new TokenBucket(check_budget_mbps_ * kMegabyte);
 
   WorkerVector *memory_vector = new WorkerVector();
   std::unique_ptr<TestStep> copy_step;
@@ -1222,12 +2201,31 @@ void Sat::InitializeThreads(TestStep &test_step) {
     copy_step =
         std::make_unique<TestStep>("Run Memory Copy Threads", *test_run_);
   }
+  map<int32, int>::const_iterator tuned_region = region_copy_threads_.begin();
+  int tuned_threads = 0;
   for (int i = 0; i < memory_threads_; i++) {
     CopyThread *thread = new CopyThread();
     thread->InitThread(total_threads_++, this, os_, patternlist_,
-                       &power_spike_status_, copy_step.get());
-
-    if ((region_count_ > 1) && (region_mode_)) {
+                       ProfileStatus(kMemoryType, &power_spike_status_),
+                       copy_step.get());
+    thread->set_budget(Budget(kMemoryType));
+
+    if (tuned_region != region_copy_threads_.end()) {
+      // Give each region the copy threads auto tuning picked for it, on its
+      // own cpus and memory.  Any threads beyond that, as a daemon request
+      // may ask for, go round the regions again.
+      if (tuned_threads == tuned_region->second) {
+        if (++tuned_region == region_copy_threads_.end())
+          tuned_region = region_copy_threads_.begin();
+        tuned_threads = 0;
+      }
+      tuned_threads++;
+      int32 region = tuned_region->first;
+      cpu_set_t *cpuset = os_->FindCoreMask(region, *copy_step);
+      sat_assert(cpuset);
+      thread->set_cpu_mask(cpuset);
+      thread->set_tag(1 << region);
+    } else if ((region_count_ > 1) && (region_mode_)) {
       int32 region = region_find(i % region_count_);
       cpu_set_t *cpuset = os_->FindCoreMask(region, *copy_step);
       sat_assert(cpuset);
@@ -1241,33 +2239,8 @@ void Sat::InitializeThreads(TestStep &test_step) {
         thread->set_tag(region_mask_ & ~(1 << region));
       }
     } else {
-      cpu_set_t available_cpus;
-      thread->AvailableCpus(&available_cpus);
-      int cores = cpuset_count(&available_cpus);
-      // Don't restrict thread location if we have more than one
-      // thread per core. Not so good for performance.
-      if (cpu_stress_threads_ + memory_threads_ <= cores) {
-        // Place a thread on alternating cores first.
-        // This assures interleaved core use with no overlap.
-        int nthcore = i;
-        int nthbit =
-            (((2 * nthcore) % cores) + (((2 * nthcore) / cores) % 2)) % cores;
-        cpu_set_t all_cores;
-        cpuset_set_ab(&all_cores, 0, cores);
-        if (!cpuset_isequal(&available_cpus, &all_cores)) {
-          // We are assuming the bits are contiguous.
-          // Complain if this is not so.
-          copy_step->AddLog(Log{
-              .severity = LogSeverity::kWarning,
-              .message = absl::StrFormat("Did not find the expected number of "
-                                         "CPU cores. Expected: %s, Actual: %s",
-                                         cpuset_format(&all_cores),
-                                         cpuset_format(&available_cpus))});
-        }
-
-        // Set thread affinity.
-        thread->set_cpu_mask_to_cpu(nthbit);
-      }
+      PlaceThread(thread, i, false, cpu_stress_threads_ + memory_threads_,
+                  *copy_step);
     }
     memory_vector->insert(memory_vector->end(), thread);
   }
@@ -1338,6 +2311,7 @@ void Sat::InitializeThreads(TestStep &test_step) {
     CheckThread *thread = new CheckThread();
     thread->InitThread(total_threads_++, this, os_, patternlist_,
                        &continuous_status_, check_step.get());
+    thread->set_budget(Budget(kCheckType));
 
     check_vector->insert(check_vector->end(), thread);
   }
@@ -1356,7 +2330,9 @@ void Sat::InitializeThreads(TestStep &test_step) {
   for (int i = 0; i < invert_threads_; i++) {
     InvertThread *thread = new InvertThread();
     thread->InitThread(total_threads_++, this, os_, patternlist_,
-                       &continuous_status_, invert_step.get());
+                       ProfileStatus(kInvertType, &continuous_status_),
+                       invert_step.get());
+    thread->set_budget(Budget(kInvertType));
 
     invert_vector->insert(invert_vector->end(), thread);
   }
@@ -1377,14 +2353,26 @@ void Sat::InitializeThreads(TestStep &test_step) {
   WorkerVector *random_vector = new WorkerVector();
   for (int i = 0; i < disk_threads_; i++) {
     // Creating write threads
+    // Limits shared by the threads of this disk.
+    disk_iops_budgets_.push_back(disk_iops_ ? new TokenBucket(disk_iops_)
+                                            : NULL);
+    disk_byte_budgets_.push_back(
+        disk_mbps_ ? new TokenBucket(disk_mbps_ * kMegabyte) : NULL);
+
     DiskThread *thread = new DiskThread(blocktables_[i]);
     thread->InitThread(total_threads_++, this, os_, patternlist_,
-                       &power_spike_status_, disk_step.get());
+                       ProfileStatus(kDiskType, &power_spike_status_),
+                       disk_step.get());
     thread->SetDevice(diskfilename_[i].c_str());
+    thread->SetPipeline(disk_pipeline_);
+    thread->SetLatencyInterval(disk_latency_interval_);
+    thread->SetRateLimits(disk_iops_budgets_[i], disk_byte_budgets_[i],
+                          disk_thread_iops_, disk_thread_mbps_ * kMegabyte);
     if (thread->SetParameters(read_block_size_, write_block_size_,
                               segment_size_, cache_size_, blocks_per_segment_,
                               read_threshold_, write_threshold_,
-                              non_destructive_)) {
+                              non_destructive_) &&
+        thread->SetIoEngine(io_engine_, queue_depth_, submit_batch_)) {
       disk_vector->insert(disk_vector->end(), thread);
     } else {
       disk_step->AddLog(Log{
@@ -1392,18 +2380,24 @@ void Sat::InitializeThreads(TestStep &test_step) {
           .message = "Failed to set disk thread parameters",
       });
       delete thread;
+      DiscardProfileStatus(kDiskType);
     }
 
     for (int j = 0; j < random_threads_; j++) {
       // Creating random threads
       RandomDiskThread *rthread = new RandomDiskThread(blocktables_[i]);
       rthread->InitThread(total_threads_++, this, os_, patternlist_,
-                          &power_spike_status_, disk_step.get());
+                          ProfileStatus(kDiskType, &power_spike_status_),
+                          disk_step.get());
       rthread->SetDevice(diskfilename_[i].c_str());
+      rthread->SetLatencyInterval(disk_latency_interval_);
+      rthread->SetRateLimits(disk_iops_budgets_[i], disk_byte_budgets_[i],
+                             disk_thread_iops_, disk_thread_mbps_ * kMegabyte);
       if (rthread->SetParameters(read_block_size_, write_block_size_,
                                  segment_size_, cache_size_,
                                  blocks_per_segment_, read_threshold_,
-                                 write_threshold_, non_destructive_)) {
+                                 write_threshold_, non_destructive_) &&
+          rthread->SetIoEngine(io_engine_, queue_depth_, submit_batch_)) {
         random_vector->insert(random_vector->end(), rthread);
       } else {
         disk_step->AddLog(Log{
@@ -1411,6 +2405,7 @@ void Sat::InitializeThreads(TestStep &test_step) {
             .message = "Failed to set random disk thread parameters",
         });
         delete rthread;
+        DiscardProfileStatus(kDiskType);
       }
     }
   }
@@ -1433,33 +2428,13 @@ void Sat::InitializeThreads(TestStep &test_step) {
   for (int i = 0; i < cpu_stress_threads_; i++) {
     CpuStressThread *thread = new CpuStressThread();
     thread->InitThread(total_threads_++, this, os_, patternlist_,
-                       &continuous_status_, cpu_stress_step.get());
+                       ProfileStatus(kCPUType, &continuous_status_),
+                       cpu_stress_step.get());
 
-    // Don't restrict thread location if we have more than one
-    // thread per core. Not so good for performance.
-    cpu_set_t available_cpus;
-    thread->AvailableCpus(&available_cpus);
-    int cores = cpuset_count(&available_cpus);
-    if (cpu_stress_threads_ + memory_threads_ <= cores) {
-      // Place a thread on alternating cores first.
-      // Go in reverse order for CPU stress threads. This assures interleaved
-      // core use with no overlap.
-      int nthcore = (cores - 1) - i;
-      int nthbit =
-          (((2 * nthcore) % cores) + (((2 * nthcore) / cores) % 2)) % cores;
-      cpu_set_t all_cores;
-      cpuset_set_ab(&all_cores, 0, cores);
-      if (!cpuset_isequal(&available_cpus, &all_cores)) {
-        cpu_stress_step->AddLog(Log{
-            .severity = LogSeverity::kWarning,
-            .message = absl::StrFormat("Found %s cores when %s were expected",
-                                       cpuset_format(&available_cpus),
-                                       cpuset_format(&all_cores))});
-      }
-
-      // Set thread affinity.
-      thread->set_cpu_mask_to_cpu(nthbit);
-    }
+    // Go in reverse order for CPU stress threads. This assures interleaved
+    // core use with no overlap.
+    PlaceThread(thread, i, true, cpu_stress_threads_ + memory_threads_,
+                *cpu_stress_step);
 
     cpu_vector->insert(cpu_vector->end(), thread);
   }
@@ -1619,8 +2594,14 @@ int Sat::CacheLineSize() {
 void Sat::JoinThreads(TestStep &test_step) {
   test_step.AddLog(Log{.severity = LogSeverity::kDebug,
                        .message = "Joining worker threads"});
+  // Stopped check threads drain the valid pages too, so final verification
+  // starts here.
+  int64 verify_start_us = sat_get_time_us();
   power_spike_status_.StopWorkers();
   continuous_status_.StopWorkers();
+  for (auto &type : profile_status_) {
+    for (WorkerStatus *status : type.second) status->StopWorkers();
+  }
 
   AcquireWorkerLock();
   for (WorkerMap::const_iterator map_it = workers_map_.begin();
@@ -1637,6 +2618,7 @@ void Sat::JoinThreads(TestStep &test_step) {
 
   QueueStats(test_step);
 
+  int64 final_check_errors = 0;
   {
     TestStep check_step("Run Post-Test Memory Check Threads", *test_run_);
 
@@ -1650,12 +2632,39 @@ void Sat::JoinThreads(TestStep &test_step) {
 
     // No need for check threads for monitor mode.
     if (!monitor_mode_) {
+      // Check on every cpu.  With several NUMA regions, each region's pages
+      // are checked only by threads pinned to its own cpus.
+      vector<std::pair<int32, cpu_set_t *>> regions;
+      if (use_affinity_ && region_count_ > 1) {
+        for (int i = 0; i < region_count_; i++) {
+          int32 region = region_find(i);
+          cpu_set_t *cpuset = os_->FindCoreMask(region, check_step);
+          if (!cpuset || CPU_COUNT(cpuset) == 0) {
+            regions.clear();
+            break;
+          }
+          regions.push_back(std::make_pair(region, cpuset));
+        }
+      }
+
       // Initialize the check threads.
-      for (int i = 0; i < fill_threads_; i++) {
-        CheckThread *thread = new CheckThread();
-        thread->InitThread(total_threads_++, this, os_, patternlist_,
-                           &reap_check_status, &check_step);
-        reap_check_vector.push_back(thread);
+      if (regions.empty()) {
+        for (int i = 0; i < max(os_->num_cpus(), 1); i++) {
+          CheckThread *thread = new CheckThread();
+          thread->InitThread(total_threads_++, this, os_, patternlist_,
+                             &reap_check_status, &check_step);
+          reap_check_vector.push_back(thread);
+        }
+      }
+      for (const auto &region : regions) {
+        for (int i = 0; i < CPU_COUNT(region.second); i++) {
+          CheckThread *thread = new CheckThread();
+          thread->InitThread(total_threads_++, this, os_, patternlist_,
+                             &reap_check_status, &check_step);
+          thread->set_cpu_mask(region.second);
+          thread->set_tag(1 << region.first);
+          reap_check_vector.push_back(thread);
+        }
       }
     }
 
@@ -1683,12 +2692,25 @@ void Sat::JoinThreads(TestStep &test_step) {
     }
 
     // Add in any errors from check threads.
+    int64 pages_checked = 0;
+    int64 pages_skipped = 0;
+    WorkerMap::const_iterator checkers = workers_map_.find(kCheckType);
+    if (checkers != workers_map_.end()) {
+      for (WorkerThread *thread : *checkers->second) {
+        pages_checked +=
+            static_cast<CheckThread *>(thread)->GetFinalPagesChecked();
+        pages_skipped +=
+            static_cast<CheckThread *>(thread)->GetFinalPagesSkipped();
+      }
+    }
     for (WorkerVector::const_iterator it = reap_check_vector.begin();
          it != reap_check_vector.end(); ++it) {
       check_step.AddLog(Log{
           .severity = LogSeverity::kDebug,
           .message = absl::StrFormat("Reaping thread %d", (*it)->ThreadID())});
-      errorcount_ += (*it)->GetErrorCount();
+      final_check_errors += (*it)->GetErrorCount();
+      pages_checked += static_cast<CheckThread *>(*it)->GetFinalPagesChecked();
+      pages_skipped += static_cast<CheckThread *>(*it)->GetFinalPagesSkipped();
       check_step.AddLog(Log{.severity = LogSeverity::kDebug,
                             .message = absl::StrFormat(
                                 "Thread %d found %lld hardware incidents",
@@ -1697,6 +2719,24 @@ void Sat::JoinThreads(TestStep &test_step) {
     }
     reap_check_vector.clear();
     reap_check_status.Destroy();
+
+    if (!monitor_mode_) {
+      check_step.AddMeasurement(Measurement{
+          .name = "Final Verification Time",
+          .unit = "s",
+          .value = (sat_get_time_us() - verify_start_us) / 1000000.0,
+      });
+      check_step.AddMeasurement(Measurement{
+          .name = "Final Verification Pages Checked",
+          .unit = "pages",
+          .value = static_cast<double>(pages_checked),
+      });
+      check_step.AddMeasurement(Measurement{
+          .name = "Final Verification Pages Skipped",
+          .unit = "pages",
+          .value = static_cast<double>(pages_skipped),
+      });
+    }
   }
 
   // Reap all children. Stopped threads should have already ended.
@@ -1705,8 +2745,9 @@ void Sat::JoinThreads(TestStep &test_step) {
   test_step.AddLog(Log{.severity = LogSeverity::kDebug,
                        .message = "Join all outstanding threads"});
 
-  // Find all errors.
-  errorcount_ = GetTotalErrorCount();
+  // Find all errors, including the final check's and auto tuning's.
+  errorcount_ = GetTotalErrorCount() + final_check_errors + tune_errors_;
+  tune_errors_ = 0;
 
   AcquireWorkerLock();
   for (WorkerMap::const_iterator map_it = workers_map_.begin();
@@ -1727,6 +2768,7 @@ void Sat::JoinThreads(TestStep &test_step) {
   // Delete thread test steps
   for (std::unique_ptr<TestStep> &thread_step : thread_test_steps_)
     thread_step.reset();
+  thread_test_steps_.clear();
 }
 
 // Print queuing information.
@@ -1829,6 +2871,176 @@ void Sat::RunAnalysis() {
   if (disk_threads_ > 0)
     ReportThreadStats({kDiskType, kRandomDiskType}, "Disk", true,
                       analysis_step);
+  ReportYieldStats(analysis_step);
+  ReportBudgetStats(analysis_step);
+  if (os_->page_cache_flushes()) {
+    analysis_step.AddMeasurement(Measurement{
+        .name = "Page Cache Flushes",
+        .unit = "flushes",
+        .value = static_cast<double>(os_->page_cache_flushes()),
+    });
+    analysis_step.AddMeasurement(Measurement{
+        .name = "Page Cache Flush Time",
+        .unit = "s",
+        .value = os_->page_cache_flush_us() / 1000000.0,
+    });
+  }
+}
+
+TokenBucket *Sat::Budget(ThreadType type) {
+  map<int, TokenBucket *>::iterator it = budgets_.find(type);
+  return it == budgets_.end() ? NULL : it->second;
+}
+
+void Sat::UpdateBudgetScale(int64 now_ms, TestStep &test_step) {
+  // Never cut the budgets below this fraction, so the test keeps running.
+  static const double kMinBudgetScale = 1.0 / 64;
+  int64 stall_us;
+  if (!os_->ReadMemoryPressure(&stall_us)) return;
+  int64 elapsed_ms = now_ms - last_stall_ms_;
+  int64 stalled_us = stall_us - last_stall_us_;
+  bool first_sample = (last_stall_ms_ == 0);
+  last_stall_us_ = stall_us;
+  last_stall_ms_ = now_ms;
+  if (first_sample || elapsed_ms <= 0) return;
+
+  double stall_percent = stalled_us / (elapsed_ms * 10.0);
+  for (auto &entry : budgets_) {
+    TokenBucket *budget = entry.second;
+    double scale = budget->scale();
+    if (stall_percent > psi_threshold_) {
+      // Back off quickly, and recover slowly.
+      budget->SetScale(max(scale / 2, kMinBudgetScale));
+    } else if (scale < 1) {
+      budget->SetScale(min(scale * 1.25, 1.0));
+    }
+  }
+  if (stall_percent > psi_threshold_) {
+    psi_backoffs_++;
+    test_step.AddLog(Log{
+        .severity = LogSeverity::kInfo,
+        .message = absl::StrFormat(
+            "Tasks stalled on memory %.1f%% of the time, reducing worker "
+            "bandwidth limits",
+            stall_percent)});
+  }
+}
+
+void Sat::ReportBudgetStats(TestStep &test_step) {
+  static const struct {
+    ThreadType type;
+    const char *name;
+  } kBudgetTypes[] = {
+      {kMemoryType, "Memory Copy"},
+      {kInvertType, "Invert"},
+      {kCheckType, "Check"},
+  };
+  for (const auto &entry : kBudgetTypes) {
+    TokenBucket *budget = Budget(entry.type);
+    if (!budget) continue;
+    test_step.AddMeasurement(Measurement{
+        .name = absl::StrCat(entry.name, " Bandwidth Limit"),
+        .unit = "MB/s",
+        .value = static_cast<double>(budget->bytes_per_second()) / kMegabyte,
+    });
+    test_step.AddMeasurement(Measurement{
+        .name = absl::StrCat(entry.name, " Throttled Thread Time"),
+        .unit = "s",
+        .value = budget->ThrottledNs() / 1000000000.0,
+    });
+  }
+  if (psi_threshold_) {
+    test_step.AddMeasurement(Measurement{
+        .name = "Memory Pressure Backoffs",
+        .value = static_cast<double>(psi_backoffs_),
+    });
+  }
+  for (size_t i = 0; i < disk_iops_budgets_.size(); i++) {
+    TokenBucket *budgets[] = {disk_iops_budgets_[i], disk_byte_budgets_[i]};
+    for (TokenBucket *budget : budgets) {
+      if (!budget) continue;
+      bool iops = (budget == disk_iops_budgets_[i]);
+      test_step.AddMeasurement(Measurement{
+          .name = absl::StrFormat("Disk %s %s Limit", diskfilename_[i],
+                                  iops ? "IOPS" : "Bandwidth"),
+          .unit = iops ? "requests / second" : "MB/s",
+          .value = iops ? static_cast<double>(budget->bytes_per_second())
+                        : static_cast<double>(budget->bytes_per_second()) /
+                              kMegabyte,
+      });
+      test_step.AddMeasurement(Measurement{
+          .name = absl::StrFormat("Disk %s %s Throttled Thread Time",
+                                  diskfilename_[i],
+                                  iops ? "IOPS" : "Bandwidth"),
+          .unit = "s",
+          .value = budget->ThrottledNs() / 1000000000.0,
+      });
+    }
+  }
+}
+
+void Sat::SetYieldPolicies(TestStep &test_step) {
+  vector<WorkerThread *> busy;
+  for (int type : {kMemoryType, kInvertType, kCPUType}) {
+    WorkerMap::const_iterator map_it = workers_map_.find(type);
+    if (map_it == workers_map_.end()) continue;
+    busy.insert(busy.end(), map_it->second->begin(), map_it->second->end());
+  }
+
+  int yielding = 0;
+  for (WorkerThread *thread : busy) {
+    WorkerThread::YieldPolicy policy;
+    if (yield_policy_ == kYieldAuto) {
+      // Count the cpu bound workers, this one included, that may run on any
+      // of its cpus.  Yielding only helps if they outnumber the cpus.
+      int sharing = 0;
+      for (WorkerThread *other : busy) {
+        cpu_set_t common;
+        CPU_AND(&common, thread->cpu_mask(), other->cpu_mask());
+        if (CPU_COUNT(&common)) sharing++;
+      }
+      policy = sharing > CPU_COUNT(thread->cpu_mask())
+                   ? WorkerThread::kYieldAlways
+                   : WorkerThread::kYieldNever;
+    } else {
+      policy = static_cast<WorkerThread::YieldPolicy>(yield_policy_);
+    }
+    thread->set_yield_policy(policy);
+    if (policy == WorkerThread::kYieldAlways) yielding++;
+  }
+
+  test_step.AddLog(Log{
+      .severity = LogSeverity::kDebug,
+      .message = absl::StrFormat(
+          "%d of %d cpu bound worker threads yield with sched_yield()",
+          yielding, busy.size())});
+}
+
+void Sat::ReportYieldStats(TestStep &test_step) {
+  static const struct {
+    ThreadType type;
+    const char *name;
+  } kYieldingTypes[] = {
+      {kMemoryType, "Memory Copy"},
+      {kInvertType, "Invert"},
+      {kCPUType, "CPU Stress"},
+  };
+  for (const auto &entry : kYieldingTypes) {
+    WorkerMap::const_iterator map_it = workers_map_.find(entry.type);
+    if (map_it == workers_map_.end() || map_it->second->empty()) continue;
+    int64 iterations = 0;
+    int64 syscalls = 0;
+    for (WorkerThread *thread : *map_it->second) {
+      iterations += thread->GetIterations();
+      syscalls += thread->GetYieldSyscalls();
+    }
+    if (iterations == 0) continue;
+    test_step.AddMeasurement(Measurement{
+        .name = absl::StrCat(entry.name, " Yield Syscalls Per Iteration"),
+        .unit = "syscalls",
+        .value = static_cast<double>(syscalls) / iterations,
+    });
+  }
 }
 
 // Get total error count, summing across all threads..
@@ -1852,6 +3064,11 @@ void Sat::SpawnThreads(TestStep &test_step) {
                        .message = "Initializing WorkerStatus objects"});
   power_spike_status_.Initialize();
   continuous_status_.Initialize();
+  for (auto &type : profile_status_) {
+    for (WorkerStatus *status : type.second) status->Initialize();
+    profile_active_[type.first] = type.second.size();
+  }
+  SetYieldPolicies(test_step);
   test_step.AddLog(Log{.severity = LogSeverity::kDebug,
                        .message = "Spawning worker threads"});
   for (WorkerMap::const_iterator map_it = workers_map_.begin();
@@ -1887,6 +3104,20 @@ void Sat::DeleteThreads(TestStep &test_step) {
                        .message = "Destroying WorkerStatus objects"});
   power_spike_status_.Destroy();
   continuous_status_.Destroy();
+  for (auto &type : profile_status_) {
+    for (WorkerStatus *status : type.second) {
+      status->Destroy();
+      delete status;
+    }
+  }
+  profile_status_.clear();
+  profile_active_.clear();
+  for (auto &entry : budgets_) delete entry.second;
+  budgets_.clear();
+  for (TokenBucket *budget : disk_iops_budgets_) delete budget;
+  disk_iops_budgets_.clear();
+  for (TokenBucket *budget : disk_byte_budgets_) delete budget;
+  disk_byte_budgets_.clear();
 }
 
 namespace {
@@ -1898,16 +3129,69 @@ namespace {
 // run.
 //
 // Arguments:
-//   frequency: seconds
-//   start: unixtime
-//   now: unixtime
+//   frequency: milliseconds
+//   start: monotonic milliseconds
+//   now: monotonic milliseconds
 //
-// Returns: unixtime
-inline time_t NextOccurance(time_t frequency, time_t start, time_t now) {
+// Returns: monotonic milliseconds
+inline int64 NextOccurance(int64 frequency, int64 start, int64 now) {
   return start + frequency + (((now - start) / frequency) * frequency);
 }
 }  // namespace
 
+void Sat::WakeRun() {
+  // Run() waits for calls in progress before closing the descriptor, so
+  // that its number can't be reused under them.
+  run_wakers_++;
+  int fd = run_event_fd_;
+  uint64 one = 1;
+  // A full counter still wakes Run(), so a failed write needs no handling.
+  if (fd >= 0) {
+    ssize_t unused = write(fd, &one, sizeof(one));
+    (void)unused;
+  }
+  run_wakers_--;
+}
+
+void Sat::ErrorsFound(int64 count) {
+  if (count <= 0) return;
+  int64 total = errors_found_.fetch_add(count, std::memory_order_relaxed);
+  // Only the report that crosses the limit needs to wake Run().
+  int64 limit = stop_on_error_ ? 0 : static_cast<int64>(max_errorcount_);
+  if ((stop_on_error_ || max_errorcount_ != 0) && total <= limit &&
+      total + count > limit) {
+    WakeRun();
+  }
+}
+
+void Sat::WaitForRunEvent(int64 wake_ms) {
+  int64 now = sat_get_time_us() / 1000;
+  if (wake_ms <= now) return;
+#if defined(HAVE_SYS_EVENTFD_H) && defined(HAVE_SYS_TIMERFD_H)
+  if (run_timer_fd_ >= 0 && run_event_fd_ >= 0) {
+    // sat_get_time_us() is CLOCK_MONOTONIC too, so the timer expires on the
+    // exact millisecond rather than after a rounded relative sleep.
+    struct itimerspec timer = {};
+    timer.it_value.tv_sec = wake_ms / 1000;
+    timer.it_value.tv_nsec = (wake_ms % 1000) * 1000000;
+    if (timerfd_settime(run_timer_fd_, TFD_TIMER_ABSTIME, &timer, NULL) == 0) {
+      struct pollfd fds[2] = {{run_timer_fd_, POLLIN, 0},
+                              {run_event_fd_, POLLIN, 0}};
+      // EINTR is a signal, which sets user_break_ anyway.
+      if (poll(fds, 2, -1) > 0) {
+        uint64 count;
+        for (const struct pollfd &fd : fds) {
+          if ((fd.revents & POLLIN) && read(fd.fd, &count, sizeof(count)) < 0)
+            break;
+        }
+      }
+      return;
+    }
+  }
+#endif
+  sat_usleep((wake_ms - now) * 1000);
+}
+
 // Run the actual test.
 bool Sat::Run() {
   // Install signal handlers to gracefully exit in the middle of a run.
@@ -1930,17 +3214,46 @@ bool Sat::Run() {
   // must be called in the same thread that reads the "volatile sig_atomic_t"
   // variable it sets.  We enforce that by blocking the signals in question
   // in the worker threads, forcing them to be handled by this thread.
+  //
+  // An embedding process keeps its own signal handling, and uses Stop().
   TestStep run_step("Run Test Threads", *test_run_);
-  run_step.AddLog(Log{.severity = LogSeverity::kDebug,
-                      .message = "Installing signal handlers"});
   sigset_t new_blocked_signals;
   sigemptyset(&new_blocked_signals);
-  sigaddset(&new_blocked_signals, SIGINT);
-  sigaddset(&new_blocked_signals, SIGTERM);
   sigset_t prev_blocked_signals;
+  sighandler_t prev_sigint_handler = SIG_DFL;
+  sighandler_t prev_sigterm_handler = SIG_DFL;
+  if (!embedded_) {
+    run_step.AddLog(Log{.severity = LogSeverity::kDebug,
+                        .message = "Installing signal handlers"});
+    sigaddset(&new_blocked_signals, SIGINT);
+    sigaddset(&new_blocked_signals, SIGTERM);
+  }
   pthread_sigmask(SIG_BLOCK, &new_blocked_signals, &prev_blocked_signals);
-  sighandler_t prev_sigint_handler = signal(SIGINT, SatHandleBreak);
-  sighandler_t prev_sigterm_handler = signal(SIGTERM, SatHandleBreak);
+  if (!embedded_) {
+    prev_sigint_handler = signal(SIGINT, SatHandleBreak);
+    prev_sigterm_handler = signal(SIGTERM, SatHandleBreak);
+  }
+
+  // Checks from previous runs don't count for this one.
+  if (++verify_epoch_ == 0) verify_epoch_ = 1;
+
+  // The loop below sleeps on a timer set to its next scheduled action, and
+  // is woken early through an eventfd by signals and by workers crossing the
+  // error limit.  Without them it falls back to plain sleeps.  Errors found
+  // while auto tuning count towards the limit.
+  errors_found_ = tune_errors_;
+#if defined(HAVE_SYS_EVENTFD_H) && defined(HAVE_SYS_TIMERFD_H)
+  run_event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  run_timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (run_event_fd_ < 0 || run_timer_fd_ < 0) {
+    run_step.AddLog(Log{
+        .severity = LogSeverity::kWarning,
+        .message = absl::StrFormat(
+            "Unable to create run loop event descriptors, falling back to "
+            "sleeping: %s",
+            ErrorString(errno))});
+  }
+#endif
 
   // Kick off all the worker threads.
   run_step.AddLog(Log{.severity = LogSeverity::kDebug,
@@ -1954,30 +3267,79 @@ bool Sat::Run() {
           .message = absl::StrFormat("Starting countdown with %d seconds",
                                      runtime_seconds_)});
 
-  // In seconds.
-  static const time_t kSleepFrequency = 5;
-  // All of these are in seconds.  You probably want them to be >=
-  // kSleepFrequency and multiples of kSleepFrequency, but neither is
-  // necessary.
-  static const time_t kInjectionFrequency = 10;
+  // All of these are in milliseconds.  Every action is scheduled to the
+  // millisecond; kSleepFrequency only bounds how long the error count can go
+  // unchecked when nothing wakes the loop.
+  static const int64 kSleepFrequency = 5000;
+  static const int64 kInjectionFrequency = 10000;
+  static const int64 kPressureFrequency = 1000;
   // print_delay_ determines "seconds remaining" chatty update.
 
-  const time_t start = time(NULL);
-  const time_t end = start + runtime_seconds_;
-  time_t now = start;
-  time_t next_print = start + print_delay_;
-  time_t next_pause = start + pause_delay_;
-  time_t next_resume = 0;
-  time_t next_injection;
+  // Per power spike spread of the worker resume times.
+  std::unique_ptr<MeasurementSeries> resume_skew;
+  auto report_resume_skew = [&]() {
+    int64 latency_ns, skew_ns;
+    if (!power_spike_status_.ResumeSkew(&latency_ns, &skew_ns)) return;
+    if (!resume_skew) {
+      resume_skew = std::make_unique<MeasurementSeries>(
+          MeasurementSeriesStart{.name = "Power Spike Resume Skew",
+                                 .unit = "us"},
+          run_step);
+    }
+    resume_skew->AddElement(
+        MeasurementSeriesElement{.value = skew_ns / 1000.0});
+    run_step.AddLog(Log{
+        .severity = LogSeverity::kDebug,
+        .message = absl::StrFormat(
+            "Worker threads resumed %.1f us after the resume request, "
+            "within %.1f us of each other",
+            latency_ns / 1000.0, skew_ns / 1000.0)});
+  };
+
+  const int64 start = sat_get_time_us() / 1000;
+  const int64 end = start + runtime_seconds_ * 1000LL;
+  int64 now = start;
+  int64 next_print = start + print_delay_ * 1000LL;
+  int64 next_pause = start + pause_delay_ms_;
+  int64 next_resume = 0;
+  int64 next_injection;
   if (crazy_error_injection_) {
     next_injection = start + kInjectionFrequency;
   } else {
     next_injection = 0;
   }
 
+  int64 next_sample = 0;
+  int64 last_sample = start;
+  map<int, double> copied;
+  if (bandwidth_callback_) next_sample = start + sample_interval_ms_;
+
+  int64 next_pressure = 0;
+  if (psi_threshold_) {
+    UpdateBudgetScale(start, run_step);
+    next_pressure = start + kPressureFrequency;
+  }
+
+  // Load profile segments follow each other without drift, like the other
+  // schedules.  Ramping segments are also re-applied every kProfileRampStep.
+  size_t segment = 0;
+  int64 segment_start = start;
+  int64 next_segment = 0;
+  auto segment_ramps = [&]() {
+    for (const auto &level : load_profile_[segment].levels) {
+      if (!level.second.random && level.second.from != level.second.to)
+        return true;
+    }
+    return false;
+  };
+  if (!load_profile_.empty()) {
+    ApplyLoadSegment(load_profile_[segment], 0, true, run_step);
+    next_segment = segment_start + load_profile_[segment].duration_ms;
+  }
+
   while (now < end) {
     // This is an int because it's for logprintf().
-    const int seconds_remaining = end - now;
+    const int seconds_remaining = (end - now) / 1000;
 
     if (user_break_) {
       // Handle early exit.
@@ -1989,6 +3351,15 @@ bool Sat::Run() {
       break;
     }
 
+    if (stop_on_error_ && errors_found_ > 0) {
+      run_step.AddLog(Log{
+          .severity = LogSeverity::kError,
+          .message = absl::StrFormat("Exiting early with %d seconds remaining "
+                                     "in test due to errors (stop on error)",
+                                     seconds_remaining)});
+      break;
+    }
+
     // If we have an error limit, check it here and see if we should exit.
     if (max_errorcount_ != 0) {
       uint64 errors = GetTotalErrorCount();
@@ -2008,7 +3379,7 @@ bool Sat::Run() {
           Log{.severity = LogSeverity::kInfo,
               .message = absl::StrFormat("%d seconds remaining in test",
                                          seconds_remaining)});
-      next_print = NextOccurance(print_delay_, start, now);
+      next_print = NextOccurance(print_delay_ * 1000LL, start, now);
     }
 
     if (next_injection && now >= next_injection) {
@@ -2021,10 +3392,40 @@ bool Sat::Run() {
       struct page_entry src;
       GetValid(&src, run_step);
       src.pattern = patternlist_->GetPattern(0, run_step);
+      src.verified_epoch = 0;
       PutValid(&src, run_step);
       next_injection = NextOccurance(kInjectionFrequency, start, now);
     }
 
+    if (next_sample && now >= next_sample) {
+      SampleBandwidth(now, start, last_sample, &copied);
+      last_sample = now;
+      next_sample = NextOccurance(sample_interval_ms_, start, now);
+    }
+
+    if (next_pressure && now >= next_pressure) {
+      UpdateBudgetScale(now, run_step);
+      next_pressure = NextOccurance(kPressureFrequency, start, now);
+    }
+
+    if (next_segment && now >= next_segment) {
+      // Skip any segments that were missed entirely.
+      do {
+        segment = (segment + 1) % load_profile_.size();
+        segment_start = next_segment;
+        next_segment = segment_start + load_profile_[segment].duration_ms;
+      } while (now >= next_segment);
+      ApplyLoadSegment(load_profile_[segment],
+                       static_cast<double>(now - segment_start) /
+                           load_profile_[segment].duration_ms,
+                       true, run_step);
+    } else if (next_segment && segment_ramps()) {
+      ApplyLoadSegment(load_profile_[segment],
+                       static_cast<double>(now - segment_start) /
+                           load_profile_[segment].duration_ms,
+                       false, run_step);
+    }
+
     if (next_pause && now >= next_pause) {
       // Tell worker threads to pause in preparation for a power spike.
       run_step.AddLog(Log{.severity = LogSeverity::kInfo,
@@ -2035,8 +3436,10 @@ bool Sat::Run() {
       power_spike_status_.PauseWorkers();
       run_step.AddLog(Log{.severity = LogSeverity::kDebug,
                           .message = "Worker threads paused"});
+      // Every worker has resumed from the previous spike by now.
+      report_resume_skew();
       next_pause = 0;
-      next_resume = now + pause_duration_;
+      next_resume = now + pause_duration_ms_;
     }
 
     if (next_resume && now >= next_resume) {
@@ -2049,28 +3452,330 @@ bool Sat::Run() {
       power_spike_status_.ResumeWorkers();
       run_step.AddLog(Log{.severity = LogSeverity::kDebug,
                           .message = "Worker threads resumed"});
-      next_pause = NextOccurance(pause_delay_, start, now);
+      next_pause = NextOccurance(pause_delay_ms_, start, now);
       next_resume = 0;
     }
 
-    sat_sleep(NextOccurance(kSleepFrequency, start, now) - now);
-    now = time(NULL);
+    // Sleep until the next scheduled action.
+    int64 wake = min(NextOccurance(kSleepFrequency, start, now), end);
+    if (next_pause) wake = min(wake, next_pause);
+    if (next_sample) wake = min(wake, next_sample);
+    if (next_pressure) wake = min(wake, next_pressure);
+    if (next_segment) {
+      wake = min(wake, next_segment);
+      if (segment_ramps()) wake = min(wake, now + kProfileRampStep);
+    }
+    if (next_resume) wake = min(wake, next_resume);
+    WaitForRunEvent(wake);
+    now = sat_get_time_us() / 1000;
   }
 
   JoinThreads(run_step);
+  report_resume_skew();
+  resume_skew.reset();
 
   if (!monitor_mode_) RunAnalysis();
 
   DeleteThreads(run_step);
 
-  run_step.AddLog(Log{.severity = LogSeverity::kDebug,
-                      .message = "Uninstalling signal handlers"});
-  signal(SIGINT, prev_sigint_handler);
-  signal(SIGTERM, prev_sigterm_handler);
+  if (!embedded_) {
+    run_step.AddLog(Log{.severity = LogSeverity::kDebug,
+                        .message = "Uninstalling signal handlers"});
+    signal(SIGINT, prev_sigint_handler);
+    signal(SIGTERM, prev_sigterm_handler);
+  }
+  // Stop() and signal handlers can still call WakeRun().
+  int event_fd = run_event_fd_.exchange(-1);
+  while (run_wakers_ > 0) sched_yield();
+  if (event_fd >= 0) close(event_fd);
+  if (run_timer_fd_ >= 0) close(run_timer_fd_);
+  run_timer_fd_ = -1;
 
   return true;
 }
 
+// Serve run requests on daemon_socket_, one connection at a time.  Memory
+// stays allocated and filled between runs, so a request starts stressing as
+// soon as its worker threads are spawned.  Refilling the pages a run's final
+// check emptied happens after the reply, before waiting for the next request.
+bool Sat::Serve() {
+  // The setup run reports on the daemon itself, each request gets its own.
+  std::unique_ptr<ocpdiag::results::TestRun> daemon_run = std::move(test_run_);
+  bool result = true;
+  {
+    TestStep serve_step("Serve Run Requests", *daemon_run);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    // ValidateArgs() made sure the path fits.
+    memcpy(addr.sun_path, daemon_socket_, strlen(daemon_socket_));
+    unlink(daemon_socket_);
+    if (sock < 0 ||
+        bind(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) ||
+        listen(sock, 1)) {
+      serve_step.AddError(Error{
+          .symptom = kProcessError,
+          .message = absl::StrFormat("Unable to listen on daemon socket %s: %s",
+                                     daemon_socket_, ErrorString(errno))});
+      if (sock >= 0) close(sock);
+      test_run_ = std::move(daemon_run);
+      return false;
+    }
+
+    // SIGINT and SIGTERM stop the daemon between runs, Run() installs its
+    // own handlers for the duration of a run.
+    sighandler_t prev_sigint_handler = signal(SIGINT, SatHandleBreak);
+    sighandler_t prev_sigterm_handler = signal(SIGTERM, SatHandleBreak);
+    serve_step.AddLog(
+        Log{.severity = LogSeverity::kInfo,
+            .message = absl::StrFormat("Serving run requests on %s",
+                                       daemon_socket_)});
+
+    while (!user_break_) {
+      // Signals restart accept(), but always interrupt poll().
+      struct pollfd pfd = {.fd = sock, .events = POLLIN, .revents = 0};
+      if (poll(&pfd, 1, -1) < 0 && errno == EINTR) continue;
+      int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == EAGAIN) continue;
+        serve_step.AddError(Error{
+            .symptom = kProcessError,
+            .message = absl::StrFormat("Unable to accept run request: %s",
+                                       ErrorString(errno))});
+        result = false;
+        break;
+      }
+      bool serving = ServeRequest(fd, serve_step);
+      close(fd);
+      if (!serving) break;
+    }
+
+    signal(SIGINT, prev_sigint_handler);
+    signal(SIGTERM, prev_sigterm_handler);
+    close(sock);
+    unlink(daemon_socket_);
+  }
+  test_run_ = std::move(daemon_run);
+  return result;
+}
+
+// Run one request read from the connected socket 'fd', reply with its result
+// and refill the memory for the next one.  Returns false if the daemon should
+// stop serving.
+bool Sat::ServeRequest(int fd, TestStep &serve_step) {
+  auto reply = [fd](const string &message) {
+    string line = message + "\n";
+    if (write(fd, line.data(), line.size()) < 0) return;
+  };
+
+  // Don't let a stuck client hold up the daemon.
+  struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  string request;
+  char buf[256];
+  while (request.find('\n') == string::npos &&
+         request.size() < kDaemonRequestMax) {
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR) continue;
+    if (len <= 0) break;
+    request.append(buf, len);
+  }
+  request = request.substr(0, request.find('\n'));
+  serve_step.AddLog(
+      Log{.severity = LogSeverity::kInfo,
+          .message = absl::StrFormat("Run request: '%s'", request)});
+
+  // Settings not in the request keep their command line values.
+  int runtime_seconds = runtime_seconds_;
+  int memory_threads = memory_threads_;
+  int invert_threads = invert_threads_;
+  int cpu_stress_threads = cpu_stress_threads_;
+  int check_threads = check_threads_;
+  string output;
+  char *saveptr;
+  for (char *token = strtok_r(&request[0], " \t\r", &saveptr); token;
+       token = strtok_r(NULL, " \t\r", &saveptr)) {
+    if (!strcmp(token, "quit")) {
+      reply("BYE");
+      return false;
+    }
+    char *value = strchr(token, '=');
+    if (!value) {
+      reply(absl::StrFormat("ERROR malformed setting '%s'", token));
+      return true;
+    }
+    *value++ = 0;
+    if (!strcmp(token, "output")) {
+      output = value;
+      continue;
+    }
+    int *setting = NULL;
+    if (!strcmp(token, "seconds")) setting = &runtime_seconds;
+    if (!strcmp(token, "copy")) setting = &memory_threads;
+    if (!strcmp(token, "invert")) setting = &invert_threads;
+    if (!strcmp(token, "cpu")) setting = &cpu_stress_threads;
+    if (!strcmp(token, "check")) setting = &check_threads;
+    char *end;
+    long number = strtol(value, &end, 0);
+    if (!setting || *end || end == value || number < 0) {
+      reply(absl::StrFormat("ERROR unknown setting '%s=%s'", token, value));
+      return true;
+    }
+    *setting = number;
+  }
+  if (memory_threads + invert_threads + check_threads + net_threads_ +
+          file_threads_ >
+      freepages_) {
+    reply(absl::StrFormat("ERROR the threads need more than the %lld free "
+                          "pages",
+                          freepages_));
+    return true;
+  }
+
+  int output_fd = -1;
+  int saved_stdout = -1;
+  if (!output.empty()) {
+    // Anyone who can connect can ask for output, and the daemon usually runs
+    // as root, so only plain file names in daemon_output_dir_ are allowed,
+    // and symbolic links are not followed.
+    if (!daemon_output_dir_[0]) {
+      reply("ERROR output needs --daemon_output_dir");
+      return true;
+    }
+    if (output.find('/') != string::npos || output == "." || output == "..") {
+      reply(absl::StrFormat("ERROR output must be a file name, not '%s'",
+                            output));
+      return true;
+    }
+    int dir_fd = open(daemon_output_dir_, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+      output_fd = openat(dir_fd, output.c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                         0644);
+    }
+    if (output_fd < 0) {
+      reply(absl::StrFormat("ERROR unable to open %s in %s: %s", output,
+                            daemon_output_dir_, ErrorString(errno)));
+      if (dir_fd >= 0) close(dir_fd);
+      return true;
+    }
+    close(dir_fd);
+  }
+
+  runtime_seconds_ = runtime_seconds;
+  memory_threads_ = memory_threads;
+  invert_threads_ = invert_threads;
+  cpu_stress_threads_ = cpu_stress_threads;
+  check_threads_ = check_threads;
+  errorcount_ = 0;
+  statuscount_ = 0;
+  psi_backoffs_ = 0;
+
+  // Results go to the requested file.  Pending log lines are flushed first,
+  // so that neither output ends up with lines of the other.
+  fflush(stdout);
+  std::cout.flush();
+  if (output_fd >= 0) {
+    Logger::GlobalLogger()->StopThread();
+    saved_stdout = dup(STDOUT_FILENO);
+    dup2(output_fd, STDOUT_FILENO);
+    close(output_fd);
+    Logger::GlobalLogger()->StartThread();
+  }
+
+  test_run_ = std::make_unique<ocpdiag::results::TestRun>(
+      ocpdiag::results::TestRunStart{
+          .name = "Stress App Test",
+          .version = kVersion,
+          .command_line = absl::StrCat(cmdline_, " ", request),
+          .parameters_json = cmdline_json_,
+      });
+  test_run_->StartAndRegisterDutInfo(
+      std::make_unique<ocpdiag::results::DutInfo>("place", "holder"));
+  Run();
+  bool passed = test_run_->Result() != ocpdiag::results::TestResult::kFail;
+  test_run_.reset();
+
+  fflush(stdout);
+  std::cout.flush();
+  if (saved_stdout >= 0) {
+    Logger::GlobalLogger()->StopThread();
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    Logger::GlobalLogger()->StartThread();
+  }
+
+  serve_step.AddLog(Log{
+      .severity = LogSeverity::kInfo,
+      .message = absl::StrFormat("Run request finished: %s",
+                                 passed ? "PASS" : "FAIL")});
+  reply(passed ? "PASS" : "FAIL");
+  return !user_break_ && RefillPages(serve_step);
+}
+
+void *Sat::RunThread(void *sat) {
+  static_cast<Sat *>(sat)->Run();
+  return NULL;
+}
+
+bool Sat::Start() {
+  if (run_thread_started_) return false;
+  if (pthread_create(&run_thread_, NULL, RunThread, this)) return false;
+  run_thread_started_ = true;
+  return true;
+}
+
+bool Sat::Wait() {
+  if (run_thread_started_) {
+    sat_assert(0 == pthread_join(run_thread_, NULL));
+    run_thread_started_ = false;
+  }
+  return status() != ocpdiag::results::TestResult::kFail;
+}
+
+void Sat::ReportError(const SatErrorRecord &record) {
+  if (error_callback_) error_callback_(record);
+}
+
+void Sat::SampleBandwidth(int64 now_ms, int64 start_ms, int64 last_ms,
+                          map<int, double> *copied) {
+  // Worker types that publish their progress while running.
+  static const struct {
+    ThreadType type;
+    const char *name;
+  } kSampledTypes[] = {
+      {kMemoryType, "Copy"},
+      {kInvertType, "Invert"},
+      {kCheckType, "Check"},
+  };
+  if (now_ms <= last_ms) return;
+  double interval_s = (now_ms - last_ms) / 1000.0;
+
+  for (const auto &sampled : kSampledTypes) {
+    AcquireWorkerLock();
+    WorkerMap::const_iterator map_it = workers_map_.find(sampled.type);
+    if (map_it == workers_map_.end() || map_it->second->empty()) {
+      ReleaseWorkerLock();
+      continue;
+    }
+    double data = 0;
+    for (WorkerThread *thread : *map_it->second)
+      data += thread->GetMemoryCopiedData();
+    ReleaseWorkerLock();
+
+    double &last = (*copied)[sampled.type];
+    bandwidth_callback_(SatBandwidthSample{
+        .type = sampled.name,
+        .elapsed_ms = now_ms - start_ms,
+        .interval_s = interval_s,
+        .mbps = (data - last) / interval_s,
+    });
+    last = data;
+  }
+}
+
 // Clean up all resources.
 bool Sat::Cleanup() {
   g_sat = NULL;
@@ -2102,9 +3807,7 @@ bool Sat::Cleanup() {
     delete finelock_q_;
     finelock_q_ = 0;
   }
-  if (page_bitmap_) {
-    delete[] page_bitmap_;
-  }
+  page_extents_.clear();
 
   for (size_t i = 0; i < blocktables_.size(); i++) {
     delete blocktables_[i];
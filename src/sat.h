@@ -11,6 +11,8 @@
 
 #include <signal.h>
 
+#include <atomic>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
@@ -26,6 +28,50 @@
 #include "sattypes.h"
 #include "worker.h"
 
+// A range of physical memory touched by the test, [start, end).
+struct PhysExtent {
+  uint64 start;
+  uint64 end;
+};
+
+// Memory bandwidth of one worker type over one sample interval.
+struct SatBandwidthSample {
+  const char *type;   // "Copy", "Invert" or "Check".
+  int64 elapsed_ms;   // Since the start of the run.
+  double interval_s;  // Time the sample covers.
+  double mbps;        // Memory traffic over the interval, in MB/s.
+};
+
+// A hardware error reported by a worker thread.
+struct SatErrorRecord {
+  string thread_type;
+  int thread_id;
+  string verdict;
+  string message;
+};
+
+// Typed configuration for embedding SAT in another process, in place of a
+// command line.  See Sat::Configure().
+struct SatOptions {
+  int64 memory_mb = 0;      // Memory to test, 0 for most of the free memory.
+  int runtime_seconds = 20;
+  int copy_threads = -1;    // -1 for one per cpu.
+  int invert_threads = 0;
+  int check_threads = 0;
+  int cpu_threads = 0;
+  int64 max_errors = 0;     // Errors allowed before stopping, 0 for no limit.
+  bool stop_on_error = false;
+  int verbosity = 8;
+  vector<string> args;      // Any other command line flags, as for main().
+
+  // Called on the thread running the test every sample_interval_ms.
+  std::function<void(const SatBandwidthSample &)> on_bandwidth;
+  int64 sample_interval_ms = 1000;
+  // Called on the worker thread that found the error, as soon as it is
+  // found.  Must be thread safe, and return quickly.
+  std::function<void(const SatErrorRecord &)> on_error;
+};
+
 // SAT stress test class.
 class Sat {
  public:
@@ -37,6 +83,10 @@ class Sat {
 
   // Read configuration from arguments. Called first.
   bool ParseArgs(int argc, const char **argv);
+  // Read configuration from options instead, when embedded in another
+  // process.  Called first, in place of ParseArgs().  Unlike ParseArgs(), it
+  // never exits the process, and Run() leaves the signal handlers alone.
+  bool Configure(const SatOptions &options);
   // Initialize data structures, subclasses, and resources,
   // based on command line args.
   // Called after ParseArgs().
@@ -46,6 +96,18 @@ class Sat {
   // This must be called from a single-threaded program.
   bool Run();
 
+  // Start Run() on a thread of its own and return right away, for embedding.
+  // Initialize() must be called first, and Wait() before Cleanup().
+  bool Start();
+  // Ask a started run to finish early.  Does not wait for it.
+  void Stop() { Break(); }
+  // Wait for a started run to finish.  Returns false if the test failed.
+  bool Wait();
+
+  // Keep the filled memory warm and serve run requests from the daemon
+  // socket until told to quit.  Replaces Run() when daemon_mode() is set.
+  bool Serve();
+
   // Pretty print help.
   virtual void PrintHelp();
 
@@ -54,7 +116,19 @@ class Sat {
   bool Cleanup();
 
   // Abort Run().  Only for use by Run()-installed signal handlers.
-  void Break() { user_break_ = true; }
+  void Break() {
+    user_break_ = true;
+    WakeRun();
+  }
+
+  // Wake Run() to re-check the exit conditions.  Async-signal-safe.
+  void WakeRun();
+  // Called by worker threads as they count errors, so that Run() reacts to
+  // stop_on_error_ or the error limit right away instead of at its next
+  // scheduled action.
+  void ErrorsFound(int64 count);
+  // Called by worker threads for each hardware error they report.
+  void ReportError(const SatErrorRecord &record);
 
   // Fetch and return empty and full pages into the empty and full pools.
   bool GetValid(struct page_entry *pe, ocpdiag::results::TestStep &test_step);
@@ -79,6 +153,12 @@ class Sat {
   int errors() const { return errorcount_; }
   int warm() const { return warm_; }
   bool stop_on_error() const { return stop_on_error_; }
+  bool daemon_mode() const { return daemon_socket_[0] != 0; }
+  // Pages whose verified_epoch matches were checked during this run, and
+  // not written since.  Never 0.
+  uint32 verify_epoch() const { return verify_epoch_; }
+  bool sched_idle() const { return sched_idle_; }
+  int nice_level() const { return nice_; }
   bool use_affinity() const { return use_affinity_; }
   int32 region_mask() const { return region_mask_; }
   // Semi-accessor to find the "nth" region to avoid replicated bit searching..
@@ -110,6 +190,10 @@ class Sat {
   bool InitializePatterns(ocpdiag::results::TestStep &setup_step);
   // Initializes test memory with datapatterns.
   bool InitializePages();
+  // Runs the fill threads to turn 'pages' empty pages into valid ones.
+  bool FillPages(int64 pages, ocpdiag::results::TestStep &test_step);
+  // Fills the pages a run's final check left empty, keeping freepages_ free.
+  bool RefillPages(ocpdiag::results::TestStep &test_step);
 
   // Start up worker threads.
   virtual void InitializeThreads(ocpdiag::results::TestStep &test_step);
@@ -117,6 +201,8 @@ class Sat {
   void SpawnThreads(ocpdiag::results::TestStep &test_step);
   // Reap worker threads.
   void JoinThreads(ocpdiag::results::TestStep &test_step);
+  // Sleep until the monotonic time wake_ms, or until WakeRun().
+  void WaitForRunEvent(int64 wake_ms);
   // Run bandwidth and error analysis.
   virtual void RunAnalysis();
   // Delete worker threads.
@@ -130,6 +216,13 @@ class Sat {
   int ReadInt(const char *filename, int *value);
   // Collect error counts from threads.
   int64 GetTotalErrorCount();
+  // Order the available cpus according to placement_policy_.
+  void PlacementOrder(const cpu_set_t &available, vector<int> *order);
+  // Pin the nth thread of a group according to placement_policy_, and report
+  // where it landed. Threads are placed from the end of the order if reverse
+  // is set, so that two groups interleave without overlap.
+  void PlaceThread(WorkerThread *thread, int nth, bool reverse,
+                   int total_placed, ocpdiag::results::TestStep &test_step);
 
   // Command line arguments.
   string cmdline_;
@@ -154,6 +247,11 @@ class Sat {
   // Control flags.
   volatile sig_atomic_t user_break_;  // User has signalled early exit.  Used as
                                       // a boolean.
+  std::atomic<int> run_event_fd_;     // eventfd that wakes Run() early.
+  std::atomic<int> run_wakers_;       // WakeRun() calls that may be using
+                                      // run_event_fd_.
+  int run_timer_fd_;                  // timerfd for Run()'s next action.
+  std::atomic<int64> errors_found_;   // Errors reported by ErrorsFound().
   int verbosity_;                     // How much to print.
   int print_delay_;                   // Chatty update frequency.
   int strict_;                        // Check results per transaction.
@@ -182,6 +280,18 @@ class Sat {
                             // take before warning of a slow write.
   int non_destructive_;     // Whether to use non-destructive mode for
                             // the disk test.
+  int io_engine_;           // DiskThread::IoEngine used for the disk test.
+  int queue_depth_;         // Disk requests kept in flight per thread.
+  int submit_batch_;        // Disk requests handed to the kernel at once.
+  bool disk_pipeline_;      // Overlap disk writes and verification.
+  int disk_latency_interval_;  // Seconds between disk latency summaries,
+                               // 0 for a summary at the end only.
+  int64 disk_iops_;         // Requests per second and MB/s on each disk,
+  int64 disk_mbps_;         // shared by its threads.  Zero means unlimited.
+  int64 disk_thread_iops_;  // The same, for each disk thread on its own.
+  int64 disk_thread_mbps_;
+  vector<TokenBucket *> disk_iops_budgets_;  // Shared disk budgets, by disk,
+  vector<TokenBucket *> disk_byte_budgets_;  // NULL when unlimited.
 
   // Generic Options.
   int monitor_mode_;  // Switch for monitor-only mode SAT.
@@ -191,9 +301,22 @@ class Sat {
   int tag_mode_;      // Do tagging of memory and strict
                       // checking for misplaced cachelines.
 
-  bool do_page_map_;            // Should we print a list of used pages?
-  unsigned char *page_bitmap_;  // Store bitmap of physical pages seen.
-  uint64 page_bitmap_size_;     // Length of physical memory represented.
+  bool do_page_map_;             // Should we print a list of used pages?
+  char page_map_file_[255];      // Binary file to dump the page map to.
+  vector<PhysExtent> page_extents_;  // Physical ranges seen, unsorted.
+
+  // Low impact options, for running next to production services.
+  int64 copy_budget_mbps_;    // Memory traffic budget of each worker type,
+  int64 invert_budget_mbps_;  // in MB/s.  Zero means unlimited.
+  int64 check_budget_mbps_;
+  bool sched_idle_;           // Run the workers under SCHED_IDLE.
+  int nice_;                  // Nice level of the workers.
+  int psi_threshold_;         // Memory stall percentage above which the
+                              // budgets back off, zero to never back off.
+  map<int, TokenBucket *> budgets_;  // Budgets in use, by ThreadType.
+  int64 last_stall_us_;       // Memory stall total at the last PSI sample.
+  int64 last_stall_ms_;       // When it was sampled.
+  int psi_backoffs_;          // Times the budgets were cut.
 
   // Cpu Cache Coherency Options.
   bool cc_test_;            // Flag to decide whether to start the
@@ -237,13 +360,33 @@ class Sat {
   bool use_affinity_;                // Should stressapptest set cpu affinity?
   int32 region_mask_;                // Bitmask of available NUMA regions.
   int32 region_count_;               // Count of available NUMA regions.
+  uint32 verify_epoch_;              // Incremented by every Run().
   int32 region_[32];                 // Pagecount per region.
   int region_mode_;                  // What to do with NUMA hints?
   static const int kLocalNuma = 1;   // Target local memory.
   static const int kRemoteNuma = 2;  // Target remote memory.
 
+  int placement_policy_;             // How to place pinned threads.
+  static const int kPlaceAlternate = 0;  // Alternating cpus.
+  static const int kPlaceCore = 1;       // One per physical core first.
+  static const int kPlaceSmt = 2;        // Fill SMT siblings first.
+  static const int kPlaceLlc = 3;        // Spread across LLC domains.
+  static const int kPlaceSocket = 4;     // Pack a single socket.
+  vector<CpuTopology> cpu_topology_;     // Layout of the online cpus.
+  int yield_policy_;                     // A WorkerThread::YieldPolicy, or:
+  static const int kYieldAuto = -1;      // Yield only when oversubscribed.
+
+  // Copy thread auto tuning.
+  bool auto_tune_;                // Pick the copy thread count by bandwidth.
+  int auto_tune_ms_;              // Measurement time of each sweep step.
+  char tune_profile_file_[255];   // Saved tuning to reuse, or to create.
+  // Tuned copy threads per NUMA region, or under -1 when not pinned.
+  map<int32, int> region_copy_threads_;
+
   // Results.
   int64 errorcount_;  // Total hardware incidents seen.
+  int64 tune_errors_;  // Hardware incidents seen by the auto tuning sweep,
+                       // counted in the next run.
   int statuscount_;   // Total test errors seen.
 
   // Thread type constants and types
@@ -269,15 +412,82 @@ class Sat {
   typedef map<int, WorkerVector *> WorkerMap;
   // Contains all worker threads.
   WorkerMap workers_map_;
-  // Delay between power spikes.
-  time_t pause_delay_;
-  // The duration of each pause (for power spikes).
-  time_t pause_duration_;
+  // Delay between power spikes, in milliseconds.
+  int64 pause_delay_ms_;
+  // The duration of each pause (for power spikes), in milliseconds.
+  int64 pause_duration_ms_;
   // For the workers we pause and resume to create power spikes.
   WorkerStatus power_spike_status_;
   // For the workers we never pause.
   WorkerStatus continuous_status_;
 
+  // Load profile: segments of worker activity that the run loop cycles
+  // through, to shape power, thermal and bandwidth ramps within one run.
+  // Active share of one worker type during a segment.  Values are thread
+  // counts, or fractions of the type's threads.  A ramp moves linearly from
+  // 'from' to 'to' over the segment; a random level picks a new count each
+  // time the segment starts.
+  struct LoadLevel {
+    bool fraction;
+    bool random;
+    double from;
+    double to;
+  };
+  struct LoadSegment {
+    int64 duration_ms;
+    map<int, LoadLevel> levels;  // By ThreadType, unlisted types run fully.
+  };
+  // Worker types a load profile can control, by their name in the file.
+  struct LoadProfileType {
+    const char *name;
+    ThreadType type;
+  };
+  static const LoadProfileType kLoadProfileTypes[4];
+  char load_profile_file_[255];    // Load profile to apply, if any.
+  vector<LoadSegment> load_profile_;
+  // Private status for each thread of a profiled worker type, by ThreadType,
+  // so that threads can be paused and resumed individually.
+  map<int, vector<WorkerStatus *>> profile_status_;
+  map<int, int> profile_active_;  // Leading threads of each type running.
+  static constexpr int64 kProfileRampStep = 100;  // Ramp update period, in ms.
+
+  // Embedding.
+  std::function<void(const SatBandwidthSample &)> bandwidth_callback_;
+  std::function<void(const SatErrorRecord &)> error_callback_;
+  int64 sample_interval_ms_;  // Bandwidth sample period, in ms.
+  bool embedded_;             // Configured by Configure(), not main().
+  pthread_t run_thread_;      // Thread running Run() after Start().
+  bool run_thread_started_;
+
+  static void *RunThread(void *sat);
+  // Pass the memory bandwidth of each worker type since the previous call
+  // to bandwidth_callback_.  'copied' keeps the MB copied so far by type.
+  void SampleBandwidth(int64 now_ms, int64 start_ms, int64 last_ms,
+                       map<int, double> *copied);
+
+  // Daemon mode.
+  char daemon_socket_[255];  // Unix socket to serve run requests on, if any.
+  char daemon_output_dir_[255];  // Directory requests may write output to,
+                                 // empty to refuse 'output=' settings.
+  static constexpr int kDaemonRequestMax = 4096;  // Longest request, in bytes.
+
+  // Run the single request read from the connected socket 'fd'.  Returns
+  // false once the request asks the daemon to quit.
+  bool ServeRequest(int fd, ocpdiag::results::TestStep &serve_step);
+
+  // Read load_profile_file_ into load_profile_.
+  bool ParseLoadProfile();
+  // Status a new thread of the given type should use: its own when a load
+  // profile is active and controls the type, otherwise 'shared'.
+  WorkerStatus *ProfileStatus(ThreadType type, WorkerStatus *shared);
+  // Undo the last ProfileStatus() for a thread that will never be spawned.
+  void DiscardProfileStatus(ThreadType type);
+  // Pause and resume profiled threads to match the segment, 'progress' of
+  // the way through it.  Random levels are only rolled at the segment start.
+  void ApplyLoadSegment(const LoadSegment &segment, double progress,
+                        bool segment_start,
+                        ocpdiag::results::TestStep &test_step);
+
   class OsLayer *os_;               // Os abstraction: put hacks here.
   class PatternList *patternlist_;  // Access to global data patterns.
 
@@ -289,12 +499,43 @@ class Sat {
                          ocpdiag::results::TestStep &test_step);
 
   void QueueStats(ocpdiag::results::TestStep &test_step);
+  // Budget of the given worker type, or NULL if it runs unlimited.
+  TokenBucket *Budget(ThreadType type);
+  // Sample memory pressure and scale the budgets down while it is above
+  // psi_threshold_, or back up once it subsides.
+  void UpdateBudgetScale(int64 now_ms, ocpdiag::results::TestStep &test_step);
+  // How long the budgets held the workers back, summed over the threads.
+  void ReportBudgetStats(ocpdiag::results::TestStep &test_step);
+  // sched_yield() calls per work loop iteration of the cpu bound workers.
+  void ReportYieldStats(ocpdiag::results::TestStep &test_step);
+
+  // Choose how each cpu bound worker yields, from how many such workers
+  // share its cpus.
+  void SetYieldPolicies(ocpdiag::results::TestStep &test_step);
+
+  // Sweep copy thread counts per NUMA region and keep the smallest count
+  // that reaches the bandwidth knee.
+  bool AutoTuneCopyThreads();
+  // Memory bandwidth, in MB/s, of 'threads' copy threads pinned to 'region',
+  // or left unpinned if it is negative.
+  double MeasureCopyBandwidth(int threads, int32 region,
+                              ocpdiag::results::TestStep &tune_step);
+  // Load region_copy_threads_ from tune_profile_file_ if it was saved on the
+  // same kind of machine.
+  bool ReadTuneProfile(const string &sku,
+                       ocpdiag::results::TestStep &tune_step);
+  void WriteTuneProfile(const string &sku,
+                        ocpdiag::results::TestStep &tune_step);
 
   // Physical page use reporting.
   void AddrMapInit(ocpdiag::results::TestStep &fill_step);
   void AddrMapUpdate(struct page_entry *pe,
                      ocpdiag::results::TestStep &fill_step);
   void AddrMapPrint(ocpdiag::results::TestStep &fill_step);
+  // Sort and coalesce page_extents_ using one thread per cpu.
+  void AddrMapMerge();
+  // Write page_extents_ to page_map_file_ for offline tools.
+  bool AddrMapWrite(ocpdiag::results::TestStep &fill_step);
 
   // Page queues, only one of (valid_+empty_) or (finelock_q_) will be used
   // at a time. A commandline switch controls which queue implementation will
@@ -240,6 +240,7 @@ constexpr char kDiskAsyncOperationTimeoutFailVerdict[] =
     "sat-disk-async-operation-timeout-fail";
 constexpr char kDiskUnknownFailVerdict[] = "sat-disk-unknown-error-fail";
 constexpr char kDiskLowLevelIOFailVerdict[] = "sat-disk-low-level-io-fail";
+constexpr char kDiskSlowOperationVerdict[] = "sat-disk-slow-operation";
 
 constexpr char kCacheCoherencyFailVerdict[] = "sat-cache-coherency-fail";
 constexpr char kCpuFrequencyTooLowFailVerdict[] =
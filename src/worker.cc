@@ -8,6 +8,7 @@
 // stress the system
 
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sched.h>
 #include <signal.h>
@@ -15,6 +16,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/times.h>
@@ -39,6 +41,8 @@
 #include <libaio.h>
 #endif
 
+// For pausing and resuming workers.
+#include <linux/futex.h>
 #include <sys/syscall.h>
 
 #include <set>
@@ -131,6 +135,33 @@ static void *ThreadSpawnerGeneric(void *ptr) {
   return NULL;
 }
 
+// Sleep until *word no longer holds value. May return spuriously.
+static void FutexWait(std::atomic<uint32> *word, uint32 value) {
+  syscall(SYS_futex, reinterpret_cast<uint32 *>(word), FUTEX_WAIT_PRIVATE,
+          value, NULL, NULL, 0);
+}
+
+// Wake every thread sleeping in FutexWait() on word.
+static void FutexWakeAll(std::atomic<uint32> *word) {
+  syscall(SYS_futex, reinterpret_cast<uint32 *>(word), FUTEX_WAKE_PRIVATE,
+          INT_MAX, NULL, NULL, 0);
+}
+
+// Hint to the cpu that this is a spin loop.
+static inline void CpuRelax() {
+#if defined(STRESSAPPTEST_CPU_X86_64) || defined(STRESSAPPTEST_CPU_I686)
+  __builtin_ia32_pause();
+#elif defined(STRESSAPPTEST_CPU_AARCH64)
+  asm volatile("yield");
+#endif
+}
+
+static inline int64 MonotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 void WorkerStatus::Initialize() {
   sat_assert(0 == pthread_mutex_init(&num_workers_mutex_, NULL));
 
@@ -142,34 +173,93 @@ void WorkerStatus::Initialize() {
                       &attrs, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP));
 #endif
   sat_assert(0 == pthread_rwlock_init(&status_rwlock_, &attrs));
-
-#ifdef HAVE_PTHREAD_BARRIERS
-  sat_assert(0 ==
-             pthread_barrier_init(&pause_barrier_, NULL, num_workers_ + 1));
-  sat_assert(0 == pthread_rwlock_init(&pause_rwlock_, &attrs));
-#endif
-
   sat_assert(0 == pthread_rwlockattr_destroy(&attrs));
 }
 
 void WorkerStatus::Destroy() {
   sat_assert(0 == pthread_mutex_destroy(&num_workers_mutex_));
   sat_assert(0 == pthread_rwlock_destroy(&status_rwlock_));
-#ifdef HAVE_PTHREAD_BARRIERS
-  sat_assert(0 == pthread_barrier_destroy(&pause_barrier_));
-#endif
+  Reset();
 }
 
 void WorkerStatus::PauseWorkers() {
-  if (SetStatus(PAUSE) != PAUSE) WaitOnPauseBarrier();
+  if (SetStatus(PAUSE) == PAUSE) return;
+
+  // Wait for every worker to call ContinueRunning() or RemoveSelf().  The
+  // worker count can't change while paused, see RemoveSelf().
+  AcquireNumWorkersLock();
+  uint32 workers = num_workers_;
+  ReleaseNumWorkersLock();
+  if (workers == 0) return;
+  uint32 done = ((PauseEpoch() << kPausedEpochShift) | workers);
+  uint32 paused;
+  while ((paused = paused_workers_.value.load(std::memory_order_acquire)) !=
+         done) {
+    FutexWait(&paused_workers_.value, paused);
+  }
 }
 
 void WorkerStatus::ResumeWorkers() {
-  if (SetStatus(RUN) == PAUSE) WaitOnPauseBarrier();
+  first_resume_ns_.store(kNoResume, std::memory_order_relaxed);
+  last_resume_ns_.store(0, std::memory_order_relaxed);
+  resume_ns_ = MonotonicNs();
+  if (SetStatus(RUN) == PAUSE) FutexWakeAll(&state_.value);
 }
 
 void WorkerStatus::StopWorkers() {
-  if (SetStatus(STOP) == PAUSE) WaitOnPauseBarrier();
+  if (SetStatus(STOP) == PAUSE) FutexWakeAll(&state_.value);
+}
+
+bool WorkerStatus::ResumeSkew(int64 *latency_ns, int64 *skew_ns) {
+  int64 first = first_resume_ns_.exchange(kNoResume);
+  if (first == kNoResume) return false;
+  *latency_ns = first - resume_ns_;
+  *skew_ns = last_resume_ns_.load() - first;
+  return true;
+}
+
+void WorkerStatus::WaitWhilePaused() {
+  uint32 state = state_.value.load(std::memory_order_acquire);
+  bool counted = false;
+  uint32 counted_epoch = 0;
+  while ((state & kStatusMask) == PAUSE) {
+    // Let PauseWorkers() know this worker has stopped.  A worker that slept
+    // through a resume and into the next pause counts again for that one.
+    uint32 epoch = state >> kEpochShift;
+    if (!counted || epoch != counted_epoch) {
+      CountPaused(epoch);
+      counted = true;
+      counted_epoch = epoch;
+    }
+    FutexWait(&state_.value, state);
+    state = state_.value.load(std::memory_order_acquire);
+  }
+  if (counted && (state & kStatusMask) == RUN) RecordResume();
+}
+
+void WorkerStatus::CountPaused(uint32 epoch) {
+  uint32 tag = (epoch << kPausedEpochShift);
+  uint32 value = paused_workers_.value.load(std::memory_order_relaxed);
+  uint32 next;
+  do {
+    // Compare epochs modulo the bits kept, so that they can wrap.
+    uint32 counted_tag = value & ~kPausedCountMask;
+    int16 ahead = static_cast<int16>((tag - counted_tag) >> kPausedEpochShift);
+    if (ahead < 0) return;
+    next = ahead == 0 ? value + 1 : tag | 1;
+  } while (!paused_workers_.value.compare_exchange_weak(
+      value, next, std::memory_order_release, std::memory_order_relaxed));
+  FutexWakeAll(&paused_workers_.value);
+}
+
+void WorkerStatus::RecordResume() {
+  int64 now = MonotonicNs();
+  int64 first = first_resume_ns_.load(std::memory_order_relaxed);
+  while (now < first && !first_resume_ns_.compare_exchange_weak(first, now)) {
+  }
+  int64 last = last_resume_ns_.load(std::memory_order_relaxed);
+  while (now > last && !last_resume_ns_.compare_exchange_weak(last, now)) {
+  }
 }
 
 bool WorkerStatus::ContinueRunning(bool *paused) {
@@ -184,11 +274,9 @@ bool WorkerStatus::ContinueRunning(bool *paused) {
       case RUN:
         return true;
       case PAUSE:
-        // Wait for the other workers to call this function so that
-        // PauseWorkers() can return.
-        WaitOnPauseBarrier();
-        // Wait for ResumeWorkers() to be called.
-        WaitOnPauseBarrier();
+        // Report this worker as paused so that PauseWorkers() can return,
+        // then wait for ResumeWorkers() or StopWorkers().
+        WaitWhilePaused();
         // Indicate that a pause occurred.
         if (paused) {
           *paused = true;
@@ -206,27 +294,19 @@ void WorkerStatus::RemoveSelf() {
   // Acquire a read lock on status_rwlock_ while (status_ != PAUSE).
   for (;;) {
     AcquireStatusReadLock();
-    if (status_ != PAUSE) break;
+    if (GetStatus() != PAUSE) break;
     // We need to obey PauseWorkers() just like ContinueRunning() would, so that
-    // the other threads won't wait on pause_barrier_ forever.
+    // PauseWorkers() doesn't wait for this worker forever.
     ReleaseStatusLock();
-    // Wait for the other workers to call this function so that PauseWorkers()
-    // can return.
-    WaitOnPauseBarrier();
-    // Wait for ResumeWorkers() to be called.
-    WaitOnPauseBarrier();
+    WaitWhilePaused();
   }
 
   // This lock would be unnecessary if we held a write lock instead of a read
   // lock on status_rwlock_, but that would also force all threads calling
   // ContinueRunning() to wait on this one.  Using a separate lock avoids that.
+  // Holding the read lock keeps PauseWorkers() from counting workers while
+  // num_workers_ changes.
   AcquireNumWorkersLock();
-  // Decrement num_workers_ and reinitialize pause_barrier_, which we know isn't
-  // in use because (status != PAUSE).
-#ifdef HAVE_PTHREAD_BARRIERS
-  sat_assert(0 == pthread_barrier_destroy(&pause_barrier_));
-  sat_assert(0 == pthread_barrier_init(&pause_barrier_, NULL, num_workers_));
-#endif
   --num_workers_;
   ReleaseNumWorkersLock();
 
@@ -234,11 +314,39 @@ void WorkerStatus::RemoveSelf() {
   ReleaseStatusLock();
 }
 
+TokenBucket::TokenBucket(int64 bytes_per_second)
+    : bytes_per_second_(bytes_per_second) {
+  scale_ppm_ = 1000000;
+  arrival_ns_ = MonotonicNs();
+  throttled_ns_ = 0;
+}
+
+int64 TokenBucket::Reserve(int64 bytes) {
+  int64 rate = bytes_per_second_ * scale_ppm_.load(std::memory_order_relaxed) /
+               1000000;
+  if (rate < 1) rate = 1;
+  // A page or two at a time, so this can't overflow.
+  int64 cost = bytes * 1000000000LL / rate;
+  int64 now = MonotonicNs();
+  int64 arrival = arrival_ns_.load(std::memory_order_relaxed);
+  int64 next;
+  do {
+    // Unused budget doesn't accumulate beyond the present.
+    next = (arrival > now ? arrival : now) + cost;
+  } while (!arrival_ns_.compare_exchange_weak(arrival, next,
+                                              std::memory_order_relaxed));
+  return next - now - kBurstNs;
+}
+
 // Parent thread class.
 WorkerThread::WorkerThread() {
   status_ = false;
   pages_copied_ = 0;
   errorcount_ = 0;
+  iterations_ = 0;
+  yield_syscalls_ = 0;
+  yield_policy_ = kYieldAlways;
+  budget_ = NULL;
   runduration_usec_ = 1;
   priority_ = Normal;
   worker_status_ = NULL;
@@ -314,6 +422,24 @@ bool WorkerThread::InitPriority() {
                            cpuset_format(&cpu_mask_).c_str()));
   }
 
+  // Low impact runs leave the cpus to everything else first.
+  if (sat_->sched_idle()) {
+    struct sched_param param = {};
+    if (sched_setscheduler(0, SCHED_IDLE, &param)) {
+      AddLog(LogSeverity::kWarning,
+             absl::StrFormat("Unable to use SCHED_IDLE: %s",
+                             ErrorString(errno)));
+    }
+  }
+  if (sat_->nice_level()) {
+    // Linux applies the nice value of a thread id to that thread only.
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), sat_->nice_level())) {
+      AddLog(LogSeverity::kWarning,
+             absl::StrFormat("Unable to set nice level %d: %s",
+                             sat_->nice_level(), ErrorString(errno)));
+    }
+  }
+
   AddLog(LogSeverity::kDebug,
          absl::StrFormat("Running on core ID %d mask %s (%s)", sched_getcpu(),
                          CurrentCpusFormat().c_str(),
@@ -323,8 +449,28 @@ bool WorkerThread::InitPriority() {
 
 // Use pthreads to create a system thread.
 int WorkerThread::SpawnThread() {
+  pthread_attr_t attr;
+  sat_assert(0 == pthread_attr_init(&attr));
+#ifdef HAVE_PTHREAD_ATTR_SETAFFINITY_NP
+  // Bind before the thread starts, so that its first allocations and page
+  // faults land on the right node. InitPriority() still binds as a fallback.
+  cpu_set_t process_mask;
+  AvailableCpus(&process_mask);
+  if (!cpuset_isequal(&cpu_mask_, &process_mask) &&
+      cpuset_issubset(&cpu_mask_, &process_mask)) {
+    int err = pthread_attr_setaffinity_np(&attr, sizeof(cpu_mask_), &cpu_mask_);
+    if (err) {
+      AddLog(LogSeverity::kWarning,
+             absl::StrFormat("pthread_attr_setaffinity_np to %s failed with "
+                             "error code %d.",
+                             cpuset_format(&cpu_mask_), err));
+    }
+  }
+#endif
+
   // Create the new thread.
-  int result = pthread_create(&thread_, NULL, thread_spawner_, this);
+  int result = pthread_create(&thread_, &attr, thread_spawner_, this);
+  pthread_attr_destroy(&attr);
   if (result) {
     char buf[256];
     sat_strerror(result, buf, sizeof(buf));
@@ -355,7 +501,33 @@ bool WorkerThread::JoinThread() {
   return (!result);
 }
 
+// Name the thread after its type and ID, e.g. "sat-MC-3" for memory copy
+// thread 3, so profilers and /proc attribute time to the right workload.
+void WorkerThread::SetThreadName() {
+#ifdef HAVE_PTHREAD_SETNAME_NP
+  string type = GetThreadTypeName();
+  string initials;
+  bool word_start = true;
+  for (char c : type) {
+    if (c == ' ') {
+      word_start = true;
+    } else if (word_start) {
+      initials += c;
+      word_start = false;
+    }
+  }
+  // Every type name ends in "Thread", which says nothing.
+  if (initials.size() > 1 && initials.back() == 'T' &&
+      type.size() >= 6 && type.compare(type.size() - 6, 6, "Thread") == 0)
+    initials.pop_back();
+  // Names are limited to 15 characters plus the terminator.
+  string name = absl::StrFormat("sat-%s-%d", initials, thread_num_);
+  pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#endif
+}
+
 void WorkerThread::StartRoutine() {
+  SetThreadName();
   InitPriority();
   StartThreadTimer();
   Work();
@@ -434,7 +606,41 @@ bool WorkerThread::BindToCpus(const cpu_set_t *thread_mask) {
 
 // A worker thread can yield itself to give up CPU until it's scheduled again.
 //   Returns true on success, false on error.
-bool WorkerThread::YieldSelf() { return (sched_yield() == 0); }
+bool WorkerThread::YieldSelf() {
+  switch (yield_policy_) {
+    case kYieldNever:
+      return true;
+    case kYieldPause:
+      CpuRelax();
+      return true;
+    case kYieldAlways:
+      break;
+  }
+  yield_syscalls_++;
+  return (sched_yield() == 0);
+}
+
+void WorkerThread::Throttle(int64 bytes) {
+  if (!budget_) return;
+  int64 wait_ns = budget_->Reserve(bytes);
+  if (wait_ns <= 0) return;
+  budget_->AddThrottled(ThrottleSleep(wait_ns));
+}
+
+int64 WorkerThread::ThrottleSleep(int64 wait_ns) {
+  // Sleep in slices so that a stop or pause request isn't held up by a long
+  // wait, e.g. while backing off under memory pressure.
+  static const int64 kThrottleSliceNs = 100 * 1000000LL;
+  int64 start = MonotonicNs();
+  int64 end = start + wait_ns;
+  int64 now = start;
+  while (now < end && IsReadyToRunNoPause() && !IsPauseRequested()) {
+    int64 slice = std::min(end - now, kThrottleSliceNs);
+    sat_usleep(slice / 1000);
+    now = MonotonicNs();
+  }
+  return now - start;
+}
 
 void WorkerThread::AddLog(LogSeverity severity, const string &message) {
   test_step_->AddLog(
@@ -457,6 +663,17 @@ void WorkerThread::AddDiagnosis(const string &verdict, DiagnosisType type,
                 .type = type,
                 .message = absl::StrFormat("%s #%d: %s", GetThreadTypeName(),
                                            thread_num_, message)});
+  if (sat_ && type == DiagnosisType::kFail) {
+    sat_->ReportError(SatErrorRecord{.thread_type = GetThreadTypeName(),
+                                     .thread_id = thread_num_,
+                                     .verdict = verdict,
+                                     .message = message});
+  }
+}
+
+void WorkerThread::AddErrors(int64 count) {
+  errorcount_ += count;
+  if (sat_) sat_->ErrorsFound(count);
 }
 
 // Fill this page with its pattern.
@@ -470,6 +687,7 @@ bool WorkerThread::FillPage(struct page_entry *pe) {
 
   // Tag this page as written from the current CPU.
   pe->lastcpu = sched_getcpu();
+  pe->verified_epoch = 0;
 
   // Mask is the bitmask of indexes used by the pattern.
   // It is the pattern size -1. Size is always a power of 2.
@@ -570,7 +788,7 @@ bool FillThread::Work() {
   status_ = result;
   AddLog(LogSeverity::kDebug,
          absl::StrFormat("Completed. Status: %s. Filled %d pages.",
-                         status_ ? "Success" : "Fail", pages_copied_));
+                         status_ ? "Success" : "Fail", GetPageCount()));
   return result;
 }
 
@@ -841,7 +1059,7 @@ int WorkerThread::CheckRegion(void *addr, class Pattern *pattern,
   }
 
   // Keep track of observed errors.
-  errorcount_ += errors + overflowerrors;
+  AddErrors(errors + overflowerrors);
   return errors + overflowerrors;
 }
 
@@ -866,7 +1084,7 @@ int WorkerThread::CrcCheckPage(struct page_entry *srcpe) {
     if (tag_mode_) {
       AdlerAddrCrcC(memslice, blocksize, &crc, srcpe);
     } else {
-      CalculateAdlerChecksum(memslice, blocksize, &crc);
+      os_->AdlerChecksumMem(memslice, blocksize, &crc);
     }
 
     // If the CRC does not match, we'd better look closer.
@@ -895,6 +1113,8 @@ int WorkerThread::CrcCheckPage(struct page_entry *srcpe) {
     errors += CheckRegion(memslice, srcpe->pattern, srcpe->lastcpu, leftovers,
                           blocks * blocksize, 0);
   }
+  // Until the page is written again, the final check can skip it.
+  if (errors == 0) srcpe->verified_epoch = sat_->verify_epoch();
   return errors;
 }
 
@@ -941,7 +1161,7 @@ void WorkerThread::ProcessTagError(struct ErrorRecord *error,
                    CurrentCpusFormat(), error->vaddr, error->paddr, dimm_string,
                    error->actual, error->reread, error->expected));
 
-  errorcount_ += 1;
+  AddErrors(1);
 
   // Overwrite incorrect data with correct data to prevent
   // future miscompares when this data is reused.
@@ -1197,7 +1417,7 @@ int WorkerThread::CrcCopyPage(struct page_entry *dstpe,
             er.patternname = srcpe->pattern->name();
             ProcessError(&er, "Hardware Error");
             errors += 1;
-            errorcount_++;
+            AddErrors(1);
           }
         }
       }
@@ -1349,7 +1569,7 @@ int WorkerThread::CrcWarmCopyPage(struct page_entry *dstpe,
             er.patternname = srcpe->pattern->name();
             ProcessError(&er, "Hardware Error");
             errors++;
-            errorcount_++;
+            AddErrors(1);
           }
         }
       }
@@ -1395,7 +1615,7 @@ bool CheckThread::Work() {
   // We want to check all the pages, and
   // stop when there aren't any left.
   while (true) {
-    result = result && sat_->GetValid(&pe, *test_step_);
+    result = result && sat_->GetValid(&pe, tag_, *test_step_);
     if (!result) {
       if (IsReadyToRunNoPause())
         AddProcessError("check thread failed to pop pages");
@@ -1404,8 +1624,16 @@ bool CheckThread::Work() {
       break;
     }
 
-    // Do the result check.
-    CrcCheckPage(&pe);
+    // Do the result check.  Once stopped, pages already checked since they
+    // were last written don't need another one.
+    if (IsReadyToRunNoPause()) {
+      CrcCheckPage(&pe);
+    } else if (pe.verified_epoch == sat_->verify_epoch()) {
+      final_skipped_++;
+    } else {
+      CrcCheckPage(&pe);
+      final_checked_++;
+    }
 
     // Push pages back on the valid queue if we are still going,
     // throw them out otherwise.
@@ -1417,7 +1645,8 @@ bool CheckThread::Work() {
       AddProcessError("check thread failed to push pages");
       break;
     }
-    loops++;
+    pages_copied_ = ++loops;
+    Throttle(sat_->page_length());
   }
 
   pages_copied_ = loops;
@@ -1425,7 +1654,7 @@ bool CheckThread::Work() {
   AddLog(
       LogSeverity::kDebug,
       absl::StrFormat("Check thread completed with status %d, %d pages copied",
-                      status_, pages_copied_));
+                      status_, GetPageCount()));
   return result;
 }
 
@@ -1479,21 +1708,25 @@ bool CopyThread::Work() {
     // to avoid threads from preempting each other in the middle of the inner
     // copy-loop. Cooperations between Copy worker-threads results in less
     // unnecessary cache thrashing (which happens when context-switching in the
-    // middle of the inner copy-loop).
+    // middle of the inner copy-loop).  Threads that own their cpus have no
+    // one to cooperate with, so their yield policy skips the syscall.
     YieldSelf();
 
     if (!result) {
       AddProcessError("Failed to push pages.");
       break;
     }
-    loops++;
+    // Kept current so that bandwidth can be sampled while running.
+    pages_copied_ = ++loops;
+    iterations_ = loops;
+    // Each page is read and written once.
+    Throttle(2LL * sat_->page_length());
   }
 
-  pages_copied_ = loops;
   status_ = result;
   AddLog(LogSeverity::kDebug,
          absl::StrFormat("Status: %s, %d pages copied.",
-                         status_ ? "Success" : "Fail", pages_copied_));
+                         status_ ? "Success" : "Fail", GetPageCount()));
   return result;
 }
 
@@ -1514,6 +1747,7 @@ bool InvertThread::Work() {
     }
 
     if (sat_->strict()) CrcCheckPage(&src);
+    src.verified_epoch = 0;
 
     // For the same reason CopyThread yields itself (see YieldSelf comment
     // in CopyThread::Work(), InvertThread yields itself after each invert
@@ -1535,7 +1769,10 @@ bool InvertThread::Work() {
       AddProcessError("Failed to push pages");
       break;
     }
-    loops++;
+    iterations_ = ++loops;
+    pages_copied_ = loops * 2;
+    // Four passes, each reading and writing the page.
+    Throttle(8LL * sat_->page_length());
   }
 
   pages_copied_ = loops * 2;
@@ -1543,7 +1780,7 @@ bool InvertThread::Work() {
   AddLog(LogSeverity::kDebug,
          absl::StrFormat(
              "Invert thread completed with status %d and %d pages copied",
-             status_, pages_copied_));
+             status_, GetPageCount()));
   return result;
 }
 
@@ -1601,7 +1838,7 @@ bool FileThread::WritePageToFile(int fd, struct page_entry *src) {
   if (size != page_length) {
     AddDiagnosis(kFileWriteFailVerdict, DiagnosisType::kFail,
                  "Failed to write page to file.");
-    errorcount_++;
+    AddErrors(1);
     AddLog(LogSeverity::kWarning,
            "Block Error: file_thread failed to write, bailing");
     return false;
@@ -1633,8 +1870,10 @@ bool FileThread::WritePages(int fd) {
 
     if (!result) return false;
   }
+  // If O_DIRECT worked, this will be a NOP.
   return os_->FlushPageCache(
-      *test_step_);  // If O_DIRECT worked, this will be a NOP.
+      fd, 0, static_cast<int64>(sat_->disk_pages()) * sat_->page_length(),
+      *test_step_);
 }
 
 // Copy data from file into memory block.
@@ -1648,7 +1887,7 @@ bool FileThread::ReadPageFromFile(int fd, struct page_entry *dst) {
                  "Faile to read page from file.");
     AddLog(LogSeverity::kWarning,
            "Block Error: file_thread failed to read, bailing");
-    errorcount_++;
+    AddErrors(1);
     return false;
   }
   return true;
@@ -1701,7 +1940,7 @@ bool FileThread::SectorValidatePage(const struct PageRec &page,
         offset += 3 * sizeof(uint8);
 
       // Run sector tag error through diagnoser for logging and reporting.
-      errorcount_ += 1;
+      AddErrors(1);
       AddDiagnosis(
           kHddSectorTagFailVerdict, DiagnosisType::kFail,
           absl::StrFormat("Sector Error: Sector tag @ 0x%x, pass %d/%d. sec "
@@ -1861,7 +2100,7 @@ bool FileThread::ReadPages(int fd) {
         result = false;
       }
       crc_page_ = -1;
-      errorcount_ += errors;
+      AddErrors(errors);
     }
     if (!PutValidPage(&dst)) return false;
   }
@@ -1916,7 +2155,7 @@ bool FileThread::Work() {
 
   AddLog(LogSeverity::kDebug,
          absl::StrFormat("Completed %d: file thread status %d, %d pages copied",
-                         thread_num_, status_, pages_copied_));
+                         thread_num_, status_, GetPageCount()));
   // Failure to read from device indicates hardware,
   // rather than procedural SW error.
   status_ = true;
@@ -2182,7 +2421,7 @@ bool NetworkThread::Work() {
   AddLog(LogSeverity::kDebug,
          absl::StrFormat(
              "Network thread completed with status %d, %d pages copied",
-             status_, pages_copied_));
+             status_, GetPageCount()));
   return result;
 }
 
@@ -2274,7 +2513,7 @@ bool NetworkListenThread::Work() {
   AddLog(LogSeverity::kDebug,
          absl::StrFormat(
              "Network listen thread completed status %d, %d pages copied",
-             status_, pages_copied_));
+             status_, GetPageCount()));
   return true;
 }
 
@@ -2335,7 +2574,7 @@ bool NetworkSlaveThread::Work() {
   AddLog(LogSeverity::kDebug,
          absl::StrFormat(
              "Finished network listen child thread, status %d, %d pages copied",
-             status_, pages_copied_));
+             status_, GetPageCount()));
   return true;
 }
 
@@ -2348,6 +2587,7 @@ bool CpuStressThread::Work() {
     // Run ludloff's platform/CPU-specific assembly workload.
     os_->CpuStressWorkload();
     YieldSelf();
+    iterations_++;
   } while (IsReadyToRun());
 
   AddLog(LogSeverity::kDebug, "Finished CPU stress thread");
@@ -2441,7 +2681,7 @@ bool CpuCacheCoherencyThread::Work() {
     // of it being missed terribly minute.  It seems unlikely any failure
     // case would be off by more than a small number.
     if ((cc_global_num & 0xff) != (cc_inc_count_ & 0xff)) {
-      errorcount_++;
+      AddErrors(1);
       AddDiagnosis(
           kCacheCoherencyFailVerdict, DiagnosisType::kFail,
           absl::StrFormat(
@@ -2479,9 +2719,14 @@ bool CpuCacheCoherencyThread::Work() {
 }
 
 DiskThread::DiskThread(DiskBlockTable *block_table) {
-  read_block_size_ = kSectorSize;   // default 1 sector (512 bytes)
-  write_block_size_ = kSectorSize;  // this assumes read and write block size
-                                    // are the same
+  read_block_size_ = kDefaultSectorSize;   // default 1 sector
+  write_block_size_ = kDefaultSectorSize;  // this assumes read and write block
+                                           // size are the same
+  read_block_size_set_ = false;
+  write_block_size_set_ = false;
+  sector_size_ = kDefaultSectorSize;
+  physical_sector_size_ = kDefaultSectorSize;
+  buffer_alignment_ = kDefaultSectorSize;
   segment_size_ = -1;               // use the entire disk as one segment
   cache_size_ = 16 * 1024 * 1024;   // assume 16MiB cache by default
   // Use a queue such that 3/2 times as much data as the cache can hold
@@ -2501,18 +2746,43 @@ DiskThread::DiskThread(DiskBlockTable *block_table) {
 
 #ifdef HAVE_LIBAIO_H
   aio_ctx_ = 0;
+  aio_abandoned_ = 0;
+  aio_late_ = 0;
 #endif
   block_table_ = block_table;
   update_block_table_ = 1;
 
   block_buffer_ = NULL;
 
+  io_engine_ = kIoEngineAuto;
+  queue_depth_ = 1;
+  submit_batch_ = 1;
+  use_ring_ = false;
+  ring_failed_ = false;
+  pipeline_ = false;
+  direct_io_ = false;
+  latency_interval_ = 0;
+  last_latency_report_ = 0;
+  heatmap_region_size_ = 0;
+  device_iops_budget_ = NULL;
+  device_byte_budget_ = NULL;
+  backoff_ns_ = 0;
+  backoffs_ = 0;
+  throttled_ns_ = 0;
+  unflushed_start_ = 0;
+  unflushed_end_ = 0;
+  ring_buffers_ = NULL;
+  ring_slot_size_ = 0;
+  ring_next_block_op_ = 0;
+
   blocks_written_ = 0;
   blocks_read_ = 0;
 }
 
 DiskThread::~DiskThread() {
   if (block_buffer_) free(block_buffer_);
+  ring_.Destroy();
+  if (ring_buffers_) free(ring_buffers_);
 }
 
 // Set filename for device file (in /dev).
@@ -2529,22 +2799,24 @@ bool DiskThread::SetParameters(int read_block_size, int write_block_size,
                                int64 write_threshold, int non_destructive) {
   if (read_block_size != -1) {
     // Blocks must be aligned to the disk's sector size.
-    if (read_block_size % kSectorSize != 0) {
+    if (read_block_size <= 0 || read_block_size % kDefaultSectorSize != 0) {
       AddProcessError(absl::StrFormat(
-          "Block size must be a multiple of sector size %d", kSectorSize));
+          "Block size must be a multiple of sector size %d",
+          kDefaultSectorSize));
       return false;
     }
 
     read_block_size_ = read_block_size;
+    read_block_size_set_ = true;
   }
 
   if (write_block_size != -1) {
     // Write blocks must be aligned to the disk's sector size and to the
     // block size.
-    if (write_block_size % kSectorSize != 0) {
+    if (write_block_size <= 0 || write_block_size % kDefaultSectorSize != 0) {
       AddProcessError(absl::StrFormat(
           "Write block size must be a multiple of sector size %d",
-          kSectorSize));
+          kDefaultSectorSize));
       return false;
     }
     if (write_block_size % read_block_size_ != 0) {
@@ -2556,6 +2828,7 @@ bool DiskThread::SetParameters(int read_block_size, int write_block_size,
     }
 
     write_block_size_ = write_block_size;
+    write_block_size_set_ = true;
 
   } else {
     // Make sure write_block_size_ is still valid.
@@ -2608,15 +2881,16 @@ bool DiskThread::SetParameters(int read_block_size, int write_block_size,
   }
 
   if (segment_size != -1) {
-    // Segments must be aligned to the disk's sector size.
-    if (segment_size % kSectorSize != 0) {
+    // Segments must be aligned to the disk's sector size.  This is checked
+    // again once the device's own sector size is known.
+    if (segment_size % kDefaultSectorSize != 0) {
       AddProcessError(absl::StrFormat(
           "The segment size %d must be a multiple of the sector size %d",
-          segment_size, kSectorSize));
+          segment_size, kDefaultSectorSize));
       return false;
     }
 
-    segment_size_ = segment_size / kSectorSize;
+    segment_size_ = segment_size;
   }
 
   non_destructive_ = non_destructive;
@@ -2627,16 +2901,58 @@ bool DiskThread::SetParameters(int read_block_size, int write_block_size,
   queue_size_ = ((cache_size_ / write_block_size_) * 3) / 2;
   // Updating DiskBlockTable parameters
   if (update_block_table_) {
-    block_table_->SetParameters(kSectorSize, write_block_size_, device_sectors_,
-                                segment_size_, device_name_);
+    block_table_->SetParameters(
+        sector_size_, write_block_size_, device_sectors_,
+        segment_size_ == -1 ? -1 : segment_size_ / sector_size_, device_name_);
   }
   return true;
 }
 
+// Select the I/O engine and its queue depth.
+// A submit batch of 0 submits a full queue at once.
+bool DiskThread::SetIoEngine(int io_engine, int queue_depth,
+                             int submit_batch) {
+  if (io_engine < kIoEngineAuto || io_engine > kIoEngineUring) {
+    AddProcessError(absl::StrFormat("Unknown I/O engine %d", io_engine));
+    return false;
+  }
+  if (queue_depth <= 0) {
+    AddProcessError("Queue depth must be greater than zero");
+    return false;
+  }
+  if (queue_depth > 1 && io_engine == kIoEngineAio) {
+    AddProcessError("The AIO engine only supports a queue depth of 1");
+    return false;
+  }
+  if (submit_batch < 0 || submit_batch > queue_depth) {
+    AddProcessError(absl::StrFormat(
+        "Submit batch must be between 1 and the queue depth %d", queue_depth));
+    return false;
+  }
+
+  io_engine_ = io_engine;
+  queue_depth_ = queue_depth;
+  submit_batch_ = submit_batch ? submit_batch : queue_depth;
+  return true;
+}
+
+void DiskThread::SetRateLimits(TokenBucket *device_iops,
+                               TokenBucket *device_bytes, int64 thread_iops,
+                               int64 thread_bytes_per_second) {
+  device_iops_budget_ = device_iops;
+  device_byte_budget_ = device_bytes;
+  thread_iops_budget_.reset(thread_iops ? new TokenBucket(thread_iops)
+                                        : NULL);
+  thread_byte_budget_.reset(thread_bytes_per_second
+                                ? new TokenBucket(thread_bytes_per_second)
+                                : NULL);
+}
+
 // Open a device, return false on failure.
 bool DiskThread::OpenDevice(int *pfile) {
   int flags = O_RDWR | O_SYNC | O_LARGEFILE;
   int fd = open(device_name_.c_str(), flags | O_DIRECT, 0);
+  direct_io_ = (fd >= 0 && O_DIRECT != 0);
   if (O_DIRECT != 0 && fd < 0 && errno == EINVAL) {
     fd = open(device_name_.c_str(), flags, 0);  // Try without O_DIRECT
     os_->ActivateFlushPageCache(*test_step_);
@@ -2675,15 +2991,16 @@ bool DiskThread::GetDiskSize(int fd) {
                    absl::StrFormat("%s has a block size of zero, which "
                                    "indicates a non working device",
                                    device_name_));
-      ++errorcount_;
+      AddErrors(1);
       status_ = true;  // Avoid a procedural error.
       return false;
     }
 
-    device_sectors_ = block_size / kSectorSize;
+    GetSectorSizes(fd);
+    device_sectors_ = block_size / sector_size_;
 
   } else if (S_ISREG(device_stat.st_mode)) {
-    device_sectors_ = device_stat.st_size / kSectorSize;
+    device_sectors_ = device_stat.st_size / sector_size_;
 
   } else {
     AddProcessError(
@@ -2691,14 +3008,97 @@ bool DiskThread::GetDiskSize(int fd) {
     return false;
   }
 
-  AddLog(LogSeverity::kDebug, absl::StrFormat("Device sectors: %lld on disk %s",
-                                              device_sectors_, device_name_));
+  AddLog(LogSeverity::kDebug,
+         absl::StrFormat("Device sectors: %lld of %d bytes (%d bytes "
+                         "physical) on disk %s",
+                         device_sectors_, sector_size_, physical_sector_size_,
+                         device_name_));
+
+  if (!CheckBlockSizes()) return false;
 
   if (update_block_table_) {
-    block_table_->SetParameters(kSectorSize, write_block_size_, device_sectors_,
-                                segment_size_, device_name_);
+    block_table_->SetParameters(
+        sector_size_, write_block_size_, device_sectors_,
+        segment_size_ == -1 ? -1 : segment_size_ / sector_size_, device_name_);
+  }
+
+  return true;
+}
+
+// Query the logical and physical sector sizes of a block device.  The
+// logical size is the unit of addressing and the smallest O_DIRECT
+// transfer, the physical size the smallest write that a 512e drive does
+// without a read-modify-write cycle.  Regular files keep the defaults.
+void DiskThread::GetSectorSizes(int fd) {
+  int logical_size = 0;
+  if (ioctl(fd, BLKSSZGET, &logical_size) == -1 || logical_size <= 0 ||
+      logical_size % kDefaultSectorSize != 0) {
+    AddLog(LogSeverity::kWarning,
+           absl::StrFormat("Unable to get the sector size of disk %s, "
+                           "assuming %d bytes",
+                           device_name_, kDefaultSectorSize));
+    logical_size = kDefaultSectorSize;
+  }
+  unsigned int physical_size = 0;
+#ifdef BLKPBSZGET
+  if (ioctl(fd, BLKPBSZGET, &physical_size) == -1) physical_size = 0;
+#endif
+  if (physical_size < static_cast<unsigned int>(logical_size) ||
+      physical_size % logical_size != 0)
+    physical_size = logical_size;
+
+  sector_size_ = logical_size;
+  physical_sector_size_ = physical_size;
+  buffer_alignment_ = sector_size_;
+}
+
+// Check the read and write block sizes against the sector sizes, once
+// they are known.  Default block sizes grow to a physical sector.
+// Return false if the device can't do I/O at the given sizes.
+bool DiskThread::CheckBlockSizes() {
+  if (!read_block_size_set_ &&
+      (!write_block_size_set_ ||
+       write_block_size_ % physical_sector_size_ == 0)) {
+    read_block_size_ = std::max(read_block_size_, physical_sector_size_);
+  }
+  if (!write_block_size_set_) {
+    write_block_size_ = std::max(write_block_size_, read_block_size_);
+    queue_size_ = ((cache_size_ / write_block_size_) * 3) / 2;
   }
 
+  if (read_block_size_ % sector_size_ != 0 ||
+      write_block_size_ % sector_size_ != 0) {
+    AddProcessError(absl::StrFormat(
+        "Read block size %d and write block size %d must be multiples of "
+        "the %d byte sector size of disk %s",
+        read_block_size_, write_block_size_, sector_size_, device_name_));
+    return false;
+  }
+  if (segment_size_ != -1 && segment_size_ % sector_size_ != 0) {
+    AddProcessError(absl::StrFormat(
+        "The segment size %lld must be a multiple of the %d byte sector size "
+        "of disk %s",
+        segment_size_, sector_size_, device_name_));
+    return false;
+  }
+
+  // Smaller writes still work, but the drive has to read the rest of the
+  // physical sector first, which shows up in the latencies measured.
+  if (write_block_size_ % physical_sector_size_ != 0) {
+    AddLog(LogSeverity::kWarning,
+           absl::StrFormat("Write block size %d is not a multiple of the %d "
+                           "byte physical sector size of disk %s, writes "
+                           "will be read-modify-write",
+                           write_block_size_, physical_sector_size_,
+                           device_name_));
+  }
+  if (read_block_size_ % physical_sector_size_ != 0) {
+    AddLog(LogSeverity::kWarning,
+           absl::StrFormat("Read block size %d is not a multiple of the %d "
+                           "byte physical sector size of disk %s",
+                           read_block_size_, physical_sector_size_,
+                           device_name_));
+  }
   return true;
 }
 
@@ -2720,13 +3120,14 @@ bool DiskThread::DoWork(int fd) {
   if (segment_size_ == -1) {
     num_segments = 1;
   } else {
-    num_segments = device_sectors_ / segment_size_;
-    if (device_sectors_ % segment_size_ != 0) num_segments++;
+    int64 segment_sectors = segment_size_ / sector_size_;
+    num_segments = device_sectors_ / segment_sectors;
+    if (device_sectors_ % segment_sectors != 0) num_segments++;
   }
 
   // Disk size should be at least 3x cache size.  See comment later for
   // details.
-  sat_assert(device_sectors_ * kSectorSize > 3 * cache_size_);
+  sat_assert(device_sectors_ * sector_size_ > 3 * cache_size_);
 
   // This disk test works by writing blocks with a certain pattern to
   // disk, then reading them back and verifying it against the pattern
@@ -2740,31 +3141,31 @@ bool DiskThread::DoWork(int fd) {
   // enough blocks are written before read such that a block would
   // be ejected from the disk cache by the time it is read.
   //
-  // TODO(amistry): Implement some sort of read/write throttling.  The
-  //                flood of asynchronous I/O requests when a drive is
-  //                unplugged is causing the application and kernel to
-  //                become unresponsive.
-
-  read_times_ = std::make_unique<MeasurementSeries>(
-      MeasurementSeriesStart{
-          .name = absl::StrFormat("%s read times", device_name_),
-          .unit = "us",
-          .validators = {Validator{
-              .type = ValidatorType::kLessThanOrEqual,
-              .value = {static_cast<double>(read_threshold_)}}},
-      },
-      *test_step_);
-  write_times_ = std::make_unique<MeasurementSeries>(
-      MeasurementSeriesStart{
-          .name = absl::StrFormat("%s write times", device_name_),
-          .unit = "us",
-          .validators = {Validator{
-              .type = ValidatorType::kLessThanOrEqual,
-              .value = {static_cast<double>(write_threshold_)}}},
-      },
-      *test_step_);
+  // Requests are held back to the rate limits, if any, and slowed down
+  // further while they take longer than their timeout, since a flood of
+  // asynchronous I/O requests to an unplugged drive can make the
+  // application and kernel unresponsive.
 
   while (IsReadyToRun()) {
+    if (pipeline_) {
+      // Keep writing, and verify each block once enough blocks have been
+      // written after it to push it out of the disk cache, so that reads
+      // and writes overlap instead of taking turns.
+      if (!WriteNewBlock(fd, &block_num, num_segments)) return true;
+      if (block_num % (queue_size_ + 1) == 0) {
+        // Without O_DIRECT, the blocks about to be verified must be
+        // written and evicted from the page cache first.
+        if (!direct_io_ && use_ring_ && !ReapRing(0)) return true;
+        if (!FlushWrittenBlocks(fd)) return false;
+      }
+      if (in_flight_sectors_.size() > static_cast<size_t>(queue_size_) &&
+          !VerifyOldestBlock(fd)) {
+        if (use_ring_) ReapRing(0);
+        return true;
+      }
+      continue;
+    }
+
     // Write blocks to disk.
     AddLog(
         LogSeverity::kDebug,
@@ -2772,80 +3173,151 @@ bool DiskThread::DoWork(int fd) {
                         non_destructive_ ? "(disabled) " : "", device_name_));
     while (IsReadyToRunNoPause() &&
            in_flight_sectors_.size() < static_cast<size_t>(queue_size_ + 1)) {
-      // Confine testing to a particular segment of the disk.
-      int64 segment = (block_num / blocks_per_segment_) % num_segments;
-      if (!non_destructive_ && (block_num % blocks_per_segment_ == 0)) {
-        AddLog(LogSeverity::kDebug,
-               absl::StrFormat(
-                   "Starting to write segment %lld out of %lld on disk %s",
-                   segment, num_segments, device_name_));
-      }
-      block_num++;
-
-      BlockData *block = block_table_->GetUnusedBlock(segment, *test_step_);
-
-      // If an unused sequence of sectors could not be found, skip to the
-      // next block to process.  Soon, a new segment will come and new
-      // sectors will be able to be allocated.  This effectively puts a
-      // minumim on the disk size at 3x the stated cache size, or 48MiB
-      // if a cache size is not given (since the cache is set as 16MiB
-      // by default).  Given that todays caches are at the low MiB range
-      // and drive sizes at the mid GB, this shouldn't pose a problem.
-      // The 3x minimum comes from the following:
-      //   1. In order to allocate 'y' blocks from a segment, the
-      //      segment must contain at least 2y blocks or else an
-      //      allocation may not succeed.
-      //   2. Assume the entire disk is one segment.
-      //   3. A full write phase consists of writing blocks corresponding to
-      //      3/2 cache size.
-      //   4. Therefore, the one segment must have 2 * 3/2 * cache
-      //      size worth of blocks = 3 * cache size worth of blocks
-      //      to complete.
-      // In non-destructive mode, don't write anything to disk.
-      if (!non_destructive_) {
-        if (!WriteBlockToDisk(fd, block)) {
-          block_table_->RemoveBlock(block);
-          return true;
-        }
-        blocks_written_++;
-      }
-
-      // Block is either initialized by writing, or in nondestructive case,
-      // initialized by being added into the datastructure for later reading.
-      block->initialized();
-
-      in_flight_sectors_.push(block);
+      if (!WriteNewBlock(fd, &block_num, num_segments)) return true;
     }
-    if (!os_->FlushPageCache(
-            *test_step_))  // If O_DIRECT worked, this will be a NOP.
+    // Every write must be on disk before reading any of it back.
+    if (use_ring_ && !ReapRing(0)) return true;
+    if (!FlushWrittenBlocks(fd))  // If O_DIRECT worked, this will be a NOP.
       return false;
 
     // Verify blocks on disk.
     AddLog(LogSeverity::kDebug,
            absl::StrFormat("Read phase for disk %s", device_name_));
     while (IsReadyToRunNoPause() && !in_flight_sectors_.empty()) {
-      BlockData *block = in_flight_sectors_.front();
-      in_flight_sectors_.pop();
-      if (!ValidateBlockOnDisk(fd, block)) return true;
-      block_table_->RemoveBlock(block);
-      blocks_read_++;
+      if (!VerifyOldestBlock(fd)) {
+        if (use_ring_) ReapRing(0);
+        return true;
+      }
     }
+    if (use_ring_ && !ReapRing(0)) return true;
+  }
+  if (use_ring_) ReapRing(0);
+
+  // Leave the table empty for the next run.
+  while (!in_flight_sectors_.empty()) {
+    block_table_->RemoveBlock(in_flight_sectors_.front());
+    in_flight_sectors_.pop();
   }
 
   pages_copied_ = blocks_written_ + blocks_read_;
   return true;
 }
 
+// Allocate the next block, write it to disk and queue it for verification.
+// Return false if the block could not be written.
+bool DiskThread::WriteNewBlock(int fd, int64 *block_num, int64 num_segments) {
+  // Confine testing to a particular segment of the disk.
+  int64 segment = (*block_num / blocks_per_segment_) % num_segments;
+  if (!non_destructive_ && (*block_num % blocks_per_segment_ == 0)) {
+    AddLog(LogSeverity::kDebug,
+           absl::StrFormat(
+               "Starting to write segment %lld out of %lld on disk %s",
+               segment, num_segments, device_name_));
+  }
+  (*block_num)++;
+
+  BlockData *block = block_table_->GetUnusedBlock(segment, *test_step_);
+
+  // If an unused sequence of sectors could not be found, skip to the
+  // next block to process.  Soon, a new segment will come and new
+  // sectors will be able to be allocated.  This effectively puts a
+  // minumim on the disk size at 3x the stated cache size, or 48MiB
+  // if a cache size is not given (since the cache is set as 16MiB
+  // by default).  Given that todays caches are at the low MiB range
+  // and drive sizes at the mid GB, this shouldn't pose a problem.
+  // The 3x minimum comes from the following:
+  //   1. In order to allocate 'y' blocks from a segment, the
+  //      segment must contain at least 2y blocks or else an
+  //      allocation may not succeed.
+  //   2. Assume the entire disk is one segment.
+  //   3. A full write phase consists of writing blocks corresponding to
+  //      3/2 cache size.
+  //   4. Therefore, the one segment must have 2 * 3/2 * cache
+  //      size worth of blocks = 3 * cache size worth of blocks
+  //      to complete.
+  if (block == NULL) return true;
+
+  // In non-destructive mode, don't write anything to disk.
+  if (!non_destructive_) {
+    if (use_ring_) {
+      // Counted as written, and initialized, once the write completes.
+      if (!QueueBlockWrite(block)) {
+        ReapRing(0);
+        block_table_->RemoveBlock(block);
+        return false;
+      }
+    } else {
+      if (!WriteBlockToDisk(fd, block)) {
+        block_table_->RemoveBlock(block);
+        return false;
+      }
+      blocks_written_++;
+      block->set_initialized();
+    }
+
+    // Remember the span written, to evict it from the page cache later.
+    int64 start = block->address() * sector_size_;
+    int64 end = start + block->size();
+    if (unflushed_end_ == 0) {
+      unflushed_start_ = start;
+      unflushed_end_ = end;
+    } else {
+      unflushed_start_ = std::min(unflushed_start_, start);
+      unflushed_end_ = std::max(unflushed_end_, end);
+    }
+  } else {
+    // In nondestructive case, the block is initialized by being added into
+    // the datastructure for later reading.
+    block->set_initialized();
+  }
+
+  in_flight_sectors_.push(block);
+  return true;
+}
+
+// Write back and evict from the page cache the span of the device written
+// since the last time, so that reads of it come from the disk.
+bool DiskThread::FlushWrittenBlocks(int fd) {
+  if (unflushed_end_ == 0) return true;
+  bool result = os_->FlushPageCache(fd, unflushed_start_,
+                                    unflushed_end_ - unflushed_start_,
+                                    *test_step_);
+  unflushed_start_ = unflushed_end_ = 0;
+  return result;
+}
+
+// Verify the oldest block written.
+// Return false if the block could not be read.
+bool DiskThread::VerifyOldestBlock(int fd) {
+  BlockData *block = in_flight_sectors_.front();
+  in_flight_sectors_.pop();
+
+  if (use_ring_) {
+    // The block can't be read back before its write completed.
+    while (!block->initialized()) {
+      int in_flight = queue_depth_ - ring_free_slots_.size();
+      if (!ReapRing(in_flight - 1)) return false;
+    }
+    // Removed from the table once its reads complete.
+    return QueueBlockValidate(block);
+  }
+
+  if (!ValidateBlockOnDisk(fd, block)) return false;
+  block_table_->RemoveBlock(block);
+  blocks_read_++;
+  return true;
+}
+
 // Do an asynchronous disk I/O operation.
 // Return false if the IO is not set up.
 bool DiskThread::AsyncDiskIO(IoOp op, int fd, void *buf, int64 size,
-                             int64 offset, int64 timeout) {
+                             int64 offset, int64 timeout, BlockData *block) {
 #ifdef HAVE_LIBAIO_H
   // Use the Linux native asynchronous I/O interface for reading/writing.
   // A read/write consists of three basic steps:
-  //    1. create an io context.
-  //    2. prepare and submit an io request to the context
-  //    3. wait for an event on the context.
+  //    1. take a request slot on the thread's io context.
+  //    2. prepare and submit the request to the context
+  //    3. wait for its event on the context.
 
   struct {
     const int opcode;
@@ -2854,99 +3326,84 @@ bool DiskThread::AsyncDiskIO(IoOp op, int fd, void *buf, int64 size,
   } operations[2] = {{IO_CMD_PREAD, "read", "disk-read-error"},
                      {IO_CMD_PWRITE, "write", "disk-write-error"}};
 
-  struct iocb cb;
-  memset(&cb, 0, sizeof(cb));
-
-  cb.aio_fildes = fd;
-  cb.aio_lio_opcode = operations[op].opcode;
-  cb.u.c.buf = buf;
-  cb.u.c.nbytes = size;
-  cb.u.c.offset = offset;
-
-  struct iocb *cbs[] = {&cb};
-  if (io_submit(aio_ctx_, 1, cbs) != 1) {
-    int error = errno;
-    char buf[256];
-    sat_strerror(error, buf, sizeof(buf));
+  int slot = GetAioRequest(timeout);
+  if (slot < 0) return false;
+  AioRequest &request = aio_requests_[slot];
+
+  struct iocb *cb = &request.cb;
+  memset(cb, 0, sizeof(*cb));
+  cb->data = reinterpret_cast<void *>(static_cast<intptr_t>(slot));
+  cb->aio_fildes = fd;
+  cb->aio_lio_opcode = operations[op].opcode;
+  cb->u.c.buf = buf;
+  cb->u.c.nbytes = size;
+  cb->u.c.offset = offset;
+
+  struct iocb *cbs[] = {cb};
+  int submitted = io_submit(aio_ctx_, 1, cbs);
+  if (submitted != 1) {
+    int error = submitted < 0 ? -submitted : EAGAIN;
+    char errbuf[256];
+    sat_strerror(error, errbuf, sizeof(errbuf));
     AddProcessError(absl::StrFormat(
         "Unable to submit async %s on disk %s. Error code %d, %s",
-        operations[op].op_str, device_name_, error, buf));
+        operations[op].op_str, device_name_, error, errbuf));
+    aio_free_requests_.push_back(slot);
     return false;
   }
+  request.in_flight = true;
+  request.submit_time = GetTime();
+
+  // Completions of requests that timed out earlier may come in first.
+  int64 deadline = request.submit_time + timeout;
+  int reaped = 0;
+  while (request.in_flight) {
+    int64 remaining = deadline - GetTime();
+    if (remaining <= 0) {
+      reaped = 0;
+      break;
+    }
+    reaped = ReapAio(1, remaining);
+    if (reaped <= 0) break;
+  }
 
-  struct io_event event;
-  memset(&event, 0, sizeof(event));
-  struct timespec tv;
-  tv.tv_sec = timeout / 1000000;
-  tv.tv_nsec = (timeout % 1000000) * 1000;
-  if (io_getevents(aio_ctx_, 1, 1, &event, &tv) != 1) {
+  if (request.in_flight) {
     // A ctrl-c from the keyboard will cause io_getevents to fail with an
     // EINTR error code.  This is not an error and so don't treat it as such,
     // but still log it.
-    int error = errno;
-    if (error == EINTR) {
+    if (reaped == -EINTR) {
       AddLog(LogSeverity::kDebug,
              absl::StrFormat("%s interrupted on disk %s", operations[op].op_str,
                              device_name_));
+    } else if (reaped < 0) {
+      char errbuf[256];
+      sat_strerror(-reaped, errbuf, sizeof(errbuf));
+      AddProcessError(absl::StrFormat(
+          "Unable to wait for async %s on disk %s. Error code %d, %s",
+          operations[op].op_str, device_name_, -reaped, errbuf));
     } else {
       AddDiagnosis(
           kDiskAsyncOperationTimeoutFailVerdict, DiagnosisType::kFail,
           absl::StrFormat(
               "Timeout doing async %s to sectors starting at %lld on disk %s",
-              operations[op].op_str, offset / kSectorSize, device_name_));
-    }
-
-    // Don't bother checking return codes since io_cancel seems to always fail.
-    // Since io_cancel is always failing, destroying and recreating an I/O
-    // context is a workaround for canceling an in-progress I/O operation.
-    // TODO(amistry): Find out why io_cancel isn't working and make it work.
-    io_cancel(aio_ctx_, &cb, &event);
-    io_destroy(aio_ctx_);
-    aio_ctx_ = 0;
-    if (io_setup(5, &aio_ctx_)) {
-      int error = errno;
-      char buf[256];
-      sat_strerror(error, buf, sizeof(buf));
-      AddProcessError(absl::StrFormat(
-          "Unable to create aio context on disk %s Error %d, %s", device_name_,
-          error, buf));
+              operations[op].op_str, offset / sector_size_, device_name_));
+      CountRegionError(offset);
+      AdjustBackoff(true);
     }
 
+    // io_cancel is not supported by most block devices, and destroying the
+    // context waits for everything in flight, so leave the request in its
+    // slot instead.  It is reaped along with later requests.
+    AbandonAioRequest(slot, block);
     return false;
   }
 
-  // event.res contains the number of bytes written/read or
-  // error if < 0, I think.
-  if (event.res != static_cast<uint64>(size)) {
-    errorcount_++;
-    string message;
-    string verdict;
-
-    int64 result = static_cast<int64>(event.res);
-    if (result < 0) {
-      switch (result) {
-        case -EIO:
-          message = absl::StrFormat(
-              "Low-level I/O error while doing %s to sectors starting at %lld "
-              "on disk %s",
-              operations[op].op_str, offset / kSectorSize, device_name_);
-          verdict = kDiskLowLevelIOFailVerdict;
-          break;
-        default:
-          message = absl::StrFormat(
-              "Unknown error while doing %s to sectors starting at %lld on "
-              "disk %s",
-              operations[op].op_str, offset / kSectorSize, device_name_);
-          verdict = kDiskUnknownFailVerdict;
-      }
-    } else {
-      message = absl::StrFormat(
-          "Unable to %s to sectors starting at %lld on disk %s",
-          operations[op].op_str, offset / kSectorSize, device_name_);
-      verdict = kDiskUnknownFailVerdict;
-    }
-
-    AddDiagnosis(verict, DiagnosisType::kFail, message);
+  // The result is the number of bytes written/read, or a negative
+  // error code.
+  int64 result = request.result;
+  aio_free_requests_.push_back(slot);
+  if (result != size) {
+    ReportIOError(op, offset, result);
     return false;
   }
 
@@ -2956,48 +3413,503 @@ bool DiskThread::AsyncDiskIO(IoOp op, int fd, void *buf, int64 size,
 #endif
 }
 
-// Write a block to disk.
-// Return false if the block is not written.
-bool DiskThread::WriteBlockToDisk(int fd, BlockData *block) {
-  memset(block_buffer_, 0, block->size());
+#ifdef HAVE_LIBAIO_H
+// Set up the AIO context and its request slots.
+bool DiskThread::SetupAio() {
+  aio_ctx_ = 0;
+  int result = io_setup(kAioRequests, &aio_ctx_);
+  if (result) {
+    int error = result < 0 ? -result : errno;
+    char buf[256];
+    sat_strerror(error, buf, sizeof(buf));
+    AddProcessError(absl::StrFormat(
+        "Unable to create aio context on disk %s Error %d, %s", device_name_,
+        error, buf));
+    return false;
+  }
 
-  // Fill block buffer with a pattern
-  struct page_entry pe;
-  if (!sat_->GetValid(&pe, *test_step_)) {
+  aio_requests_.clear();
+  aio_requests_.resize(kAioRequests);
+  aio_free_requests_.clear();
+  for (int slot = kAioRequests - 1; slot >= 0; slot--)
+    aio_free_requests_.push_back(slot);
+  return true;
+}
+
+// Wait for outstanding requests, then release the AIO context.
+void DiskThread::DestroyAio() {
+  // Destroying the context waits for the requests still in flight, which
+  // can only be ones that timed out.
+  io_destroy(aio_ctx_);
+  aio_ctx_ = 0;
+  for (int slot = 0; slot < static_cast<int>(aio_requests_.size()); slot++) {
+    if (aio_requests_[slot].in_flight) FreeAioRequest(slot);
+  }
+
+  if (aio_abandoned_) {
+    AddLog(LogSeverity::kInfo,
+           absl::StrFormat("%lld timed out requests on disk %s were left "
+                           "in flight, %lld of them completed during the run",
+                           aio_abandoned_, device_name_, aio_late_));
+  }
+}
+
+// Return a free AIO request slot, waiting for a timed out request to
+// complete if needed.  Return -1 if none is free.
+int DiskThread::GetAioRequest(int64 timeout) {
+  if (aio_free_requests_.empty()) {
+    ReapAio(0, 0);
+    if (aio_free_requests_.empty()) ReapAio(1, timeout);
+  }
+  if (aio_free_requests_.empty()) {
+    AddProcessError(absl::StrFormat(
+        "All %zu async requests on disk %s timed out and are still "
+        "in flight",
+        aio_requests_.size(), device_name_));
+    return -1;
+  }
+  int slot = aio_free_requests_.back();
+  aio_free_requests_.pop_back();
+  return slot;
+}
+
+// Wait for AIO completions and match them to their requests.  Requests
+// being waited on get their result, timed out ones are freed.
+int DiskThread::ReapAio(int min_events, int64 timeout) {
+  struct io_event events[kAioRequests];
+  struct timespec tv;
+  tv.tv_sec = timeout / 1000000;
+  tv.tv_nsec = (timeout % 1000000) * 1000;
+  int count = io_getevents(aio_ctx_, min_events, kAioRequests, events,
+                           timeout < 0 ? NULL : &tv);
+  // libaio returns a negative error code, rather than setting errno.
+  if (count < 0) return count;
+
+  for (int i = 0; i < count; i++) {
+    int slot = static_cast<int>(reinterpret_cast<intptr_t>(events[i].data));
+    AioRequest &request = aio_requests_[slot];
+    // res holds a negative error code in an unsigned field.
+    request.result = static_cast<int64>(events[i].res);
+    if (!request.timed_out) {
+      request.in_flight = false;
+      continue;
+    }
+    aio_late_++;
+    AddLog(LogSeverity::kDebug,
+           absl::StrFormat("Timed out %s at sector %lld on disk %s completed "
+                           "after %lld us with result %lld",
+                           request.cb.aio_lio_opcode == IO_CMD_PWRITE ?
+                               "write" : "read",
+                           static_cast<int64>(request.cb.u.c.offset) /
+                               sector_size_,
+                           device_name_, GetTime() - request.submit_time,
+                           request.result));
+    FreeAioRequest(slot);
+  }
+  return count;
+}
+
+// Give up waiting on a request, leaving it in its slot to be reaped
+// whenever it completes.
+void DiskThread::AbandonAioRequest(int slot, BlockData *block) {
+  AioRequest &request = aio_requests_[slot];
+  request.timed_out = true;
+  aio_abandoned_++;
+
+  if (request.cb.aio_lio_opcode == IO_CMD_PWRITE) {
+    // The write can still land, so keep its sectors from going to another
+    // block until it has.
+    if (block) {
+      block->IncreaseReferenceCounter();
+      request.block = block;
+    }
+    return;
+  }
+
+  // The read can still land, so hand its buffer over to the request
+  // rather than let it overwrite the next read.
+  if (request.cb.u.c.buf != block_buffer_) return;
+  void *buffer = NULL;
+  if (AllocateBlockBuffer(&buffer) == 0) {
+    request.buffer = block_buffer_;
+    block_buffer_ = buffer;
+    return;
+  }
+
+  // Without a new buffer, wait the read out.
+  int reaped;
+  do {
+    reaped = ReapAio(1, -1);
+  } while (request.in_flight && (reaped >= 0 || reaped == -EINTR));
+}
+
+// Release what an AIO request held and free its slot.
+void DiskThread::FreeAioRequest(int slot) {
+  AioRequest &request = aio_requests_[slot];
+  if (request.block) block_table_->ReleaseBlock(request.block);
+  if (request.buffer) free(request.buffer);
+  request.block = NULL;
+  request.buffer = NULL;
+  request.in_flight = false;
+  request.timed_out = false;
+  aio_free_requests_.push_back(slot);
+}
+#endif  // HAVE_LIBAIO_H
+
+// Allocate a block buffer aligned to the sector size since the kernel
+// requires it when using direct IO.
+int DiskThread::AllocateBlockBuffer(void **buffer) {
+#ifdef HAVE_POSIX_MEMALIGN
+  return posix_memalign(buffer, buffer_alignment_, sat_->page_length());
+#else
+  *buffer = memalign(buffer_alignment_, sat_->page_length());
+  return *buffer == 0;
+#endif
+}
+
+// Report a failed or short I/O operation.
+// 'result' is the byte count or the negative error code of the operation.
+void DiskThread::ReportIOError(IoOp op, int64 offset, int64 result) {
+  const char *op_str = op == ASYNC_IO_WRITE ? "write" : "read";
+  string message;
+  string verdict;
+
+  AddErrors(1);
+  if (result < 0) {
+    switch (result) {
+      case -EIO:
+        message = absl::StrFormat(
+            "Low-level I/O error while doing %s to sectors starting at %lld "
+            "on disk %s",
+            op_str, offset / sector_size_, device_name_);
+        verdict = kDiskLowLevelIOFailVerdict;
+        break;
+      default:
+        message = absl::StrFormat(
+            "Unknown error while doing %s to sectors starting at %lld on "
+            "disk %s",
+            op_str, offset / sector_size_, device_name_);
+        verdict = kDiskUnknownFailVerdict;
+    }
+  } else {
+    message =
+        absl::StrFormat("Unable to %s to sectors starting at %lld on disk %s",
+                        op_str, offset / sector_size_, device_name_);
+    verdict = kDiskUnknownFailVerdict;
+  }
+
+  AddDiagnosis(verdict, DiagnosisType::kFail, message);
+  CountRegionError(offset);
+}
+
+// Check out a valid test memory page to write a block straight from.
+// Test memory is page aligned, so it is fine for O_DIRECT as it is.  The
+// page stays checked out until the write completes, so that no other
+// thread changes it in the meantime.
+// Return false if there is no page to use.
+bool DiskThread::GetBlockPage(BlockData *block, struct page_entry *pe) {
+  if (block->size() > static_cast<uint64>(sat_->page_length())) return false;
+  if (!sat_->GetValid(pe, *test_step_)) {
     // Even though a valid page could not be obatined, it is not an error
     // since we can always fill in a pattern directly, albeit slower.
-    unsigned int *memblock = static_cast<unsigned int *>(block_buffer_);
-    block->set_pattern(patternlist_->GetRandomPattern());
-
     AddLog(LogSeverity::kWarning,
            absl::StrFormat("Using pattern fill fallback in "
-                           "DiskThread::WriteBlockToDisk on disk %s.",
+                           "DiskThread::GetBlockPage on disk %s.",
                            device_name_));
+    return false;
+  }
+  block->set_pattern(pe->pattern);
+  return true;
+}
+
+// Fill a buffer with a random pattern for a block about to be written,
+// when it can't be written from a test memory page.
+void DiskThread::FillBlockBuffer(void *buf, BlockData *block) {
+  unsigned int *memblock = static_cast<unsigned int *>(buf);
+  block->set_pattern(patternlist_->GetRandomPattern());
 
-    for (unsigned int i = 0; i < block->size() / wordsize_; i++) {
-      memblock[i] = block->pattern()->pattern(i);
+  for (unsigned int i = 0; i < block->size() / sizeof(*memblock); i++) {
+    memblock[i] = block->pattern()->pattern(i);
+  }
+}
+
+// Mark the start of every sector of a read buffer with the inverse of the
+// data expected there, so that a read that transfers nothing can't pass on
+// stale data.  This replaces clearing the whole buffer before every read.
+void DiskThread::PoisonReadBuffer(void *buf, BlockData *block, int64 size,
+                                  int64 pattern_offset) {
+  // There is no expected data in non-destructive mode.
+  if (non_destructive_) return;
+  Pattern *pattern = block->pattern();
+  uint64 *memblock = static_cast<uint64 *>(buf);
+  int64 words_per_sector = sector_size_ / sizeof(*memblock);
+  for (int64 i = 0; i < size / sector_size_; i++) {
+    // Same layout as CheckRegion expects.
+    datacast_t data;
+    int64 index = 2 * i * words_per_sector + pattern_offset;
+    data.l32.l = pattern->pattern(index);
+    data.l32.h = pattern->pattern(index + 1);
+    memblock[i * words_per_sector] = ~data.l64;
+  }
+}
+
+// Count a request's latency in the histograms rather than recording every
+// request, which at high IOPS costs more than the I/O itself.  Requests
+// over the threshold are still reported one by one.
+void DiskThread::RecordLatency(IoOp op, int64 latency, int64 offset) {
+  int64 threshold;
+  RegionStats *region = NULL;
+  if (!heatmap_.empty()) {
+    region = &heatmap_[std::min<int64>(offset / heatmap_region_size_,
+                                       heatmap_.size() - 1)];
+  }
+  if (op == ASYNC_IO_WRITE) {
+    write_latency_.Record(latency);
+    interval_write_latency_.Record(latency);
+    threshold = write_threshold_;
+    if (region) {
+      region->writes++;
+      region->write_time += latency;
+      region->write_max = std::max(region->write_max, latency);
     }
   } else {
-    memcpy(block_buffer_, pe.addr, block->size());
-    block->set_pattern(pe.pattern);
-    sat_->PutValid(&pe, *test_step_);
+    read_latency_.Record(latency);
+    interval_read_latency_.Record(latency);
+    threshold = read_threshold_;
+    if (region) {
+      region->reads++;
+      region->read_time += latency;
+      region->read_max = std::max(region->read_max, latency);
+    }
   }
 
+  if (latency > threshold) {
+    AddDiagnosis(
+        kDiskSlowOperationVerdict, DiagnosisType::kUnknown,
+        absl::StrFormat("Slow %s of %lld us, over the threshold of %lld us, "
+                        "to sectors starting at %lld on disk %s",
+                        op == ASYNC_IO_WRITE ? "write" : "read", latency,
+                        threshold, offset / sector_size_, device_name_));
+  }
+
+  // Timed out requests never get here, so back off from slow ones already.
+  AdjustBackoff(latency > threshold);
+
+  if (latency_interval_ &&
+      GetTime() - last_latency_report_ >= latency_interval_)
+    ReportLatency(false);
+}
+
+// Summarize the latency histograms as count, p50, p99, p99.9 and max.
+void DiskThread::ReportLatency(bool final) {
+  int64 now = GetTime();
+  ReportHeatmap();
+  for (int op = ASYNC_IO_READ; op <= ASYNC_IO_WRITE; op++) {
+    bool write = (op == ASYNC_IO_WRITE);
+    const char *op_str = write ? "write" : "read";
+    LatencyHistogram *interval =
+        write ? &interval_write_latency_ : &interval_read_latency_;
+
+    if (!final) {
+      if (interval->count()) {
+        AddLog(LogSeverity::kInfo,
+               absl::StrFormat(
+                   "%s latency on disk %s over the last %.1f s: %lld "
+                   "requests, p50 %lld us, p99 %lld us, p99.9 %lld us, "
+                   "max %lld us",
+                   op_str, device_name_,
+                   (now - last_latency_report_) / 1000000.0, interval->count(),
+                   interval->Percentile(50), interval->Percentile(99),
+                   interval->Percentile(99.9), interval->max()));
+      }
+      interval->Reset();
+      continue;
+    }
+
+    const LatencyHistogram &total = write ? write_latency_ : read_latency_;
+    if (total.count() == 0) continue;
+    string name = absl::StrFormat("%s #%d %s %s latency", GetThreadTypeName(),
+                                  thread_num_, device_name_, op_str);
+    test_step_->AddMeasurement(Measurement{
+        .name = absl::StrFormat("%s requests", name),
+        .unit = "requests",
+        .value = static_cast<double>(total.count()),
+    });
+    const double kPercentiles[] = {50, 99, 99.9};
+    for (double percentile : kPercentiles) {
+      test_step_->AddMeasurement(Measurement{
+          .name = absl::StrFormat("%s p%g", name, percentile),
+          .unit = "us",
+          .value = static_cast<double>(total.Percentile(percentile)),
+      });
+    }
+    test_step_->AddMeasurement(Measurement{
+        .name = absl::StrFormat("%s max", name),
+        .unit = "us",
+        .validators = {Validator{
+            .type = ValidatorType::kLessThanOrEqual,
+            .value = {static_cast<double>(write ? write_threshold_
+                                                : read_threshold_)}}},
+        .value = static_cast<double>(total.max()),
+    });
+  }
+  last_latency_report_ = now;
+}
+
+// Hold requests back to the rate limits, so that the flood of requests to
+// a failing drive can't make the system unresponsive.  A request waits for
+// whichever limit, or the backoff, is furthest behind.
+void DiskThread::ThrottleRequest(int64 bytes) {
+  TokenBucket *budgets[] = {device_iops_budget_, device_byte_budget_,
+                            thread_iops_budget_.get(),
+                            thread_byte_budget_.get()};
+  int64 costs[] = {1, bytes, 1, bytes};
+  int64 budget_waits_ns[4] = {0, 0, 0, 0};
+  int64 wait_ns = backoff_ns_;
+  for (int i = 0; i < 4; i++) {
+    if (!budgets[i]) continue;
+    budget_waits_ns[i] = budgets[i]->Reserve(costs[i]);
+    wait_ns = std::max(wait_ns, budget_waits_ns[i]);
+  }
+  if (wait_ns <= 0) return;
+  if (use_ring_) {
+    // Ring latency is measured when a request is reaped, so finish what is
+    // in flight before sleeping, rather than charging the sleep to the
+    // device.  The slot of the request being queued is already taken.
+    int64 drain_start = GetTime();
+    ReapRing(1);
+    wait_ns -= (GetTime() - drain_start) * 1000;
+    if (wait_ns <= 0) return;
+  }
+  int64 slept_ns = ThrottleSleep(wait_ns);
+  throttled_ns_ += slept_ns;
+  // Each limit is charged for the part of the sleep it asked for.
+  for (int i = 0; i < 4; i++) {
+    if (budget_waits_ns[i] > 0)
+      budgets[i]->AddThrottled(std::min(budget_waits_ns[i], slept_ns));
+  }
+}
+
+void DiskThread::AdjustBackoff(bool slow) {
+  static const int64 kMinBackoffNs = 1000000LL;
+  static const int64 kMaxBackoffNs = 1000000000LL;
+  if (slow) {
+    // Later backoffs are counted in the summary at the end of the thread.
+    if (backoffs_ == 0) {
+      AddLog(LogSeverity::kInfo,
+             absl::StrFormat("Requests to disk %s are slower than their "
+                             "threshold, slowing down",
+                             device_name_));
+    }
+    // Back off quickly, and recover slowly.
+    backoff_ns_ = std::min(std::max(backoff_ns_ * 2, kMinBackoffNs),
+                           kMaxBackoffNs);
+    backoffs_++;
+  } else if (backoff_ns_) {
+    backoff_ns_ = backoff_ns_ * 7 / 8;
+    if (backoff_ns_ < kMinBackoffNs) backoff_ns_ = 0;
+  }
+}
+
+// Split the device into the regions of the latency heatmap: one per
+// segment, or kDefaultHeatmapRegions if the device is a single segment,
+// merging segments if there would be more than kMaxHeatmapRegions.
+void DiskThread::SetupHeatmap() {
+  int64 device_size = device_sectors_ * sector_size_;
+  int64 region_size = segment_size_;
+  if (region_size == -1)
+    region_size = (device_size + kDefaultHeatmapRegions - 1) /
+                  kDefaultHeatmapRegions;
+  int64 min_region_size =
+      (device_size + kMaxHeatmapRegions - 1) / kMaxHeatmapRegions;
+  if (region_size < min_region_size)
+    region_size = (min_region_size + region_size - 1) / region_size *
+                  region_size;
+  if (region_size <= 0) {
+    heatmap_.clear();
+    return;
+  }
+
+  heatmap_region_size_ = region_size;
+  heatmap_.assign((device_size + region_size - 1) / region_size,
+                  RegionStats{});
+}
+
+void DiskThread::CountRegionError(int64 offset) {
+  if (heatmap_.empty()) return;
+  heatmap_[std::min<int64>(offset / heatmap_region_size_, heatmap_.size() - 1)]
+      .errors++;
+}
+
+// Record the heatmap as a measurement of the worst mean latency of any
+// region, with the totals of every region, in disk order, as metadata.
+void DiskThread::ReportHeatmap() {
+  if (heatmap_.empty()) return;
+
+  string reads, read_mean, read_max, writes, write_mean, write_max, errors;
+  double worst_mean = 0;
+  for (size_t i = 0; i < heatmap_.size(); i++) {
+    const RegionStats &region = heatmap_[i];
+    const char *separator = i ? "," : "";
+    double region_read_mean =
+        region.reads ? static_cast<double>(region.read_time) / region.reads
+                     : 0;
+    double region_write_mean =
+        region.writes ? static_cast<double>(region.write_time) / region.writes
+                      : 0;
+    worst_mean = std::max(worst_mean,
+                          std::max(region_read_mean, region_write_mean));
+    absl::StrAppendFormat(&reads, "%s%lld", separator, region.reads);
+    absl::StrAppendFormat(&read_mean, "%s%.0f", separator, region_read_mean);
+    absl::StrAppendFormat(&read_max, "%s%lld", separator, region.read_max);
+    absl::StrAppendFormat(&writes, "%s%lld", separator, region.writes);
+    absl::StrAppendFormat(&write_mean, "%s%.0f", separator,
+                          region_write_mean);
+    absl::StrAppendFormat(&write_max, "%s%lld", separator, region.write_max);
+    absl::StrAppendFormat(&errors, "%s%lld", separator, region.errors);
+  }
+
+  test_step_->AddMeasurement(Measurement{
+      .name = absl::StrFormat("%s #%d %s latency heatmap", GetThreadTypeName(),
+                              thread_num_, device_name_),
+      .unit = "us",
+      .metadata_json = absl::StrFormat(
+          "{\"region_bytes\":%lld,\"reads\":[%s],\"read_mean_us\":[%s],"
+          "\"read_max_us\":[%s],\"writes\":[%s],\"write_mean_us\":[%s],"
+          "\"write_max_us\":[%s],\"errors\":[%s]}",
+          heatmap_region_size_, reads, read_mean, read_max, writes,
+          write_mean, write_max, errors),
+      .value = worst_mean,
+  });
+}
+
+// Write a block to disk.
+// Return false if the block is not written.
+bool DiskThread::WriteBlockToDisk(int fd, BlockData *block) {
+  struct page_entry pe;
+  bool zero_copy = GetBlockPage(block, &pe);
+  void *buf = zero_copy ? pe.addr : block_buffer_;
+  if (!zero_copy) FillBlockBuffer(block_buffer_, block);
+
   AddLog(LogSeverity::kDebug,
          absl::StrFormat("Writing %lld sectors starting at %lld on disk %s",
-                         block->size() / kSectorSize, block->address(),
+                         block->size() / sector_size_, block->address(),
                          device_name_));
 
+  ThrottleRequest(block->size());
   int64 start_time = GetTime();
 
-  if (!AsyncDiskIO(ASYNC_IO_WRITE, fd, block_buffer_, block->size(),
-                   block->address() * kSectorSize, write_timeout_)) {
-    return false;
-  }
+  bool written = AsyncDiskIO(ASYNC_IO_WRITE, fd, buf, block->size(),
+                             block->address() * sector_size_, write_timeout_,
+                             block);
+  // A write that timed out may still read the page, but what it writes
+  // lands in sectors held back until it completes.
+  if (zero_copy) sat_->PutValid(&pe, *test_step_);
+  if (!written) return false;
 
   int64 end_time = GetTime();
-  write_times_->AddElement(MeasurementSeriesElement{
-      .value = static_cast<double>(end_time - start_time)});
+  RecordLatency(ASYNC_IO_WRITE, end_time - start_time,
+                block->address() * sector_size_);
 
   return true;
 }
@@ -3018,14 +3930,13 @@ bool DiskThread::ValidateBlockOnDisk(int fd, BlockData *block) {
 
   // Read block from disk and time the read.  If it takes longer than the
   // threshold, complain.
-  if (lseek(fd, address * kSectorSize, SEEK_SET) == -1) {
+  if (lseek(fd, address * sector_size_, SEEK_SET) == -1) {
     AddProcessError(
         absl::StrFormat("Unable to seek to sector %lld in "
                         "DiskThread::ValidateSectorsOnDisk on disk %s",
                         address, device_name_));
     return false;
   }
-  int64 start_time = GetTime();
 
   // Split a large write-sized block into small read-sized blocks and
   // read them in groups of randomly-sized multiples of read block size.
@@ -3036,34 +3947,41 @@ bool DiskThread::ValidateBlockOnDisk(int fd, BlockData *block) {
     current_blocks = (random() % blocks) + 1;
     current_bytes = current_blocks * read_block_size_;
 
-    memset(block_buffer_, 0, current_bytes);
+    // The pattern is indexed in 32-bit words from the start of the block.
+    int64 pattern_offset = bytes_read / sizeof(uint32);
+    PoisonReadBuffer(block_buffer_, block, current_bytes, pattern_offset);
 
     AddLog(
         LogSeverity::kDebug,
         absl::StrFormat(
             "Reading %lld sectors starting at sector %lld on disk %s",
-            current_bytes / kSectorSize,
-            (address * kSectorSize + bytes_read) / kSectorSize, device_name_));
+            current_bytes / sector_size_,
+            (address * sector_size_ + bytes_read) / sector_size_,
+            device_name_));
 
+    ThrottleRequest(current_bytes);
+    int64 start_time = GetTime();
     if (!AsyncDiskIO(ASYNC_IO_READ, fd, block_buffer_, current_bytes,
-                     address * kSectorSize + bytes_read, write_timeout_)) {
+                     address * sector_size_ + bytes_read, read_timeout_,
+                     NULL)) {
       return false;
     }
 
     int64 end_time = GetTime();
-    read_times_->AddElement(MeasurementSeriesElement{
-        .value = static_cast<double>(end_time - start_time)});
+    RecordLatency(ASYNC_IO_READ, end_time - start_time,
+                  address * sector_size_ + bytes_read);
 
     // In non-destructive mode, don't compare the block to the pattern since
     // the block was never written to disk in the first place.
     if (!non_destructive_) {
       if (CheckRegion(block_buffer_, block->pattern(), 0, current_bytes, 0,
-                      bytes_read)) {
+                      pattern_offset)) {
         AddDiagnosis(
             kDiskPatternMismatchFailVerdict, DiagnosisType::kFail,
             absl::StrFormat("Pattern mismatch in block starting at sector %lld "
                             "in DiskThread::ValidateSectorsOnDisk on disk %s.",
                             address, device_name_));
+        CountRegionError(address * sector_size_ + bytes_read);
       }
     }
 
@@ -3074,6 +3992,321 @@ bool DiskThread::ValidateBlockOnDisk(int fd, BlockData *block) {
   return true;
 }
 
+// Set up the io_uring engine on the device.
+// Return false if it can't be used.
+bool DiskThread::SetupRing(int fd) {
+  bool required = (io_engine_ == kIoEngineUring);
+  if (!IoRing::Supported()) {
+    if (required) AddProcessError("io_uring support is not compiled in");
+    return false;
+  }
+
+  // The ring can be set up on kernels that lack the operations it uses, in
+  // which case every request would fail.
+  int result = ring_.Init(queue_depth_);
+  if (result == 0) result = ring_.ProbeOps();
+  if (result < 0) {
+    ring_.Destroy();
+    char buf[256];
+    sat_strerror(-result, buf, sizeof(buf));
+    string message =
+        absl::StrFormat("Unable to set up io_uring for disk %s. Error %d, %s",
+                        device_name_, -result, buf);
+    if (required) {
+      AddProcessError(message);
+    } else {
+      AddLog(LogSeverity::kDebug, absl::StrCat(message, ", using AIO"));
+    }
+    return false;
+  }
+
+  // Each request slot holds a whole block, aligned for direct I/O.
+  ring_slot_size_ = std::max(write_block_size_, read_block_size_);
+  ring_slot_size_ = (ring_slot_size_ + buffer_alignment_ - 1) /
+                    buffer_alignment_ * buffer_alignment_;
+  void *buffers = NULL;
+#ifdef HAVE_POSIX_MEMALIGN
+  int memalign_result = posix_memalign(&buffers, buffer_alignment_,
+                                       ring_slot_size_ * queue_depth_);
+#else
+  buffers = memalign(buffer_alignment_, ring_slot_size_ * queue_depth_);
+  int memalign_result = (buffers == 0);
+#endif
+  if (memalign_result) {
+    ring_.Destroy();
+    AddProcessError(
+        absl::StrFormat("Unable to allocate io_uring buffers for disk %s "
+                        "posix memalign returned error code %d.",
+                        device_name_, memalign_result));
+    return false;
+  }
+  if (ring_buffers_) free(ring_buffers_);
+  ring_buffers_ = static_cast<char *>(buffers);
+
+  std::vector<struct iovec> iovecs(queue_depth_);
+  ring_requests_.assign(queue_depth_, RingRequest());
+  ring_free_slots_.clear();
+  for (int slot = queue_depth_ - 1; slot >= 0; slot--) {
+    iovecs[slot].iov_base = ring_buffers_ + slot * ring_slot_size_;
+    iovecs[slot].iov_len = ring_slot_size_;
+    ring_free_slots_.push_back(slot);
+  }
+  ring_unsubmitted_.clear();
+  ring_block_ops_.clear();
+  ring_failed_ = false;
+
+  // Registering the device and the buffers saves a lookup and a page
+  // pinning on every request, but either can be done without.
+  result = ring_.RegisterFile(fd);
+  if (result < 0) {
+    AddLog(LogSeverity::kDebug,
+           absl::StrFormat("Unable to register disk %s with io_uring, "
+                           "error %d",
+                           device_name_, -result));
+  }
+  result = ring_.RegisterBuffers(iovecs.data(), queue_depth_);
+  if (result < 0) {
+    AddLog(LogSeverity::kDebug,
+           absl::StrFormat("Unable to register io_uring buffers for disk %s, "
+                           "error %d",
+                           device_name_, -result));
+  }
+
+  AddLog(LogSeverity::kDebug,
+         absl::StrFormat("Using io_uring on disk %s: queue depth %d, submit "
+                         "batch %d, fixed file %d, fixed buffers %d",
+                         device_name_, queue_depth_, submit_batch_,
+                         ring_.fixed_file(), ring_.fixed_buffers()));
+  return true;
+}
+
+// Return a free request slot, waiting for a request to complete if needed.
+// Return -1 if a request failed.
+int DiskThread::GetRingSlot() {
+  if (ring_free_slots_.empty() && !ReapRing(queue_depth_ - 1)) return -1;
+  if (ring_failed_) return -1;
+  int slot = ring_free_slots_.back();
+  ring_free_slots_.pop_back();
+  return slot;
+}
+
+// Queue a request on the ring.  The kernel is handed the queued requests
+// once there is a full batch of them.  A write from a test memory 'page'
+// goes straight from the page, which is returned once the write completes;
+// anything else uses the slot's registered buffer.
+// Return false if a request failed.
+bool DiskThread::QueueRingRequest(int slot, IoOp op, BlockData *block,
+                                  int64 block_offset, int64 size,
+                                  int64 block_op, struct page_entry *page) {
+  ThrottleRequest(size);
+  if (ring_failed_) {
+    // Finishing the requests in flight while throttling failed one.
+    if (page) sat_->PutValid(page, *test_step_);
+    ring_free_slots_.push_back(slot);
+    return false;
+  }
+
+  RingRequest &request = ring_requests_[slot];
+  request.op = op;
+  request.block = block;
+  request.block_offset = block_offset;
+  request.size = size;
+  request.submit_time = 0;
+  request.block_op = block_op;
+  request.has_page = (page != NULL);
+  if (page) request.page = *page;
+
+  void *buf = page ? page->addr : ring_buffers_ + slot * ring_slot_size_;
+  // Test memory pages are not registered with the ring, so zero-copy
+  // writes use plain (unfixed) writes; SetupRing probes for both kinds.
+  int buf_index = page ? -1 : slot;
+  int64 offset = block->address() * sector_size_ + block_offset;
+  int64 timeout = (op == ASYNC_IO_WRITE) ? write_timeout_ : read_timeout_;
+  if (!ring_.Queue(op == ASYNC_IO_WRITE, buf, buf_index, size, offset, slot,
+                   timeout)) {
+    AddProcessError(absl::StrFormat("io_uring queue full on disk %s",
+                                    device_name_));
+    if (page) sat_->PutValid(page, *test_step_);
+    ring_free_slots_.push_back(slot);
+    ring_failed_ = true;
+    return false;
+  }
+  ring_unsubmitted_.push_back(slot);
+  ring_block_ops_[block_op]++;
+
+  if (ring_.queued() < static_cast<unsigned>(submit_batch_)) return true;
+  return ReapRing(queue_depth_);
+}
+
+// Queue the write of a block on the ring.
+// Return false if a request failed.
+bool DiskThread::QueueBlockWrite(BlockData *block) {
+  int slot = GetRingSlot();
+  if (slot < 0) return false;
+
+  struct page_entry pe;
+  bool zero_copy = GetBlockPage(block, &pe);
+  if (!zero_copy)
+    FillBlockBuffer(ring_buffers_ + slot * ring_slot_size_, block);
+
+  AddLog(LogSeverity::kDebug,
+         absl::StrFormat("Writing %lld sectors starting at %lld on disk %s",
+                         block->size() / sector_size_, block->address(),
+                         device_name_));
+
+  return QueueRingRequest(slot, ASYNC_IO_WRITE, block, 0, block->size(),
+                          ring_next_block_op_++, zero_copy ? &pe : NULL);
+}
+
+// Queue the reads verifying a block on the ring.  The block is split into
+// randomly sized reads as in ValidateBlockOnDisk, but they are all in flight
+// at once, up to the queue depth.
+// Return false if a request failed.
+bool DiskThread::QueueBlockValidate(BlockData *block) {
+  int64 blocks = block->size() / read_block_size_;
+  int64 bytes_read = 0;
+  int64 block_op = ring_next_block_op_++;
+  bool queued = true;
+
+  AddLog(LogSeverity::kDebug,
+         absl::StrFormat("Reading sectors starting at %lld on disk %s",
+                         block->address(), device_name_));
+
+  // Hold the block until every read is queued, so that it can't be
+  // released by the first reads completing.
+  ring_block_ops_[block_op] = 1;
+  while (blocks != 0) {
+    int64 current_blocks = (random() % blocks) + 1;
+    int64 current_bytes = current_blocks * read_block_size_;
+
+    int slot = GetRingSlot();
+    if (slot < 0) {
+      queued = false;
+      break;
+    }
+    PoisonReadBuffer(ring_buffers_ + slot * ring_slot_size_, block,
+                     current_bytes, bytes_read / sizeof(uint32));
+    if (!QueueRingRequest(slot, ASYNC_IO_READ, block, bytes_read,
+                          current_bytes, block_op, NULL)) {
+      queued = false;
+      break;
+    }
+
+    bytes_read += current_bytes;
+    blocks -= current_blocks;
+  }
+  ReleaseRingBlockOp(block_op, block, ASYNC_IO_READ);
+  return queued;
+}
+
+// Submit queued requests and process completions until no more than
+// 'max_in_flight' requests are outstanding.
+// Return false if a request failed.
+bool DiskThread::ReapRing(int max_in_flight) {
+  while (true) {
+    int in_flight = queue_depth_ - ring_free_slots_.size();
+    bool wait = in_flight > max_in_flight;
+    if (!ring_unsubmitted_.empty() || wait) {
+      // Stamped before the call, since waiting for a completion inside it
+      // can take as long as the requests themselves.
+      int64 submit_time = GetTime();
+      int result = ring_.Submit(wait ? 1 : 0);
+      if (result < 0 && result != -EINTR && result != -EAGAIN &&
+          result != -EBUSY) {
+        char buf[256];
+        sat_strerror(-result, buf, sizeof(buf));
+        AddProcessError(absl::StrFormat(
+            "Unable to submit io_uring requests on disk %s. Error %d, %s",
+            device_name_, -result, buf));
+        ring_failed_ = true;
+        return false;
+      }
+      // Each request is two entries, the I/O and its timeout.  Requests
+      // the kernel did not take yet are stamped when it does.
+      if (result > 0) {
+        size_t submitted =
+            std::min<size_t>((result + 1) / 2, ring_unsubmitted_.size());
+        for (size_t i = 0; i < submitted; i++)
+          ring_requests_[ring_unsubmitted_[i]].submit_time = submit_time;
+        ring_unsubmitted_.erase(ring_unsubmitted_.begin(),
+                                ring_unsubmitted_.begin() + submitted);
+      }
+    }
+
+    uint64 slot;
+    int result;
+    while (ring_.Reap(&slot, &result)) CompleteRingRequest(slot, result);
+
+    in_flight = queue_depth_ - ring_free_slots_.size();
+    if (in_flight <= max_in_flight) break;
+  }
+  return !ring_failed_;
+}
+
+// Check the result of a completed request and free its slot.
+void DiskThread::CompleteRingRequest(int slot, int result) {
+  RingRequest &request = ring_requests_[slot];
+  BlockData *block = request.block;
+  int64 offset = block->address() * sector_size_ + request.block_offset;
+
+  if (result == -ECANCELED) {
+    // The linked timeout expired and canceled the request.
+    AddDiagnosis(
+        kDiskAsyncOperationTimeoutFailVerdict, DiagnosisType::kFail,
+        absl::StrFormat(
+            "Timeout doing async %s to sectors starting at %lld on disk %s",
+            request.op == ASYNC_IO_WRITE ? "write" : "read",
+            offset / sector_size_, device_name_));
+    CountRegionError(offset);
+    AdjustBackoff(true);
+    ring_failed_ = true;
+  } else if (result != request.size) {
+    ReportIOError(request.op, offset, result);
+    ring_failed_ = true;
+  } else {
+    // Time each request from its own submission, so that requests queued
+    // behind others in a batch are not charged for them.
+    RecordLatency(request.op, GetTime() - request.submit_time, offset);
+
+    // In non-destructive mode, the block was never written.
+    if (request.op == ASYNC_IO_READ && !non_destructive_ &&
+        CheckRegion(ring_buffers_ + slot * ring_slot_size_, block->pattern(),
+                    0, request.size, 0,
+                    request.block_offset / sizeof(uint32))) {
+      AddDiagnosis(
+          kDiskPatternMismatchFailVerdict, DiagnosisType::kFail,
+          absl::StrFormat("Pattern mismatch in block starting at sector %lld "
+                          "in DiskThread::CompleteRingRequest on disk %s.",
+                          block->address(), device_name_));
+      CountRegionError(offset);
+    }
+  }
+
+  if (request.has_page) sat_->PutValid(&request.page, *test_step_);
+  ring_free_slots_.push_back(slot);
+  ReleaseRingBlockOp(request.block_op, block, request.op);
+}
+
+// Drop one outstanding request of a block operation.
+void DiskThread::ReleaseRingBlockOp(int64 block_op, BlockData *block,
+                                    IoOp op) {
+  std::map<int64, int>::iterator it = ring_block_ops_.find(block_op);
+  if (--it->second > 0) return;
+  ring_block_ops_.erase(it);
+  RingBlockDone(block, op);
+}
+
+// Account for a block whose requests have all completed.
+void DiskThread::RingBlockDone(BlockData *block, IoOp op) {
+  if (op == ASYNC_IO_WRITE) {
+    block->set_initialized();
+    blocks_written_++;
+  } else {
+    block_table_->RemoveBlock(block);
+    blocks_read_++;
+  }
+}
+
 // Direct device access thread.
 // Return false on software error.
 bool DiskThread::Work() {
@@ -3089,15 +4322,7 @@ bool DiskThread::Work() {
     return false;
   }
 
-  // Allocate a block buffer aligned to 512 bytes since the kernel requires it
-  // when using direct IO.
-#ifdef HAVE_POSIX_MEMALIGN
-  int memalign_result =
-      posix_memalign(&block_buffer_, kBufferAlignment, sat_->page_length());
-#else
-  block_buffer_ = memalign(kBufferAlignment, sat_->page_length());
-  int memalign_result = (block_buffer_ == 0);
-#endif
+  int memalign_result = AllocateBlockBuffer(&block_buffer_);
   if (memalign_result) {
     CloseDevice(fd);
     AddProcessError(
@@ -3108,31 +4333,50 @@ bool DiskThread::Work() {
     return false;
   }
 
+  use_ring_ = false;
+  if (io_engine_ != kIoEngineAio) {
+    use_ring_ = SetupRing(fd);
+    if (!use_ring_ && io_engine_ == kIoEngineUring) {
+      CloseDevice(fd);
+      status_ = false;
+      return false;
+    }
+  }
+
 #ifdef HAVE_LIBAIO_H
-  if (io_setup(5, &aio_ctx_)) {
+  if (!use_ring_ && !SetupAio()) {
     CloseDevice(fd);
-    AddProcessError(
-        absl::StrFormat("Unable to allocate memory for buffers for disk %s "
-                        "posix memalign returned error code %d.",
-                        device_name_, memalign_result));
     status_ = false;
     return false;
   }
 #endif
 
+  // Time every request, random threads included.
+  last_latency_report_ = GetTime();
+  SetupHeatmap();
+
   bool result = DoWork(fd);
+  ReportLatency(true);
+  if (throttled_ns_ || backoffs_) {
+    AddLog(LogSeverity::kInfo,
+           absl::StrFormat("Held requests to disk %s back for %.1f s, "
+                           "backed off %lld times after slow requests",
+                           device_name_, throttled_ns_ / 1000000000.0,
+                           backoffs_));
+  }
 
   status_ = result;
 
+  if (use_ring_) ring_.Destroy();
 #ifdef HAVE_LIBAIO_H
-  io_destroy(aio_ctx_);
+  if (!use_ring_) DestroyAio();
 #endif
   CloseDevice(fd);
 
   AddLog(LogSeverity::kDebug,
          absl::StrFormat(
              "Completed thread for disk %s: status %d, %d pages copied",
-             device_name_, status_, pages_copied_));
+             device_name_, status_, GetPageCount()));
   return result;
 }
 
@@ -3152,16 +4396,30 @@ bool RandomDiskThread::DoWork(int fd) {
     if (block == NULL) {
       AddLog(LogSeverity::kDebug,
              absl::StrFormat("No block available for device %s", device_name_));
+    } else if (use_ring_) {
+      // Released once its reads complete.  As with AIO, carry on after a
+      // failed request, once everything in flight has completed.
+      if (!QueueBlockValidate(block)) {
+        ReapRing(0);
+        ring_failed_ = false;
+      }
     } else {
       ValidateBlockOnDisk(fd, block);
       block_table_->ReleaseBlock(block);
       blocks_read_++;
     }
   }
+  if (use_ring_) ReapRing(0);
   pages_copied_ = blocks_read_;
   return true;
 }
 
+// Release a randomly picked block once its reads have completed.
+void RandomDiskThread::RingBlockDone(BlockData *block, IoOp op) {
+  block_table_->ReleaseBlock(block);
+  blocks_read_++;
+}
+
 // The list of MSRs to read from each cpu.
 const CpuFreqThread::CpuRegisterType CpuFreqThread::kCpuRegisters[] = {
     {kMsrTscAddr, "TSC"},
@@ -3316,7 +4574,7 @@ bool CpuFreqThread::Work() {
           cpu_freqs[cpu]->AddElement(
               MeasurementSeriesElement{.value = static_cast<double>(freq)});
           if (freq < freq_threshold_) {
-            errorcount_++;
+            AddErrors(1);
             pass = false;
             AddDiagnosis(
                 kCpuFrequencyTooLowFailVerdict, DiagnosisType::kFail,
@@ -21,6 +21,8 @@
 #include <libaio.h>
 #endif
 
+#include <atomic>
+#include <map>
 #include <queue>
 #include <set>
 #include <string>
@@ -29,6 +31,8 @@
 // This file must work with autoconf on its public version,
 // so these includes are correct.
 #include "disk_blocks.h"
+#include "io_ring.h"
+#include "latency_histogram.h"
 #include "ocpdiag/core/results/data_model/input_model.h"
 #include "ocpdiag/core/results/measurement_series.h"
 #include "ocpdiag/core/results/test_step.h"
@@ -72,7 +76,7 @@ class WorkerStatus {
   // Methods for the control thread.
   //--------------------------------
 
-  WorkerStatus() : num_workers_(0), status_(RUN) {}
+  WorkerStatus() { Reset(); }
 
   // Called by the control thread to increase the worker count.  Must be called
   // before Initialize().  The worker count is 0 upon object initialization.
@@ -87,7 +91,8 @@ class WorkerStatus {
 
   // Called by the control thread after joining all worker threads.  Must be
   // called iff Initialize() was called.  No methods may be called after calling
-  // this.
+  // this, except to reuse the object: it is left as newly constructed, ready
+  // for AddWorkers() and Initialize() again.
   void Destroy();
 
   // Called by the control thread to tell the workers to pause.  Does not return
@@ -101,6 +106,13 @@ class WorkerStatus {
   // directly after PauseWorkers().
   void ResumeWorkers();
 
+  // Timing of the last ResumeWorkers(): the delay until the first worker was
+  // running again, and the spread between the first and the last worker.
+  // Only meaningful once every worker has resumed, e.g. after the next
+  // PauseWorkers() returned.  Returns false if no resume was measured since
+  // the previous call.
+  bool ResumeSkew(int64 *latency_ns, int64 *skew_ns);
+
   // Called by the control thread to tell the workers to stop.  May only be
   // called between Initialize() and Destroy().  May only be called once.
   void StopWorkers();
@@ -127,18 +139,51 @@ class WorkerStatus {
   // PauseWorkers() should never be used!
   bool ContinueRunningNoPause();
 
+  // Whether PauseWorkers() was called and the workers not yet resumed.  Does
+  // not pause, so that a worker can cut a wait short and pause at its next
+  // ContinueRunning().
+  bool PauseRequested() { return GetStatus() == PAUSE; }
+
+  // Number of times PauseWorkers() has been called. May be called from any
+  // thread.
+  uint32 PauseEpoch() {
+    return state_.value.load(std::memory_order_acquire) >> kEpochShift;
+  }
+
  private:
   enum Status { RUN, PAUSE, STOP };
 
-  void WaitOnPauseBarrier() {
-#ifdef HAVE_PTHREAD_BARRIERS
-    pthread_rwlock_rdlock(&pause_rwlock_);
-    int error = pthread_barrier_wait(&pause_barrier_);
-    if (error != PTHREAD_BARRIER_SERIAL_THREAD) sat_assert(error == 0);
-    pthread_rwlock_unlock(&pause_rwlock_);
-#endif
+  // state_ holds the Status in its low bits and a pause epoch above them.
+  // Writers update it while holding status_rwlock_, so RemoveSelf() can
+  // still exclude status changes, but readers only need a single atomic
+  // load.  It is 32 bits wide so that paused workers can futex wait on it.
+  static const uint32 kStatusMask = 3;
+  static const int kEpochShift = 2;
+  // paused_workers_ holds the low bits of the pause epoch being counted
+  // above the count of workers that have seen that pause.
+  static const int kPausedEpochShift = 16;
+  static const uint32 kPausedCountMask = (1 << kPausedEpochShift) - 1;
+  static const int64 kNoResume = INT64_MAX;
+
+  // Puts the status back to RUN with no workers and no resume history.
+  void Reset() {
+    num_workers_ = 0;
+    state_.value = RUN;
+    paused_workers_.value = 0;
+    resume_ns_ = 0;
+    first_resume_ns_ = kNoResume;
+    last_resume_ns_ = 0;
   }
 
+  // Called by a worker that saw PAUSE.  Reports the worker as paused and
+  // returns once the status is no longer PAUSE.
+  void WaitWhilePaused();
+  // Count this worker as paused in pause 'epoch', unless a later pause is
+  // already being counted.
+  void CountPaused(uint32 epoch);
+  // Fold this worker's resume time into the skew statistics.
+  void RecordResume();
+
   void AcquireNumWorkersLock() {
     sat_assert(0 == pthread_mutex_lock(&num_workers_mutex_));
   }
@@ -159,18 +204,22 @@ class WorkerStatus {
     sat_assert(0 == pthread_rwlock_unlock(&status_rwlock_));
   }
 
+  // Lock free. The common "still running" check is one relaxed load of a
+  // cache line that is only written on status changes.
   Status GetStatus() {
-    AcquireStatusReadLock();
-    Status status = status_;
-    ReleaseStatusLock();
-    return status;
+    return static_cast<Status>(state_.value.load(std::memory_order_relaxed) &
+                               kStatusMask);
   }
 
   // Returns the previous status.
   Status SetStatus(Status status) {
     AcquireStatusWriteLock();
-    Status prev_status = status_;
-    status_ = status;
+    uint32 prev_state = state_.value.load(std::memory_order_relaxed);
+    Status prev_status = static_cast<Status>(prev_state & kStatusMask);
+    uint32 epoch = prev_state >> kEpochShift;
+    if (status == PAUSE && prev_status != PAUSE) epoch++;
+    state_.value.store((epoch << kEpochShift) | status,
+                       std::memory_order_release);
     ReleaseStatusLock();
     return prev_status;
   }
@@ -178,17 +227,72 @@ class WorkerStatus {
   pthread_mutex_t num_workers_mutex_;
   int num_workers_;
 
-  pthread_rwlock_t status_rwlock_;
-  Status status_;
-
-#ifdef HAVE_PTHREAD_BARRIERS
-  pthread_barrier_t pause_barrier_;
-  pthread_rwlock_t pause_rwlock_;  // Guards pause_barrier_
-#endif
+  pthread_rwlock_t status_rwlock_;  // Serializes status changes.
+  // Kept on its own cache line so polling workers do not contend with
+  // the locks.
+  struct alignas(kCacheLineSize) {
+    std::atomic<uint32> value;
+  } state_;
+
+  // Workers that have seen the current pause, tagged with its epoch so that
+  // a worker still leaving an earlier pause is not counted twice.
+  // PauseWorkers() futex waits on it until every worker has stopped.
+  struct alignas(kCacheLineSize) {
+    std::atomic<uint32> value;
+  } paused_workers_;
+
+  // Resume timing, in CLOCK_MONOTONIC nanoseconds.
+  int64 resume_ns_;  // When ResumeWorkers() released the workers.
+  std::atomic<int64> first_resume_ns_;  // First worker running again.
+  std::atomic<int64> last_resume_ns_;   // Last worker running again.
 
   DISALLOW_COPY_AND_ASSIGN(WorkerStatus);
 };
 
+// Byte rate budget shared by the workers of one type, for running at reduced
+// intensity next to other services.  This is a token bucket in its virtual
+// scheduling form: each reservation pushes a theoretical arrival time forward
+// by its cost, and a caller that gets more than a burst ahead of real time
+// waits out the difference.  Lock free.  Disk threads also use it to limit
+// requests, reserving one "byte" per request.
+class TokenBucket {
+ public:
+  explicit TokenBucket(int64 bytes_per_second);
+
+  // Reserve 'bytes' of the budget.  Returns how long the caller should wait,
+  // in nanoseconds, before using them.
+  int64 Reserve(int64 bytes);
+
+  // Run at 'scale' times the configured rate, to back off under pressure.
+  void SetScale(double scale) {
+    scale_ppm_.store(static_cast<int64>(scale * 1000000),
+                     std::memory_order_relaxed);
+  }
+  double scale() const {
+    return scale_ppm_.load(std::memory_order_relaxed) / 1000000.0;
+  }
+  int64 bytes_per_second() const { return bytes_per_second_; }
+
+  // Total time callers waited.
+  void AddThrottled(int64 ns) {
+    throttled_ns_.fetch_add(ns, std::memory_order_relaxed);
+  }
+  int64 ThrottledNs() const {
+    return throttled_ns_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  // Reservations may run this far ahead of real time without waiting.
+  static constexpr int64 kBurstNs = 50 * 1000000LL;
+
+  const int64 bytes_per_second_;
+  std::atomic<int64> scale_ppm_;     // Rate multiplier, in millionths.
+  std::atomic<int64> arrival_ns_;    // Theoretical arrival time.
+  std::atomic<int64> throttled_ns_;  // Sum of returned waits.
+
+  DISALLOW_COPY_AND_ASSIGN(TokenBucket);
+};
+
 // This is a base class for worker threads.
 // Each thread repeats a specific
 // task on various blocks of memory.
@@ -217,6 +321,8 @@ class WorkerThread {
   // Only for ThreadSpawnerGeneric().
   void StartRoutine();
   bool InitPriority();
+  // Name the calling thread after this worker.
+  void SetThreadName();
 
   // Wait for the thread to complete its cleanup.
   virtual bool JoinThread();
@@ -242,7 +348,9 @@ class WorkerThread {
   // Acccess member variables.
   bool GetStatus() { return status_; }
   int64 GetErrorCount() { return errorcount_; }
-  int64 GetPageCount() { return pages_copied_; }
+  int64 GetPageCount() {
+    return pages_copied_.load(std::memory_order_relaxed);
+  }
   int64 GetRunDurationUSec() { return runduration_usec_; }
   virtual string GetThreadTypeName() { return "Generic Worker Thread"; }
 
@@ -267,8 +375,25 @@ class WorkerThread {
     cpuset_set_ab(&cpu_mask_, cpu_num, cpu_num + 1);
   }
 
+  const cpu_set_t *cpu_mask() const { return &cpu_mask_; }
+
+  // Limit the memory traffic of this thread to a budget shared with others.
+  void set_budget(TokenBucket *budget) { budget_ = budget; }
+
   void set_tag(int32 tag) { tag_ = tag; }
 
+  // How YieldSelf() lets other threads run between units of work.
+  enum YieldPolicy {
+    kYieldAlways,  // sched_yield(), for threads that share their cpus.
+    kYieldPause,   // Only a spin-wait hint, for SMT siblings.
+    kYieldNever,   // Threads that own their cpus.
+  };
+  void set_yield_policy(YieldPolicy policy) { yield_policy_ = policy; }
+  YieldPolicy yield_policy() const { return yield_policy_; }
+  // Work loop iterations, and the sched_yield() calls made during them.
+  int64 GetIterations() { return iterations_; }
+  int64 GetYieldSyscalls() { return yield_syscalls_; }
+
   // Returns CPU mask, where each bit represents a logical cpu.
   bool AvailableCpus(cpu_set_t *cpuset);
   // Returns CPU mask of CPUs this thread is bound to,
@@ -301,6 +426,9 @@ class WorkerThread {
     return worker_status_->ContinueRunningNoPause();
   }
 
+  // Whether the thread should pause at its next IsReadyToRun().
+  bool IsPauseRequested() { return worker_status_->PauseRequested(); }
+
   // These are functions used by the various work loops.
   // Pretty print and log a data miscompare.
   virtual void ProcessError(struct ErrorRecord *er, const char *message);
@@ -341,8 +469,16 @@ class WorkerThread {
   // Print out the error record of the tag mismatch.
   virtual void ProcessTagError(struct ErrorRecord *error, const char *message);
 
-  // A worker thread can yield itself to give up CPU until it's scheduled again
+  // A worker thread can yield itself to give up CPU until it's scheduled
+  // again, as yield_policy_ allows.
   bool YieldSelf();
+  // Spend 'bytes' of this thread's budget, if it has one, sleeping until the
+  // budget allows it.  The sleep is cut short if the thread must stop or
+  // pause.
+  void Throttle(int64 bytes);
+  // Sleep for 'wait_ns', or until the thread must stop or pause.  Returns
+  // the time slept, in nanoseconds.
+  int64 ThrottleSleep(int64 wait_ns);
 
   void AddLog(ocpdiag::results::LogSeverity severity, const string &message);
 
@@ -351,12 +487,22 @@ class WorkerThread {
   void AddDiagnosis(const string &verdict, ocpdiag::results::DiagnosisType type,
                     const string &message);
 
+  // Count errors found by this thread, and report them to the Sat so it can
+  // stop the run early if needed.
+  void AddErrors(int64 count);
+
  protected:
   // General state variables that all subclasses need.
   int thread_num_;               // Thread ID.
   volatile bool status_;         // Error status.
-  volatile int64 pages_copied_;  // Recorded for memory bandwidth calc.
+  // Recorded for memory bandwidth calc, and read by the auto tuning sweep
+  // while the thread runs.
+  std::atomic<int64> pages_copied_;
   volatile int64 errorcount_;    // Miscompares seen by this thread.
+  volatile int64 iterations_;    // Work loop iterations completed.
+  int64 yield_syscalls_;         // sched_yield() calls made.
+  YieldPolicy yield_policy_;     // What YieldSelf() does.
+  TokenBucket *budget_;          // Memory traffic budget, or NULL.
 
   cpu_set_t cpu_mask_;   // Cores this thread is allowed to run on.
   volatile uint32 tag_;  // Tag hint for memory this thread can use.
@@ -590,14 +736,20 @@ class FillThread : public WorkerThread {
 // then it will check and discard pages until no more remain.
 class CheckThread : public WorkerThread {
  public:
-  CheckThread() {}
+  CheckThread() : final_checked_(0), final_skipped_(0) {}
   virtual bool Work();
   // Calculate worker thread specific bandwidth.
   virtual float GetMemoryCopiedData() { return GetCopiedData(); }
+  // Pages checked once stopped, and pages skipped then because they were
+  // already checked since their last write.
+  int64 GetFinalPagesChecked() const { return final_checked_; }
+  int64 GetFinalPagesSkipped() const { return final_skipped_; }
 
   string GetThreadTypeName() { return "Memory Page Check Thread"; }
 
  private:
+  int64 final_checked_;
+  int64 final_skipped_;
   DISALLOW_COPY_AND_ASSIGN(CheckThread);
 };
 
@@ -667,14 +819,35 @@ class DiskThread : public WorkerThread {
                              int blocks_per_segment, int64 read_threshold,
                              int64 write_threshold, int non_destructive);
 
+  // Engines used to read and write the device.
+  enum IoEngine {
+    kIoEngineAuto = 0,  // io_uring when the kernel supports it, else AIO.
+    kIoEngineAio,       // Linux native AIO, one request at a time.
+    kIoEngineUring,     // io_uring, with several requests in flight.
+  };
+  // Select the I/O engine, how many requests it keeps in flight and how
+  // many queued requests are handed to the kernel at once.
+  virtual bool SetIoEngine(int io_engine, int queue_depth, int submit_batch);
+  // Overlap writes and verification instead of alternating between them.
+  void SetPipeline(bool pipeline) { pipeline_ = pipeline; }
+  // Limit requests and bytes per second, for all the threads of the device
+  // through 'device_iops' and 'device_bytes', which may be NULL, and for
+  // this thread alone through 'thread_iops' and 'thread_bytes_per_second'
+  // unless they are 0.
+  void SetRateLimits(TokenBucket *device_iops, TokenBucket *device_bytes,
+                     int64 thread_iops, int64 thread_bytes_per_second);
+  // Seconds between latency summaries, 0 for a summary at the end only.
+  void SetLatencyInterval(int seconds) {
+    latency_interval_ = seconds > 0 ? seconds * 1000000LL : 0;
+  }
+
   virtual bool Work();
 
   virtual float GetMemoryCopiedData() { return 0; }
 
  protected:
-  static const int kSectorSize = 512;       // Size of sector on disk.
-  static const int kBufferAlignment = 512;  // Buffer alignment required by the
-                                            // kernel.
+  static const int kDefaultSectorSize = 512;  // Sector size assumed until
+                                              // the device reports its own.
   static const int kBlockRetry = 100;       // Number of retries to allocate
                                             // sectors.
 
@@ -687,13 +860,22 @@ class DiskThread : public WorkerThread {
 
   // Retrieves the size (in bytes) of the disk/file.
   virtual bool GetDiskSize(int fd);
+  // Query the logical and physical sector sizes of a block device.
+  void GetSectorSizes(int fd);
+  // Check the read and write block sizes against the sector sizes.
+  bool CheckBlockSizes();
 
   // Retrieves the current time in microseconds.
   virtual int64 GetTime();
 
-  // Do an asynchronous disk I/O operation.
+  // Allocate a block buffer aligned for direct I/O.  Return the error
+  // code of the allocation, 0 on success.
+  virtual int AllocateBlockBuffer(void **buffer);
+
+  // Do an asynchronous disk I/O operation.  'block' is the block being
+  // written, kept from being reused if the write times out.
   virtual bool AsyncDiskIO(IoOp op, int fd, void *buf, int64 size, int64 offset,
-                           int64 timeout);
+                           int64 timeout, BlockData *block);
 
   // Write a block to disk.
   virtual bool WriteBlockToDisk(int fd, BlockData *block);
@@ -704,8 +886,125 @@ class DiskThread : public WorkerThread {
   // Main work loop.
   virtual bool DoWork(int fd);
 
+  // Allocate the next block, write it and queue it for verification.
+  virtual bool WriteNewBlock(int fd, int64 *block_num, int64 num_segments);
+
+  // Verify the oldest block written.
+  virtual bool VerifyOldestBlock(int fd);
+
+  // Evict the blocks written since the last call from the page cache.
+  virtual bool FlushWrittenBlocks(int fd);
+
+  // Check out a valid test memory page to write a block straight from.
+  virtual bool GetBlockPage(BlockData *block, struct page_entry *pe);
+
+  // Fill a buffer with a random pattern for a block about to be written.
+  virtual void FillBlockBuffer(void *buf, BlockData *block);
+
+  // Mark every sector of a read buffer with data that can't be expected.
+  virtual void PoisonReadBuffer(void *buf, BlockData *block, int64 size,
+                                int64 pattern_offset);
+
+  // Count the latency of a completed request at byte 'offset', reporting
+  // it if it is over the threshold, and the latency summaries when due.
+  virtual void RecordLatency(IoOp op, int64 latency, int64 offset);
+  // Log the latencies since the last summary, or record the latencies of
+  // the whole run as measurements if 'final' is set.
+  virtual void ReportLatency(bool final);
+
+  // Wait until the rate limits, and any backoff, allow a request of
+  // 'bytes' to be submitted.
+  virtual void ThrottleRequest(int64 bytes);
+  // Back off after a request that timed out or took longer than its
+  // threshold, or ease off the backoff after one that did not.  A write
+  // thread stops at its first failed request, timeouts included, so only
+  // random threads back off from timeouts.
+  virtual void AdjustBackoff(bool slow);
+
+  // Split the device into the regions of the latency heatmap.
+  virtual void SetupHeatmap();
+  // Count an error in the heatmap region holding byte 'offset'.
+  virtual void CountRegionError(int64 offset);
+  // Record the latency and error totals of every region as a measurement.
+  virtual void ReportHeatmap();
+
+  // Report a failed or short I/O operation.
+  virtual void ReportIOError(IoOp op, int64 offset, int64 result);
+
+#ifdef HAVE_LIBAIO_H
+  // Set up the AIO context and its request slots.
+  virtual bool SetupAio();
+  // Wait for outstanding requests, then release the AIO context.
+  virtual void DestroyAio();
+  // Return a free AIO request slot, waiting up to 'timeout' us for a
+  // timed out request to complete if needed.  Return -1 if none is free.
+  virtual int GetAioRequest(int64 timeout);
+  // Wait up to 'timeout' us, forever if negative, for at least
+  // 'min_events' AIO completions and process them.  Return the number
+  // processed, or a negative error code.
+  virtual int ReapAio(int min_events, int64 timeout);
+  // Give up waiting on a request, leaving it in its slot to be reaped
+  // whenever it completes.
+  virtual void AbandonAioRequest(int slot, BlockData *block);
+  // Release what an AIO request held and free its slot.
+  virtual void FreeAioRequest(int slot);
+#endif
+
+  // Set up the io_uring engine on the device.  Return false if it is not
+  // usable, in which case AIO is used unless io_uring was asked for.
+  virtual bool SetupRing(int fd);
+
+  // Return a free request slot, waiting for one to complete if needed.
+  // Return -1 if a request failed.
+  virtual int GetRingSlot();
+
+  // Queue a request on the ring, handing the kernel a batch when full.
+  // Writes from a test memory 'page' return it once complete.
+  virtual bool QueueRingRequest(int slot, IoOp op, BlockData *block,
+                                int64 block_offset, int64 size,
+                                int64 block_op, struct page_entry *page);
+
+  // Queue the write of a block on the ring.
+  virtual bool QueueBlockWrite(BlockData *block);
+
+  // Queue the reads verifying a block on the ring.
+  virtual bool QueueBlockValidate(BlockData *block);
+
+  // Submit queued requests and process their completions until no more
+  // than 'max_in_flight' are outstanding.  Return false if a request failed.
+  virtual bool ReapRing(int max_in_flight);
+
+  // Check the result of a completed request and free its slot.
+  virtual void CompleteRingRequest(int slot, int result);
+
+  // Drop one outstanding request of a block operation, calling
+  // RingBlockDone when it was the last one.
+  virtual void ReleaseRingBlockOp(int64 block_op, BlockData *block, IoOp op);
+
+  // Called once all the requests queued for a block have completed.
+  virtual void RingBlockDone(BlockData *block, IoOp op);
+
+  // A request on the io_uring engine, indexed by its buffer slot.
+  struct RingRequest {
+    IoOp op;
+    BlockData *block;    // Block being read or written.
+    int64 block_offset;  // Offset of the request in the block, in bytes.
+    int64 size;          // Size of the request, in bytes.
+    int64 submit_time;   // Time the kernel was handed the request, in us.
+    int64 block_op;      // Key of the block operation in ring_block_ops_.
+    bool has_page;       // Whether the data comes from 'page'.
+    struct page_entry page;  // Test memory page written from.
+  };
+
   int read_block_size_;     // Size of blocks read from disk, in bytes.
   int write_block_size_;    // Size of blocks written to disk, in bytes.
+  bool read_block_size_set_;   // Block sizes were given, rather than
+  bool write_block_size_set_;  // left to the defaults.
+  int sector_size_;         // Logical sector size of the device, in bytes.
+                            // Block addresses are counted in these.
+  int physical_sector_size_;  // Smallest write the device does without a
+                              // read-modify-write cycle, in bytes.
+  int buffer_alignment_;    // I/O buffer alignment needed by O_DIRECT.
   int64 blocks_read_;       // Number of blocks read in work loop.
   int64 blocks_written_;    // Number of blocks written in work loop.
   int64 segment_size_;      // Size of disk segments (in bytes) that the disk
@@ -719,6 +1018,8 @@ class DiskThread : public WorkerThread {
   int cache_size_;          // Size of disk cache, in bytes.
   int queue_size_;          // Length of in-flight-blocks queue, in blocks.
   int non_destructive_;     // Use non-destructive mode or not.
+  bool pipeline_;           // Overlap writes and verification.
+  bool direct_io_;          // Whether the device was opened with O_DIRECT.
   int update_block_table_;  // If true, assume this is the thread
                             // responsible for writing the data in the disk
                             // for this block device and, therefore,
@@ -738,19 +1039,83 @@ class DiskThread : public WorkerThread {
   string device_name_;    // Name of device file to access.
   int64 device_sectors_;  // Number of sectors on the device.
 
-  std::unique_ptr<ocpdiag::results::MeasurementSeries>
-      read_times_;  // Measurement series for storing disk read times
-  std::unique_ptr<ocpdiag::results::MeasurementSeries>
-      write_times_;  // Measurement series for storing disk write times
+  LatencyHistogram read_latency_;   // Request latencies over the run, in us.
+  LatencyHistogram write_latency_;
+  LatencyHistogram interval_read_latency_;   // Request latencies since the
+  LatencyHistogram interval_write_latency_;  // last summary, in us.
+  int64 latency_interval_;     // Time between summaries in us, 0 for none.
+  int64 last_latency_report_;  // Time of the last summary.
+
+  // Latency and error totals of one region of the device.
+  struct RegionStats {
+    int64 reads;       // Requests completed.
+    int64 read_time;   // Sum of their latencies, in us.
+    int64 read_max;    // Worst of their latencies, in us.
+    int64 writes;
+    int64 write_time;
+    int64 write_max;
+    int64 errors;      // Failed requests and miscompares.
+  };
+  // Most regions kept, when segments are smaller than the device split
+  // into as many regions.
+  static const int kMaxHeatmapRegions = 1024;
+  // Regions used when the device is tested as a single segment.
+  static const int kDefaultHeatmapRegions = 64;
+  std::vector<RegionStats> heatmap_;  // Totals per region, in disk order.
+  int64 heatmap_region_size_;         // Size of a region, in bytes.
+
+  TokenBucket *device_iops_budget_;  // Limits shared with the other threads
+  TokenBucket *device_byte_budget_;  // of the device, or NULL.
+  std::unique_ptr<TokenBucket> thread_iops_budget_;  // Limits of this
+  std::unique_ptr<TokenBucket> thread_byte_budget_;  // thread, or NULL.
+  int64 backoff_ns_;    // Pause before each request, after slow ones.
+  int64 backoffs_;      // Times a slow request lengthened the pause.
+  int64 throttled_ns_;  // Time spent waiting on limits and backoff.
+  int64 unflushed_start_;  // Span of the device written since the page
+  int64 unflushed_end_;    // cache was last flushed, in bytes, 0 if none.
 
   std::queue<BlockData *> in_flight_sectors_;  // Queue of sectors written but
                                                // not verified.
   void *block_buffer_;  // Pointer to aligned block buffer.
 
 #ifdef HAVE_LIBAIO_H
+  // A Linux native AIO request, found from its completion by the slot
+  // number kept in its iocb.  A request that times out keeps its slot,
+  // and whatever it points to, until its completion is reaped.
+  struct AioRequest {
+    struct iocb cb;
+    bool in_flight;    // Submitted and not yet reaped.
+    bool timed_out;    // Given up on, left to be reaped later.
+    int64 result;      // Byte count or negative error code, once reaped.
+    int64 submit_time;
+    BlockData *block;  // Written block whose sectors are held, or NULL.
+    void *buffer;      // Read buffer to free once reaped, or NULL.
+  };
+  // Requests the context holds at once.  All but one of them can only be
+  // requests that timed out.
+  static const int kAioRequests = 32;
+
   io_context_t aio_ctx_;  // Asynchronous I/O context for Linux native AIO.
+  std::vector<AioRequest> aio_requests_;  // Request slots.
+  std::vector<int> aio_free_requests_;    // Slots not in flight.
+  int64 aio_abandoned_;  // Requests that timed out, over the run.
+  int64 aio_late_;       // Of those, the ones reaped later.
 #endif
 
+  int io_engine_;          // IoEngine asked for.
+  int queue_depth_;        // Maximum requests in flight on the ring.
+  int submit_batch_;       // Queued requests handed to the kernel at once.
+  bool use_ring_;          // Whether the ring is used for this run.
+  bool ring_failed_;       // A request on the ring failed.
+  IoRing ring_;            // io_uring instance for the device.
+  char *ring_buffers_;     // One aligned buffer per request slot.
+  int64 ring_slot_size_;   // Size of each request buffer, in bytes.
+  std::vector<RingRequest> ring_requests_;  // Requests, by slot.
+  std::vector<int> ring_free_slots_;        // Slots with no request.
+  std::vector<int> ring_unsubmitted_;       // Slots queued, not submitted.
+  int64 ring_next_block_op_;                // Key for the next block op.
+  std::map<int64, int> ring_block_ops_;     // Requests left per block op.
+
   DiskBlockTable *block_table_;  // Disk Block Table, shared by all disk
                                  // threads that read / write at the same
                                  // device
@@ -768,6 +1133,8 @@ class RandomDiskThread : public DiskThread {
  protected:
   string GetThreadTypeName() { return "Random Disk Test Thread"; }
 
+  virtual void RingBlockDone(BlockData *block, IoOp op);
+
   DISALLOW_COPY_AND_ASSIGN(RandomDiskThread);
 };
 